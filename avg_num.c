@@ -61,4 +61,15 @@ void avg_num_clear(avg_num_t * num)
 		num->values[i] = 0;
 	}
 	num->avg = num->idx = num->used = 0;
-}
\ No newline at end of file
+}
+
+/**
+ * Free the values of the average number. The structure itself
+ * is not freed.
+ */
+void avg_num_free(avg_num_t * num)
+{
+	free(num->values);
+	num->values = NULL;
+	num->length = 0;
+}
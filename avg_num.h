@@ -13,6 +13,7 @@ typedef struct avg_num {
 void avg_num_create(avg_num_t * num, int length);
 int avg_num_add(avg_num_t * num, int n);
 void avg_num_clear(avg_num_t * num);
+void avg_num_free(avg_num_t * num);
 
 #endif 
 
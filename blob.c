@@ -0,0 +1,190 @@
+
+#include "common.h"
+#include "blob.h"
+
+#include <string.h>
+
+/**
+ * Find the run a run is connected to, halving the path on the way.
+ */
+static int find_root(blob_run_t * runs, int i)
+{
+	while (runs[i].parent != i)
+	{
+		runs[i].parent = runs[runs[i].parent].parent;
+		i = runs[i].parent;
+	}
+	return i;
+}
+
+static void join(blob_run_t * runs, int a, int b)
+{
+	a = find_root(runs, a);
+	b = find_root(runs, b);
+
+	// The lowest index becomes the root, so the roots of a row are
+	// always found before its other runs
+	if (a < b)
+	{
+		runs[b].parent = a;
+	}
+	else if (b < a)
+	{
+		runs[a].parent = b;
+	}
+}
+
+/**
+ * Record the runs of line pixels of a row.
+ *
+ * \return Number of runs in total, or -1 if there is no room left
+ */
+static int row_runs(const unsigned char * row, int y, blob_run_t * runs,
+	int n)
+{
+	int x = 0, start;
+
+	while (x < WIDTH)
+	{
+		while (x < WIDTH && row[x] != LINE)
+		{
+			x++;
+		}
+		if (x == WIDTH)
+		{
+			break;
+		}
+
+		start = x;
+		while (x < WIDTH && row[x] == LINE)
+		{
+			x++;
+		}
+
+		if (n == BLOB_MAX_RUNS)
+		{
+			return -1;
+		}
+		runs[n].y = y;
+		runs[n].start = start;
+		runs[n].end = x - 1;
+		runs[n].parent = n;
+		n++;
+	}
+	return n;
+}
+
+/**
+ * Label the connected regions of line pixels in rows `start` to `end` of
+ * the binary image, and remove the regions smaller than `min_area` pixels
+ * (specks and reflections) from the image.
+ *
+ * The rows are run-length encoded, and runs overlapping a run of the row
+ * above (including diagonally) are joined with union-find. At most
+ * BLOB_MAX_RUNS runs are labelled; the rows after that are not touched.
+ *
+ * \param bin Binary image
+ * \param start First row
+ * \param end Row after the last row
+ * \param min_area Smallest region kept
+ * \param work Working memory
+ * \param largest The largest region (area 0 if there is none)
+ * \return Number of regions kept
+ */
+int blob_detect(unsigned char * bin, int start, int end, int min_area,
+	blob_work_t * work, blob_t * largest)
+{
+	blob_run_t * runs = work->runs;
+	blob_run_t * r;
+	blob_t * b;
+	int y, n = 0, above, above_end, row, i, j, root, w, count = 0;
+
+	memset(largest, 0, sizeof(blob_t));
+
+	if (start < 0) start = 0;
+	if (end > HEIGHT) end = HEIGHT;
+
+	above = above_end = 0;
+	for (y = start; y < end; y++)
+	{
+		row = n;
+		n = row_runs(bin + INDEX(y), y, runs, n);
+		if (n < 0)
+		{
+			n = row;
+			break;
+		}
+
+		// Join with the overlapping runs of the row above
+		i = above;
+		for (j = row; j < n; j++)
+		{
+			while (i < above_end && runs[i].end + 1 < runs[j].start)
+			{
+				i++;
+			}
+			for (w = i; w < above_end && runs[w].start <= runs[j].end + 1;
+				w++)
+			{
+				join(runs, w, j);
+			}
+		}
+
+		above = row;
+		above_end = n;
+	}
+
+	// Area, bounding box and centroid of each region, kept in the slot
+	// of its root
+	for (i = 0; i < n; i++)
+	{
+		r = &runs[i];
+		root = find_root(runs, i);
+		b = &work->blobs[root];
+		w = r->end - r->start + 1;
+
+		if (root == i)
+		{
+			b->area = 0;
+			b->left = r->start;
+			b->right = r->end;
+			b->top = r->y;
+			b->x = b->y = 0;
+		}
+		b->area += w;
+		b->x += (r->start + r->end) * w;
+		b->y += r->y * w;
+		if (r->start < b->left) b->left = r->start;
+		if (r->end > b->right) b->right = r->end;
+		b->bottom = r->y;
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		r = &runs[i];
+		root = find_root(runs, i);
+		b = &work->blobs[root];
+
+		if (b->area < min_area)
+		{
+			memset(bin + INDEX2(r->start, r->y), FLOOR, r->end - r->start + 1);
+		}
+		else if (root == i)
+		{
+			count++;
+			if (b->area > largest->area)
+			{
+				*largest = *b;
+			}
+		}
+	}
+
+	if (largest->area > 0)
+	{
+		// The column sums are of twice the run centers
+		largest->x /= 2 * largest->area;
+		largest->y /= largest->area;
+	}
+	return count;
+}
+
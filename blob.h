@@ -0,0 +1,43 @@
+
+#ifndef _BLOB_H_
+#define _BLOB_H_
+
+#include "common.h"
+
+/**
+ * Largest number of line runs labelled in a frame. Rows beyond the limit
+ * are left as they are.
+ */
+#define BLOB_MAX_RUNS			4096
+
+/**
+ * A connected region of line pixels (8-connected), with its bounding box
+ * and centroid in pixels
+ */
+typedef struct blob {
+	int area;
+	int left, top, right, bottom;
+	int x, y;
+} blob_t;
+
+/**
+ * A horizontal run of line pixels and the run it is connected to
+ */
+typedef struct blob_run {
+	short y, start, end;
+	short parent;
+} blob_run_t;
+
+/**
+ * Working memory of blob_detect
+ */
+typedef struct blob_work {
+	blob_run_t runs[BLOB_MAX_RUNS];
+	blob_t blobs[BLOB_MAX_RUNS];
+} blob_work_t;
+
+int blob_detect(unsigned char * bin, int start, int end, int min_area,
+	blob_work_t * work, blob_t * largest);
+
+#endif
+
@@ -1,40 +1,195 @@
 
 #include "common.h"
 #include "broadcast.h"
+#include "telemetry.h"
+#include "encoding.h"
+#include "remote.h"
+#include "timer.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 #include <netdb.h>
 
 #define	PORT 				24000
 #define SOCKET_ERROR        -1
-#define BUFFER_SIZE         100
 #define QUEUE_SIZE          5
 
+/**
+ * Number of viewers served at the same time
+ */
+#define MAX_CLIENTS			8
+
+/**
+ * Frames queued per client. When a client falls further behind, its
+ * oldest queued frame is dropped.
+ */
+#define CLIENT_QUEUE		3
+
+/**
+ * Frames in the pool: every client queue full, the delta base of each
+ * client and the frame being filled from the vision thread
+ */
+#define POOL_SIZE			(MAX_CLIENTS * CLIENT_QUEUE + MAX_CLIENTS + 1)
+
+/**
+ * Distinct subscriptions served from one frame. A client needs at most
+ * its own and, for deltas, the keyframe it falls back to.
+ */
+#define MAX_VARIANTS		(2 * MAX_CLIENTS)
+
+/**
+ * Space in each frame for the encoded payloads of its variants. A payload
+ * that doesn't fit is sent as the whole raw image.
+ */
+#define ARENA_SIZE			(IMAGE_PIXELS / 2)
+
+/**
+ * Subscription used until the client asks for something else: every 
+ * third frame, whole and raw, with the result
+ */
+#define DEFAULT_DIVISOR		3
+
+/**
+ * Largest run-length or delta encoding of an image with the given number
+ * of pixels. Images that don't compress to this size are sent raw.
+ */
+#define ENCODED_MAX(p)		((p) / 4)
+
+/**
+ * Room for the responses to commands waiting to be sent to a client
+ */
+#define REPLY_SLOTS			128
+#define REPLY_BUFFER		(REPLY_SLOTS * sizeof(telemetry_reply_t))
+
+/**
+ * epoll tags of the server socket, the wake-up eventfd and the remote
+ * control responses (clients are tagged with their index)
+ */
+/**
+ * Socket send buffer of a client: about one raw frame (the kernel doubles
+ * the value set). A viewer that falls behind fills its queue, where the
+ * oldest frames are dropped, instead of kernel buffers that hold seconds
+ * of stale frames.
+ */
+#define SEND_BUFFER			((IMAGE_PIXELS + (int) sizeof(telemetry_packet_t)) / 2)
+
+#define TAG_SERVER			-1
+#define TAG_WAKEUP			-2
+#define TAG_REMOTE			-3
+
+/**
+ * Set in `middle` when the slot holds a frame the server hasn't taken
+ */
+#define SLOT_FRESH			4
+
 typedef struct broadcast_packet {
 	int l_x, l_y, u_x, u_y;
 	int error_lower;
 	int error_upper;
 	int mass;
+	unsigned int seq;
+	long long timestamp_us;
 	unsigned char * frame;
 } broadcast_packet_t;
 
 /**
- * Mutex for locking access to the frame buffer
+ * What a client subscribed to (see telemetry_subscription_t). The region
+ * is clipped to the image, and is 0 x 0 without the image.
+ */
+typedef struct subscription {
+	int divisor;
+	int encoding;
+	int fields;
+	int x, y, width, height;
+} subscription_t;
+
+/**
+ * The frame as sent for one subscription
  */
-static pthread_mutex_t frame_buffer_mtx;
+typedef struct variant {
+	subscription_t sub;
+	// Deltas: the frame the delta is against (-1 if there is no delta),
+	// and the keyframe variant sent to clients that don't have it
+	long base_seq;
+	int keyframe;
+	telemetry_packet_t packet;
+	const unsigned char * payload;
+} variant_t;
 
 /**
- * Condition variable for signaling frame ready
+ * A frame ready to be sent. Frames are never changed after they are
+ * queued, so all clients send from the same frame. The frame returns to
+ * the pool when the last client is done with it.
+ *
+ * The frame is prepared once for each distinct subscription (a variant),
+ * and the variant is shared by all clients with that subscription.
  */
-static pthread_cond_t frame_buffer_cv;
+typedef struct frame {
+	int refs;
+	unsigned int seq;
+	// Packet with the result of the frame, the template of the variants
+	telemetry_packet_t base;
+	int n_variants;
+	variant_t variants[MAX_VARIANTS];
+	// Encoded payloads of the variants
+	int arena_used;
+	unsigned char arena[ARENA_SIZE];
+	unsigned char data[IMAGE_PIXELS];
+} frame_t;
+
+/**
+ * A frame queued for a client, and the variant the client gets
+ */
+typedef struct entry {
+	frame_t * frame;
+	int variant;
+} entry_t;
+
+typedef struct client {
+	int fd;
+	struct sockaddr_in addr;
+	// Queued frames, oldest first. The first frame may be partly sent.
+	entry_t queue[CLIENT_QUEUE];
+	int head, count;
+	// Bytes of the first queued frame sent so far, and the variant sent
+	uint32_t offset;
+	int current;
+	subscription_t sub;
+	// Last frame whose image was sent completely (-1: none)
+	long last_seq;
+	// Received data not yet parsed as requests
+	unsigned char rx[TELEMETRY_MAX_REQUEST];
+	int rx_size;
+	// Responses to commands, sent between two frames
+	unsigned char reply[REPLY_BUFFER];
+	int reply_size, reply_sent;
+	// Responses waiting to be sent plus those still to come from the
+	// vision thread. A command is only accepted when the buffer has room
+	// for all of its responses; when it is full, requests are left 
+	// unread until responses have been sent.
+	int reply_slots;
+	// Tells the client apart from earlier ones in the same slot
+	unsigned int generation;
+	// Events waited for on the socket: readable while there is room for
+	// responses, writable while there is something to send
+	unsigned int events;
+	unsigned long sent, dropped;
+	unsigned long long bytes;
+	// Frames queued when the last frame was added, and the worst seen
+	int lag, max_lag;
+} client_t;
 
 /**
  * Server thread
@@ -42,115 +197,1020 @@ static pthread_cond_t frame_buffer_cv;
 static pthread_t thread;
 
 /**
- * Structure with data to broadcast.
+ * Triple buffer handing packets from broadcast_send to the server thread.
+ * broadcast_send fills slot `back` and swaps it with `middle`; the server
+ * swaps `middle` with `front` when it is fresh and sends from there.
+ * Each side owns its own slot, so neither ever waits for the other, and
+ * the server always gets the most recent complete packet.
  */
-static broadcast_packet_t packet;
+static broadcast_packet_t slots[3];
+static int back = 0, middle = 1, front = 2;
+
+/**
+ * Packets replaced by a newer one before the server took them
+ */
+static unsigned long skipped;
+
+static frame_t * pool;
+static client_t clients[MAX_CLIENTS];
 
+/**
+ * Last frame published for each divisor clients receive deltas at, the
+ * base of their next delta
+ */
+static struct {
+	int divisor;
+	frame_t * frame;
+} bases[MAX_CLIENTS];
+
+/**
+ * Greatest common divisor of the subscribed divisors (0: nobody wants a
+ * frame), read by broadcast_divisor
+ */
+static int divisor;
+
+/**
+ * Frames published, and variants prepared for them
+ */
+static unsigned long published, prepared;
+
+/**
+ * Cropped region of the frame and of the delta base (server thread)
+ */
+static unsigned char crop_image[IMAGE_PIXELS];
+static unsigned char crop_base[IMAGE_PIXELS];
+
+/**
+ * Clients accepted so far
+ */
+static unsigned int generations;
+
+/**
+ * Set once the server thread runs; frames are only taken while it does
+ */
+static int enabled = 0;
 
 static int port;
-static int socket_fd;
-static int server_socket_fd; 
-static int addr_size = sizeof(struct sockaddr_in);
-static struct hostent * host;   
-static struct sockaddr_in addr; 
+static int server_socket_fd = -1;
+static int epoll_fd = -1;
+static int wakeup_fd = -1;
+static struct sockaddr_in addr;
+
+static int set_nonblocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void watch(int fd, int tag, int op, unsigned int events)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.u32 = (unsigned int) tag;
+	epoll_ctl(epoll_fd, op, fd, &ev);
+}
+
+static frame_t * frame_get()
+{
+	int i;
+
+	for (i = 0; i < POOL_SIZE; i++)
+	{
+		if (pool[i].refs == 0)
+		{
+			pool[i].refs = 1;
+			return &pool[i];
+		}
+	}
+	return NULL;
+}
+
+static void frame_put(frame_t * frame)
+{
+	frame->refs--;
+}
+
+static const char * encoding_names[TELEMETRY_ENCODINGS] = {
+	"raw",
+	"bits",
+	"rle",
+	"delta"
+};
+
+static void update_divisor();
+static void client_requests(client_t * c);
+
+static void client_close(client_t * c)
+{
+	printf("[broadcast] Client %s disconnected (%lu sent, %lu dropped, "
+		"max lag %d)\n", inet_ntoa(c->addr.sin_addr), c->sent, c->dropped,
+		c->max_lag);
+
+	while (c->count > 0)
+	{
+		frame_put(c->queue[c->head].frame);
+		c->head = (c->head + 1) % CLIENT_QUEUE;
+		c->count--;
+	}
+
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	c->fd = -1;
+	update_divisor();
+}
+
+/**
+ * Pick the variant of the frame to send. A delta is only sent when the 
+ * client has the frame it is against, otherwise the keyframe is sent.
+ */
+static int choose_variant(const client_t * c, const entry_t * e)
+{
+	const variant_t * v = &e->frame->variants[e->variant];
+
+	if (v->sub.encoding == TELEMETRY_DELTA 
+		&& (v->base_seq < 0 || v->base_seq != c->last_seq))
+	{
+		return v->keyframe;
+	}
+	return e->variant;
+}
+
+/**
+ * Send the responses waiting. Returns 1 if they were all sent, 0 if the
+ * socket is full and -1 if the connection is broken.
+ */
+static int client_send_replies(client_t * c)
+{
+	ssize_t n;
+
+	while (c->reply_sent < c->reply_size)
+	{
+		n = send(c->fd, c->reply + c->reply_sent, 
+			c->reply_size - c->reply_sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				return 0;
+			}
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+		c->reply_sent += n;
+	}
+
+	c->reply_slots -= c->reply_size / sizeof(telemetry_reply_t);
+	c->reply_size = c->reply_sent = 0;
+	return 1;
+}
+
+/**
+ * Send queued frames until the queue is empty or the socket is full.
+ * Responses go out first, but never in the middle of a frame.
+ * Returns -1 if the connection is broken.
+ */
+static int client_flush(client_t * c, int index)
+{
+	const entry_t * e;
+	const variant_t * v;
+	unsigned int events;
+	ssize_t n;
+	int ret;
+
+	while (1)
+	{
+		if (c->offset == 0 && c->reply_size > 0)
+		{
+			ret = client_send_replies(c);
+			if (ret < 0)
+			{
+				return -1;
+			}
+			if (ret == 0)
+			{
+				break;
+			}
+			// Requests left unread for want of room can go on now
+			if (c->rx_size > 0)
+			{
+				client_requests(c);
+				continue;
+			}
+		}
+		if (c->count == 0)
+		{
+			break;
+		}
+
+		e = &c->queue[c->head];
+
+		if (c->offset == 0)
+		{
+			c->current = choose_variant(c, e);
+		}
+		v = &e->frame->variants[c->current];
+
+		n = telemetry_send_from(c->fd, &v->packet, v->payload, c->offset, 
+			MSG_DONTWAIT);
+		if (n < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				break;
+			}
+			return -1;
+		}
+
+		c->offset += n;
+		c->bytes += n;
+		if (c->offset == v->packet.header.length)
+		{
+			if (v->payload != NULL)
+			{
+				c->last_seq = e->frame->seq;
+			}
+			frame_put(e->frame);
+			c->head = (c->head + 1) % CLIENT_QUEUE;
+			c->count--;
+			c->offset = 0;
+			c->sent++;
+		}
+	}
+
+	// Only wait for the socket to become writable while there is
+	// something left to send
+	events = (c->reply_slots < REPLY_SLOTS ? EPOLLIN : 0)
+		| (c->count > 0 || c->reply_size > 0 ? EPOLLOUT : 0);
+	if (events != c->events)
+	{
+		c->events = events;
+		watch(c->fd, index, EPOLL_CTL_MOD, events);
+	}
+
+	return 0;
+}
+
+/**
+ * Add a response to the ones waiting to be sent to the client. A slot
+ * must have been taken for it (reply_slots), so it always fits.
+ */
+static void client_respond(client_t * c, const telemetry_response_t * response)
+{
+	telemetry_reply_t reply;
+
+	if (c->reply_size + sizeof(reply) > sizeof(c->reply))
+	{
+		return;
+	}
+
+	memset(&reply.header, 0, sizeof(reply.header));
+	reply.header.magic = TELEMETRY_RESPONSE_MAGIC;
+	reply.header.version = TELEMETRY_VERSION;
+	reply.header.length = sizeof(reply);
+	reply.header.timestamp_us = timer_now_us();
+	reply.response = *response;
+
+	memcpy(c->reply + c->reply_size, &reply, sizeof(reply));
+	c->reply_size += sizeof(reply);
+}
+
+/**
+ * Route the responses of the vision thread to their clients
+ */
+static void send_replies()
+{
+	remote_reply_t reply;
+	client_t * c;
+	int i;
+
+	while (remote_next_reply(&reply))
+	{
+		c = &clients[reply.client];
+		// The client may have gone away, and its slot been reused
+		if (c->fd >= 0 && c->generation == reply.generation)
+		{
+			client_respond(c, &reply.response);
+		}
+	}
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+	{
+		if (clients[i].fd >= 0 && clients[i].reply_size > 0
+			&& client_flush(&clients[i], i) < 0)
+		{
+			client_close(&clients[i]);
+		}
+	}
+}
+
+/**
+ * Queue a variant of a frame for the client. If the queue is full, the
+ * oldest frame that hasn't been started on is dropped.
+ */
+static void client_queue(client_t * c, frame_t * frame, int variant)
+{
+	int drop;
+
+	if (c->count == CLIENT_QUEUE)
+	{
+		// Never drop a frame that is partly sent, it would break the
+		// stream
+		drop = c->offset > 0 ? 1 : 0;
+
+		frame_put(c->queue[(c->head + drop) % CLIENT_QUEUE].frame);
+		for (; drop < c->count - 1; drop++)
+		{
+			c->queue[(c->head + drop) % CLIENT_QUEUE] =
+				c->queue[(c->head + drop + 1) % CLIENT_QUEUE];
+		}
+		c->count--;
+		c->dropped++;
+	}
+
+	frame->refs++;
+	c->queue[(c->head + c->count) % CLIENT_QUEUE].frame = frame;
+	c->queue[(c->head + c->count) % CLIENT_QUEUE].variant = variant;
+	c->count++;
+
+	c->lag = c->count;
+	if (c->lag > c->max_lag)
+	{
+		c->max_lag = c->lag;
+	}
+}
+
+static int gcd(int a, int b)
+{
+	int t;
+
+	while (b != 0)
+	{
+		t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/**
+ * Work out how often the vision thread has to hand over a frame for all
+ * clients to get theirs, and which delta bases are still needed
+ */
+static void update_divisor()
+{
+	int d = 0, i, j;
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+	{
+		if (clients[i].fd >= 0 && clients[i].sub.fields != 0)
+		{
+			d = gcd(clients[i].sub.divisor, d);
+		}
+	}
+	__atomic_store_n(&divisor, d, __ATOMIC_RELAXED);
+
+	for (j = 0; j < MAX_CLIENTS; j++)
+	{
+		if (bases[j].frame == NULL)
+		{
+			continue;
+		}
+		for (i = 0; i < MAX_CLIENTS; i++)
+		{
+			if (clients[i].fd >= 0 
+				&& clients[i].sub.encoding == TELEMETRY_DELTA
+				&& clients[i].sub.divisor == bases[j].divisor)
+			{
+				break;
+			}
+		}
+		if (i == MAX_CLIENTS)
+		{
+			frame_put(bases[j].frame);
+			bases[j].frame = NULL;
+		}
+	}
+}
+
+/**
+ * Set the subscription of the client, clipping the region to the image
+ */
+static void subscribe(client_t * c, const telemetry_subscription_t * s)
+{
+	subscription_t * sub = &c->sub;
+
+	sub->divisor = s->divisor > 0 ? s->divisor : 1;
+	sub->encoding = s->encoding < TELEMETRY_ENCODINGS ? s->encoding 
+		: TELEMETRY_RAW;
+	sub->fields = s->fields & (TELEMETRY_FIELD_RESULT | TELEMETRY_FIELD_IMAGE);
+
+	if (sub->fields & TELEMETRY_FIELD_IMAGE)
+	{
+		sub->x = s->x < WIDTH ? s->x : WIDTH - 1;
+		sub->y = s->y < HEIGHT ? s->y : HEIGHT - 1;
+		sub->width = s->width == 0 || s->width > WIDTH - sub->x 
+			? WIDTH - sub->x : s->width;
+		sub->height = s->height == 0 || s->height > HEIGHT - sub->y 
+			? HEIGHT - sub->y : s->height;
+	}
+	else
+	{
+		sub->encoding = TELEMETRY_RAW;
+		sub->x = sub->y = sub->width = sub->height = 0;
+	}
+
+	// The next image is a keyframe
+	c->last_seq = -1;
+	update_divisor();
+}
+
+static void accept_clients()
+{
+	static const telemetry_subscription_t default_subscription = {
+		DEFAULT_DIVISOR, TELEMETRY_RAW, 
+		TELEMETRY_FIELD_RESULT | TELEMETRY_FIELD_IMAGE, 0, 0, 0, 0
+	};
+	struct sockaddr_in client_addr;
+	socklen_t addr_size;
+	int fd, i, nodelay = 1, sndbuf = SEND_BUFFER;
+
+	while (1)
+	{
+		addr_size = sizeof(client_addr);
+		fd = accept(server_socket_fd, (struct sockaddr *) &client_addr,
+			&addr_size);
+		if (fd < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			{
+				perror("[broadcast] accept()");
+			}
+			return;
+		}
+
+		for (i = 0; i < MAX_CLIENTS && clients[i].fd >= 0; i++);
+		if (i == MAX_CLIENTS)
+		{
+			printf("[broadcast] Too many clients, refusing %s\n",
+				inet_ntoa(client_addr.sin_addr));
+			close(fd);
+			continue;
+		}
+
+		set_nonblocking(fd);
+
+		// Send each packet right away instead of waiting for more data
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+		memset(&clients[i], 0, sizeof(client_t));
+		clients[i].fd = fd;
+		clients[i].addr = client_addr;
+		clients[i].generation = ++generations;
+		subscribe(&clients[i], &default_subscription);
+		clients[i].events = EPOLLIN;
+		watch(fd, i, EPOLL_CTL_ADD, EPOLLIN);
+
+		printf("[broadcast] Got connection from %s (client %d)\n",
+			inet_ntoa(client_addr.sin_addr), i);
+	}
+}
 
 /**
- * Signal handler for catching SIGPIPEs and friends.
- * Whenever the connection to the client is broken (the client closes the viewer),
- * and we are in the middle of writing to the socket, a SIGPIPE signal is raised.
+ * Hand a command to the vision thread. If it has too many commands 
+ * waiting already, or there is no room for all the responses to the
+ * command, it is refused right away.
  */
-static void signal_handler(int signal)
+static void client_command(client_t * c, const unsigned char * data)
 {
-	if (signal == SIGPIPE)
+	telemetry_response_t response;
+	remote_command_t command;
+	int n;
+
+	memcpy(&command.command, data, sizeof(command.command));
+	command.command.name[TELEMETRY_NAME_SIZE - 1] = '\0';
+	command.client = c - clients;
+	command.generation = c->generation;
+	command.received_us = timer_now_us();
+	n = remote_replies(&command.command);
+
+	if (c->reply_slots + n <= REPLY_SLOTS && remote_submit(&command) == 0)
 	{
-		printf("[broadcast] Connection to client lost - too bad\n");
+		c->reply_slots += n;
 	}
 	else
 	{
-		printf("Caught another signal, wierd?\n");
+		c->reply_slots++;
+		memset(&response, 0, sizeof(response));
+		response.id = command.command.id;
+		response.op = command.command.op;
+		response.status = TELEMETRY_ERR_BUSY;
+		client_respond(c, &response);
+	}
+}
+
+static void client_request(client_t * c, int type, 
+	const unsigned char * data, int size)
+{
+	telemetry_subscription_t sub;
+	uint16_t encoding;
+
+	switch (type)
+	{
+		case TELEMETRY_REQ_ENCODING:
+			if (size < (int) sizeof(encoding))
+			{
+				break;
+			}
+			memcpy(&encoding, data, sizeof(encoding));
+			if (encoding < TELEMETRY_ENCODINGS 
+				&& (c->sub.fields & TELEMETRY_FIELD_IMAGE))
+			{
+				c->sub.encoding = encoding;
+				c->last_seq = -1;
+				update_divisor();
+				printf("[broadcast] Client %s uses %s encoding\n", 
+					inet_ntoa(c->addr.sin_addr), encoding_names[encoding]);
+			}
+			break;
+
+		case TELEMETRY_REQ_SUBSCRIBE:
+			if (size < (int) sizeof(sub))
+			{
+				break;
+			}
+			memcpy(&sub, data, sizeof(sub));
+			subscribe(c, &sub);
+			printf("[broadcast] Client %s subscribed to every %d frame(s): "
+				"%s%s%dx%d at (%d, %d), %s encoding\n", 
+				inet_ntoa(c->addr.sin_addr), c->sub.divisor,
+				c->sub.fields & TELEMETRY_FIELD_RESULT ? "result, " : "",
+				c->sub.fields & TELEMETRY_FIELD_IMAGE ? "image " : "no image ",
+				c->sub.width, c->sub.height, c->sub.x, c->sub.y, 
+				encoding_names[c->sub.encoding]);
+			break;
+
+		case TELEMETRY_REQ_COMMAND:
+			if (size >= (int) sizeof(telemetry_command_t))
+			{
+				client_command(c, data);
+			}
+			break;
+
+		default:
+			printf("[broadcast] Unknown request %d from %s\n", type,
+				inet_ntoa(c->addr.sin_addr));
+			break;
 	}
 }
 
 /**
- * Send the given packet over the socket.
- * The fields are sent in the same order as defined in the struct.
- *
- * \param packet Struct with information to send
+ * Handle the complete requests in the receive buffer of the client. Data 
+ * that isn't a request is skipped. Stops when there is no room left for
+ * responses.
  */
-static int send_packet(const broadcast_packet_t * packet)
+static void client_requests(client_t * c)
 {
-	if (send(socket_fd, &packet->l_x, sizeof(packet->l_x), 0) < 0)
+	telemetry_request_t request;
+	int start = 0;
+
+	while (c->reply_slots < REPLY_SLOTS
+		&& c->rx_size - start >= (int) sizeof(request))
 	{
-		return -1;
+		memcpy(&request, c->rx + start, sizeof(request));
+		if (request.magic != TELEMETRY_REQUEST_MAGIC
+			|| request.length < sizeof(request)
+			|| request.length > TELEMETRY_MAX_REQUEST)
+		{
+			start++;
+			continue;
+		}
+		if (c->rx_size - start < request.length)
+		{
+			break;
+		}
+
+		client_request(c, request.type, c->rx + start + sizeof(request),
+			request.length - sizeof(request));
+		start += request.length;
 	}
-	if (send(socket_fd, &packet->l_y, sizeof(packet->l_y), 0) < 0)
+
+	memmove(c->rx, c->rx + start, c->rx_size - start);
+	c->rx_size -= start;
+}
+
+/**
+ * Read requests from a client. Returns -1 if the client went away.
+ */
+static int client_read(client_t * c)
+{
+	ssize_t n;
+
+	while (1)
 	{
+		// No room to answer more commands: leave the requests in the 
+		// socket until responses have been sent
+		if (c->reply_slots == REPLY_SLOTS)
+		{
+			return client_flush(c, c - clients);
+		}
+
+		n = recv(c->fd, c->rx + c->rx_size, sizeof(c->rx) - c->rx_size, 
+			MSG_DONTWAIT);
+		if (n > 0)
+		{
+			c->rx_size += n;
+			client_requests(c);
+			continue;
+		}
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			// Answer the commands that were refused
+			if (c->reply_size > 0)
+			{
+				return client_flush(c, c - clients);
+			}
+			return 0;
+		}
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
 		return -1;
 	}
-	if (send(socket_fd, &packet->u_x, sizeof(packet->u_x), 0) < 0)
+}
+
+/**
+ * Whether clients with the two subscriptions get the same packets. The
+ * rate only matters for deltas, which are against the previous frame at
+ * that rate.
+ */
+static int same_variant(const subscription_t * a, const subscription_t * b)
+{
+	return a->fields == b->fields && a->encoding == b->encoding
+		&& a->x == b->x && a->y == b->y 
+		&& a->width == b->width && a->height == b->height
+		&& (a->encoding != TELEMETRY_DELTA || a->divisor == b->divisor);
+}
+
+/**
+ * Copy the region of the subscription out of the image. Returns the
+ * image itself if the region is all of it.
+ */
+static const unsigned char * crop(const unsigned char * image, 
+	const subscription_t * sub, unsigned char * out)
+{
+	int y;
+
+	if (sub->width == WIDTH && sub->height == HEIGHT)
 	{
-		return -1;
+		return image;
 	}
-	if (send(socket_fd, &packet->u_y, sizeof(packet->u_y), 0) < 0)
+	for (y = 0; y < sub->height; y++)
 	{
-		return -1;
+		memcpy(out + y * sub->width, image + (sub->y + y) * WIDTH + sub->x,
+			sub->width);
 	}
-	if (send(socket_fd, &packet->error_lower, sizeof(packet->error_lower), 0) < 0)
+	return out;
+}
+
+static frame_t * delta_base(int d)
+{
+	int i;
+
+	for (i = 0; i < MAX_CLIENTS; i++)
 	{
-		return -1;
+		if (bases[i].frame != NULL && bases[i].divisor == d)
+		{
+			return bases[i].frame;
+		}
 	}
-	if (send(socket_fd, &packet->error_upper, sizeof(packet->error_upper), 0) < 0)
+	return NULL;
+}
+
+/**
+ * Get the variant of the frame for a subscription, preparing it if no
+ * client with the same subscription got the frame before. Returns its
+ * index, or -1 if the frame has no room for another variant.
+ */
+static int frame_variant(frame_t * frame, const subscription_t * sub)
+{
+	const unsigned char * image;
+	unsigned char * out;
+	subscription_t key;
+	frame_t * base;
+	variant_t * v;
+	int keyframe = -1, pixels, room, size = 0, i;
+
+	for (i = 0; i < frame->n_variants; i++)
 	{
-		return -1;
+		if (same_variant(&frame->variants[i].sub, sub))
+		{
+			return i;
+		}
 	}
-	if (send(socket_fd, &packet->mass, sizeof(packet->mass), 0) < 0)
+
+	// Deltas fall back to run-length encoded keyframes
+	if (sub->encoding == TELEMETRY_DELTA)
 	{
-		return -1;
+		key = *sub;
+		key.encoding = TELEMETRY_RLE;
+		keyframe = frame_variant(frame, &key);
+		if (keyframe < 0)
+		{
+			return -1;
+		}
 	}
-	if (send(socket_fd, packet->frame, IMAGE_PIXELS, 0) < 0)
+
+	if (frame->n_variants == MAX_VARIANTS)
 	{
 		return -1;
 	}
-	return 0;
+	v = &frame->variants[frame->n_variants];
+	v->sub = *sub;
+	v->base_seq = -1;
+	v->keyframe = keyframe;
+	v->payload = NULL;
+	v->packet = frame->base;
+
+	if (!(sub->fields & TELEMETRY_FIELD_RESULT))
+	{
+		v->packet.fields.l_x = v->packet.fields.l_y = 0;
+		v->packet.fields.u_x = v->packet.fields.u_y = 0;
+		v->packet.fields.error_lower = v->packet.fields.error_upper = 0;
+		v->packet.fields.mass = 0;
+	}
+
+	if (sub->fields & TELEMETRY_FIELD_IMAGE)
+	{
+		pixels = sub->width * sub->height;
+		image = crop(frame->data, sub, crop_image);
+		out = frame->arena + frame->arena_used;
+		room = ARENA_SIZE - frame->arena_used;
+		size = -1;
+
+		switch (sub->encoding)
+		{
+			case TELEMETRY_BITS:
+				if (ENCODING_BITS_SIZE(pixels) <= room)
+				{
+					size = encode_bits(image, pixels, out);
+				}
+				break;
+
+			case TELEMETRY_RLE:
+				size = encode_rle(image, pixels, out, 
+					room < ENCODED_MAX(pixels) ? room : ENCODED_MAX(pixels));
+				break;
+
+			case TELEMETRY_DELTA:
+				base = delta_base(sub->divisor);
+				if (base == NULL)
+				{
+					break;
+				}
+				size = encode_delta(image, crop(base->data, sub, crop_base),
+					pixels, out, 
+					room < ENCODED_MAX(pixels) ? room : ENCODED_MAX(pixels));
+				// Only send the delta when it is smaller than a keyframe
+				if (size >= 0 && size < (int) (frame->variants[keyframe]
+					.packet.header.length - sizeof(telemetry_packet_t)))
+				{
+					v->base_seq = base->seq;
+				}
+				else
+				{
+					size = -1;
+				}
+				break;
+		}
+
+		if (size >= 0)
+		{
+			v->payload = out;
+			v->packet.fields.encoding = sub->encoding;
+			frame->arena_used += size;
+		}
+		else if (sub->encoding == TELEMETRY_DELTA)
+		{
+			// Only the keyframe is sent
+			size = 0;
+		}
+		else if (image == frame->data)
+		{
+			v->payload = frame->data;
+			size = pixels;
+			v->packet.fields.encoding = TELEMETRY_RAW;
+		}
+		else if (pixels <= room)
+		{
+			memcpy(out, image, pixels);
+			v->payload = out;
+			size = pixels;
+			v->packet.fields.encoding = TELEMETRY_RAW;
+			frame->arena_used += size;
+		}
+		else
+		{
+			// No room left, send the whole image
+			v->payload = frame->data;
+			size = IMAGE_PIXELS;
+			v->packet.fields.encoding = TELEMETRY_RAW;
+			v->packet.fields.width = WIDTH;
+			v->packet.fields.height = HEIGHT;
+		}
+
+		if (v->payload != NULL && v->packet.fields.width == 0)
+		{
+			v->packet.fields.width = sub->width;
+			v->packet.fields.height = sub->height;
+			v->packet.fields.x = sub->x;
+			v->packet.fields.y = sub->y;
+		}
+	}
+
+	telemetry_prepare(&v->packet, size);
+	prepared++;
+	return frame->n_variants++;
 }
 
+/**
+ * Keep the frame as the base of the next delta of the clients that got
+ * it, instead of the previous one
+ */
+static void update_bases(frame_t * frame)
+{
+	int d, i, j, unused;
 
-static void * broadcast_thread(void * ptr)
+	for (i = 0; i < MAX_CLIENTS; i++)
+	{
+		d = clients[i].sub.divisor;
+		if (clients[i].fd < 0 || clients[i].sub.encoding != TELEMETRY_DELTA
+			|| frame->seq % d != 0)
+		{
+			continue;
+		}
+
+		unused = -1;
+		for (j = 0; j < MAX_CLIENTS; j++)
+		{
+			if (bases[j].frame == NULL)
+			{
+				unused = unused < 0 ? j : unused;
+			}
+			else if (bases[j].divisor == d)
+			{
+				break;
+			}
+		}
+		if (j == MAX_CLIENTS)
+		{
+			// There is a base per divisor, and at most one divisor per 
+			// client
+			j = unused;
+			bases[j].divisor = d;
+		}
+		else if (bases[j].frame == frame)
+		{
+			continue;
+		}
+		else
+		{
+			frame_put(bases[j].frame);
+		}
+		frame->refs++;
+		bases[j].frame = frame;
+	}
+}
+
+/**
+ * Take the latest packet left by broadcast_send, and queue it for the
+ * clients that subscribed to it.
+ */
+static void publish()
 {
-	while (1)
-	{	
-		// Flag to indicate if we should continue waiting for "frame ready" signals
-		int ok = 1;
+	const broadcast_packet_t * packet;
+	frame_t * frame;
+	client_t * c;
+	int i, variant;
 
-		printf("[broadcast] Waiting for connection\n");
-		socket_fd = accept(server_socket_fd, (struct sockaddr*) &addr, (socklen_t *)&addr_size);
+	if (!(__atomic_load_n(&middle, __ATOMIC_ACQUIRE) & SLOT_FRESH))
+	{
+		return;
+	}
+
+	frame = frame_get();
+	if (frame == NULL)
+	{
+		// Can't happen as long as the pool is large enough for all queues
+		return;
+	}
+
+	front = __atomic_exchange_n(&middle, front, __ATOMIC_ACQ_REL) & ~SLOT_FRESH;
+	packet = &slots[front];
 
-		printf("[broadcast] Got connection.\n\n");
+	memset(&frame->base, 0, sizeof(frame->base));
+	frame->base.header.seq = packet->seq;
+	frame->base.header.timestamp_us = packet->timestamp_us;
+	frame->base.fields.l_x = packet->l_x;
+	frame->base.fields.l_y = packet->l_y;
+	frame->base.fields.u_x = packet->u_x;
+	frame->base.fields.u_y = packet->u_y;
+	frame->base.fields.error_lower = packet->error_lower;
+	frame->base.fields.error_upper = packet->error_upper;
+	frame->base.fields.mass = packet->mass;
 
-		while (ok)
+	frame->seq = packet->seq;
+	frame->n_variants = 0;
+	frame->arena_used = 0;
+	memcpy(frame->data, packet->frame, IMAGE_PIXELS);
+	published++;
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+	{
+		c = &clients[i];
+		if (c->fd < 0 || c->sub.fields == 0 || frame->seq % c->sub.divisor != 0)
 		{
-			// Lock mutex and wait for condition variable to be signaled
-			pthread_mutex_lock(&frame_buffer_mtx);
-			pthread_cond_wait(&frame_buffer_cv, &frame_buffer_mtx);
+			continue;
+		}
 
-			// Frame is ready!
+		variant = frame_variant(frame, &c->sub);
+		if (variant >= 0)
+		{
+			client_queue(c, frame, variant);
+		}
+		if (client_flush(c, i) < 0)
+		{
+			client_close(c);
+		}
+	}
 
-			if (send_packet(&packet) < 0)
+	update_bases(frame);
+	frame_put(frame);
+}
+
+static void * broadcast_thread(void * ptr)
+{
+	struct epoll_event events[MAX_CLIENTS + 3];
+	uint64_t value;
+	client_t * c;
+	int i, n, tag;
+
+	while (1)
+	{
+		n = epoll_wait(epoll_fd, events, MAX_CLIENTS + 3, -1);
+		if (n < 0)
+		{
+			if (errno != EINTR)
 			{
-				perror("[broadcast] send_packet()");
+				perror("[broadcast] epoll_wait()");
+			}
+			continue;
+		}
+
+		for (i = 0; i < n; i++)
+		{
+			tag = (int) events[i].data.u32;
 
-				// Socket is broken. Release mutex and break
-				// out of the loop to wait for a new connection.
-				//pthread_mutex_unlock(&frame_buffer_mtx);
-				ok = 0;
-				close(socket_fd);
+			if (tag == TAG_SERVER)
+			{
+				accept_clients();
 			}
-			else
+			else if (tag == TAG_WAKEUP)
 			{
-				// Frame sent successfully
+				if (read(wakeup_fd, &value, sizeof(value)) == sizeof(value))
+				{
+					publish();
+				}
 			}
+			else if (tag == TAG_REMOTE)
+			{
+				if (read(remote_fd(), &value, sizeof(value)) == sizeof(value))
+				{
+					send_replies();
+				}
+			}
+			else
+			{
+				c = &clients[tag];
+				if (c->fd < 0)
+				{
+					// Closed while handling an earlier event
+					continue;
+				}
 
-			pthread_mutex_unlock(&frame_buffer_mtx);
+				if ((events[i].events & (EPOLLERR | EPOLLHUP))
+					|| ((events[i].events & EPOLLIN) && client_read(c) < 0)
+					|| ((events[i].events & EPOLLOUT) && client_flush(c, tag) < 0))
+				{
+					client_close(c);
+				}
+			}
 		}
 	}
 
@@ -162,55 +1222,151 @@ static void * broadcast_thread(void * ptr)
  */
 int broadcast_init()
 {
-	port = PORT;
+	int i;
 
-	// Initialize mutex and condition variable
-	pthread_mutex_init(&frame_buffer_mtx, NULL);
-	pthread_cond_init(&frame_buffer_cv, NULL);
+	port = PORT;
 
-	// Allocate memory for the broadcast packet
-	packet.frame = ((unsigned char *) malloc(IMAGE_PIXELS));
+	// Allocate memory for the broadcast packets and the frame pool
+	for (i = 0; i < 3; i++)
+	{
+		slots[i].frame = ((unsigned char *) malloc(IMAGE_PIXELS));
+		if (slots[i].frame == NULL)
+		{
+			return -1;
+		}
+	}
+	pool = (frame_t *) calloc(POOL_SIZE, sizeof(frame_t));
+	if (pool == NULL)
+	{
+		return -1;
+	}
 
-	signal(SIGPIPE, signal_handler);
+	for (i = 0; i < MAX_CLIENTS; i++)
+	{
+		clients[i].fd = -1;
+	}
+	return remote_init();
 }
 
 void broadcast_release()
 {
-	close(socket_fd);
+	int i;
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+	{
+		if (clients[i].fd >= 0)
+		{
+			close(clients[i].fd);
+		}
+	}
 	close(server_socket_fd);
 }
 
-void broadcast_send(int l_x, int l_y, int u_x, int u_y, int error_lower, 
-	int error_upper, int mass, unsigned char * buffer)
-{	
-	// Try locking the frame buffer mutex, and return if the lock could not be
-	// aquired. This means that the frame is skipped/ignored if the lock cannot
-	// be aquired.
-	if (pthread_mutex_lock(&frame_buffer_mtx) == 0)
-	{	
-		// Populate packet with details
-		packet.l_x = l_x;
-		packet.l_y = l_y;
-		packet.u_x = u_x;
-		packet.u_y = u_y;
-		packet.error_lower = error_lower;
-		packet.error_upper = error_upper;
-		packet.mass = mass;
-		// Copy the image data
-		memcpy(packet.frame, buffer, IMAGE_PIXELS);
+/**
+ * How often the server needs a frame: broadcast_send should be called
+ * for the frames whose number is a multiple of this. Returns 0 when no
+ * client wants any frame.
+ */
+int broadcast_divisor()
+{
+	if (!__atomic_load_n(&enabled, __ATOMIC_ACQUIRE))
+	{
+		return 0;
+	}
+	return __atomic_load_n(&divisor, __ATOMIC_RELAXED);
+}
+
+/**
+ * Hand a frame to the broadcast server. This never blocks: the packet is
+ * written to a slot owned by the caller and published with one atomic
+ * swap. A packet the server hasn't taken yet is replaced.
+ *
+ * \param seq Number of the camera frame, which clients subscribe to
+ *        multiples of
+ */
+void broadcast_send(unsigned int seq, int l_x, int l_y, int u_x, int u_y, 
+	int error_lower, int error_upper, int mass, unsigned char * buffer)
+{
+	broadcast_packet_t * packet = &slots[back];
+	uint64_t one = 1;
+
+	if (!__atomic_load_n(&enabled, __ATOMIC_ACQUIRE))
+	{
+		return;
+	}
+
+	// Populate packet with details
+	packet->l_x = l_x;
+	packet->l_y = l_y;
+	packet->u_x = u_x;
+	packet->u_y = u_y;
+	packet->error_lower = error_lower;
+	packet->error_upper = error_upper;
+	packet->mass = mass;
+	packet->seq = seq;
+	packet->timestamp_us = timer_now_us();
+	// Copy the image data
+	memcpy(packet->frame, buffer, IMAGE_PIXELS);
+
+	// Publish the slot, and take over the one the server isn't using
+	back = __atomic_exchange_n(&middle, back | SLOT_FRESH, __ATOMIC_ACQ_REL);
+	if (back & SLOT_FRESH)
+	{
+		skipped++;
+		back &= ~SLOT_FRESH;
+	}
+
+	// Wake up the server thread
+	if (write(wakeup_fd, &one, sizeof(one)) < 0)
+	{
+		perror("[broadcast] write()");
+	}
+}
+
+/**
+ * Print the state of each connected client
+ */
+void broadcast_print_stats()
+{
+	int i, n = 0;
 
-		// Signal that a packet is ready, and release mutex!
-		pthread_cond_signal(&frame_buffer_cv);
-		pthread_mutex_unlock(&frame_buffer_mtx);
+	if (!__atomic_load_n(&enabled, __ATOMIC_ACQUIRE))
+	{
+		printf("Broadcast server not running\n");
+		return;
+	}
+
+	// The counters are owned by the server thread; they are only read
+	// here, so a value may be a frame old
+	for (i = 0; i < MAX_CLIENTS; i++)
+	{
+		client_t * c = &clients[i];
+		if (c->fd < 0)
+		{
+			continue;
+		}
+		printf("Client %d (%s): every %d, %dx%d at (%d, %d), %s%s, %lu sent "
+			"(%llu bytes, %llu per frame), %lu dropped, lag %d (max %d)\n", 
+			i, inet_ntoa(c->addr.sin_addr), c->sub.divisor, c->sub.width,
+			c->sub.height, c->sub.x, c->sub.y, 
+			c->sub.fields & TELEMETRY_FIELD_RESULT ? "result, " : "",
+			encoding_names[c->sub.encoding], c->sent, c->bytes, 
+			c->sent ? c->bytes / c->sent : 0, c->dropped, c->lag, c->max_lag);
+		n++;
 	}
+	printf("%d client(s), every %d frame(s), %lu frame(s) replaced before "
+		"sending, %.1f variant(s) per frame\n", n, broadcast_divisor(), 
+		skipped, published ? (double) prepared / published : 0.0);
 }
 
 int broadcast_start()
 {
+	socklen_t addr_size = sizeof(addr);
+
 	server_socket_fd = socket(AF_INET, SOCK_STREAM, 0);
     if(server_socket_fd == SOCKET_ERROR)
     {
-        printf("{broadcast] Could not make a socket\n");
+        printf("[broadcast] Could not make a socket\n");
         return 0;
     }
 
@@ -231,15 +1387,33 @@ int broadcast_start()
     }
 
     // Finally listen
-    getsockname(server_socket_fd, (struct sockaddr *) &addr, (socklen_t *) &addr_size);
+    getsockname(server_socket_fd, (struct sockaddr *) &addr, &addr_size);
     if(listen(server_socket_fd, QUEUE_SIZE) == SOCKET_ERROR)
     {
         printf("[broadcast] Could not listen\n");
         return 0;
     }
+	set_nonblocking(server_socket_fd);
 
-	pthread_create(&thread, NULL, broadcast_thread, NULL);
+	epoll_fd = epoll_create(MAX_CLIENTS + 3);
+	wakeup_fd = eventfd(0, EFD_NONBLOCK);
+	if (epoll_fd < 0 || wakeup_fd < 0)
+	{
+		printf("[broadcast] Could not create epoll instance\n");
+		return 0;
+	}
+	watch(server_socket_fd, TAG_SERVER, EPOLL_CTL_ADD, EPOLLIN);
+	watch(wakeup_fd, TAG_WAKEUP, EPOLL_CTL_ADD, EPOLLIN);
+	watch(remote_fd(), TAG_REMOTE, EPOLL_CTL_ADD, EPOLLIN);
+
+	if (pthread_create(&thread, NULL, broadcast_thread, NULL) != 0)
+	{
+		printf("[broadcast] Could not start the server thread\n");
+		return 0;
+	}
+	__atomic_store_n(&enabled, 1, __ATOMIC_RELEASE);
 
     printf("[broadcast] Opened socket and started listening on port %d\n", port);
-	printf("[broadcast] Accept thread started\n");
+	printf("[broadcast] Server thread started\n");
+	return 1;
 }
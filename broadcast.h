@@ -6,7 +6,9 @@
 int broadcast_init();
 int broadcast_start();
 void broadcast_release();
-void broadcast_send(int l_x, int l_y, int u_x, int u_y, int error_lower, 
-	int error_upper, int mass, unsigned char * buffer);
+int broadcast_divisor();
+void broadcast_send(unsigned int seq, int l_x, int l_y, int u_x, int u_y, 
+	int error_lower, int error_upper, int mass, unsigned char * buffer);
+void broadcast_print_stats();
 
 #endif
@@ -0,0 +1,455 @@
+/**
+ * Load generator and latency benchmark for the broadcast server.
+ *
+ * Usage: broadcast_bench [-h host] [-n connections] [-t seconds]
+ *                        [-r divisor] [-e raw|bits|rle|delta] [-c x,y,w,h]
+ *                        [-b kB/s] [-s slow] [-l fps]
+ *
+ * Opens the connections to the server, subscribes each of them, and
+ * receives and decodes the packets like the viewer does, without showing
+ * them. With -b the first -s connections (all by default) read at most
+ * that many kB per second through a small socket buffer, like a viewer
+ * on a slow Wi-Fi link. At the end the frames, missed frames, throughput
+ * and latency of each connection are printed.
+ *
+ * With -l the broadcast server runs in the benchmark itself, fed with
+ * synthetic frames at the given frame rate, and the connections go to
+ * localhost. This exercises the same server code as eyecam without the
+ * camera, so changes to the broadcast path can be checked on a dev
+ * machine.
+ *
+ * The latency is from the capture timestamp of a frame to the moment its
+ * packet has been received completely. The timestamp is on the monotonic
+ * clock of the robot, so the latency is only meaningful when the server
+ * runs on the same machine (always the case with -l).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+
+#include "common.h"
+#include "broadcast.h"
+#include "receiver.h"
+#include "timer.h"
+
+#define PORT				"24000"
+
+#define MAX_CONNECTIONS		64
+
+/**
+ * Socket receive buffer of a throttled connection, so the server sees
+ * the slow link instead of the kernel buffering for it
+ */
+#define SLOW_RCVBUF			(16 * 1024)
+
+typedef struct connection {
+	int index;
+	int fd;
+	pthread_t thread;
+	receiver_t rx;
+	// Bytes per second read at most (0: as fast as possible)
+	long rate;
+	// Previous image of the region, the base of the next delta
+	unsigned char image[IMAGE_PIXELS];
+	long last_seq;
+	unsigned long frames, missed, errors;
+	unsigned long long bytes;
+	long long start_us, end_us;
+	// Latency of each frame (microseconds)
+	long long * latency;
+	unsigned long n_latency, max_latency;
+} connection_t;
+
+static connection_t connections[MAX_CONNECTIONS];
+static telemetry_subscription_t sub;
+static volatile int running = 1;
+
+static const char * encodings[] = { "raw", "bits", "rle", "delta" };
+
+static void add_latency(connection_t * c, long long us)
+{
+	long long * grown;
+
+	if (c->n_latency == c->max_latency)
+	{
+		c->max_latency = c->max_latency ? 2 * c->max_latency : 1024;
+		grown = (long long *) realloc(c->latency,
+			c->max_latency * sizeof(long long));
+		if (grown == NULL)
+		{
+			return;
+		}
+		c->latency = grown;
+	}
+	c->latency[c->n_latency++] = us;
+}
+
+/**
+ * Sleep as long as needed to keep the connection at its rate
+ */
+static void throttle(connection_t * c)
+{
+	long long due = c->start_us + (long long) (c->bytes * 1000000ULL / c->rate);
+	long long now = timer_now_us();
+
+	if (due > now)
+	{
+		usleep(due - now);
+	}
+}
+
+static void * receive_thread(void * arg)
+{
+	connection_t * c = (connection_t *) arg;
+	telemetry_header_t header;
+	telemetry_fields_t fields;
+	unsigned char * payload;
+	int size;
+
+	c->start_us = timer_now_us();
+
+	while (running)
+	{
+		size = receiver_read(&c->rx, &header, &fields, &payload);
+		if (size < 0)
+		{
+			break;
+		}
+		if (header.magic != TELEMETRY_MAGIC)
+		{
+			continue;
+		}
+		add_latency(c, timer_now_us() - (long long) header.timestamp_us);
+
+		c->frames++;
+		c->bytes += header.length;
+		if (c->last_seq >= 0 && header.seq > c->last_seq + sub.divisor)
+		{
+			c->missed += (header.seq - c->last_seq) / sub.divisor - 1;
+		}
+		c->last_seq = header.seq;
+
+		if (size > 0 && receiver_decode(&fields, payload, size, c->image) < 0)
+		{
+			c->errors++;
+		}
+
+		if (c->rate > 0)
+		{
+			throttle(c);
+		}
+	}
+
+	c->end_us = timer_now_us();
+	if (running)
+	{
+		printf("Connection %d lost\n", c->index);
+	}
+	return NULL;
+}
+
+static int compare(const void * a, const void * b)
+{
+	long long x = *(const long long *) a, y = *(const long long *) b;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * Print the latency percentiles of the samples (sorted in place)
+ */
+static void print_latency(long long * latency, unsigned long n)
+{
+	long long total = 0;
+	unsigned long i;
+
+	if (n == 0)
+	{
+		printf("no frames\n");
+		return;
+	}
+
+	qsort(latency, n, sizeof(long long), compare);
+	for (i = 0; i < n; i++)
+	{
+		total += latency[i];
+	}
+	printf("latency avg %lld us, p50 %lld, p90 %lld, p99 %lld, max %lld\n",
+		total / (long long) n, latency[n / 2], latency[n * 9 / 10],
+		latency[n * 99 / 100], latency[n - 1]);
+}
+
+/**
+ * Make a frame like the binary image of the line: a slanted band that
+ * drifts sideways
+ */
+static void make_frame(unsigned char * image, unsigned long n)
+{
+	int y, x0;
+
+	memset(image, 0, IMAGE_PIXELS);
+	for (y = 0; y < IMAGE_HEIGHT; y++)
+	{
+		x0 = 120 + (n / 10) % 60 + y / 8;
+		memset(image + y * IMAGE_WIDTH + x0, 255, 30);
+	}
+}
+
+/**
+ * Hand synthetic frames to the broadcast server, at the rate the clients
+ * subscribed to, like frame_callback does with the camera frames
+ */
+static void * feed_thread(void * arg)
+{
+	static unsigned char image[IMAGE_PIXELS];
+	long long period = 1000000 / (long) arg, next = timer_now_us(), now;
+	unsigned long n = 0;
+	int d;
+
+	while (running)
+	{
+		d = broadcast_divisor();
+		if (d > 0 && n % d == 0)
+		{
+			make_frame(image, n);
+			broadcast_send(n, 160, 200, 160, 40, 0, 0, 30 * IMAGE_HEIGHT,
+				image);
+		}
+		n++;
+
+		next += period;
+		now = timer_now_us();
+		if (next > now)
+		{
+			usleep(next - now);
+		}
+	}
+	return NULL;
+}
+
+static int connect_to(const char * host)
+{
+	struct addrinfo hints, * res;
+	int fd, nodelay = 1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, PORT, &hints, &res) != 0)
+	{
+		fprintf(stderr, "Unknown host %s\n", host);
+		return -1;
+	}
+
+	fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (fd < 0 || connect(fd, res->ai_addr, res->ai_addrlen) < 0)
+	{
+		perror("connect");
+		freeaddrinfo(res);
+		return -1;
+	}
+	freeaddrinfo(res);
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+	return fd;
+}
+
+static void usage(const char * name)
+{
+	fprintf(stderr, "Usage: %s [-h host] [-n connections] [-t seconds] "
+		"[-r divisor] [-e raw|bits|rle|delta] [-c x,y,w,h] [-b kB/s] "
+		"[-s slow] [-l fps]\n", name);
+	exit(1);
+}
+
+int main(int argc, char ** argv)
+{
+	const char * host = "127.0.0.1";
+	int n = 1, seconds = 10, slow = -1, fps = 0, rcvbuf = SLOW_RCVBUF, i;
+	long rate = 0;
+	unsigned int x, y, w, h;
+	unsigned long frames = 0, missed = 0, errors = 0, n_latency = 0;
+	unsigned long long bytes = 0;
+	long long * latency;
+	pthread_t feeder;
+	connection_t * c;
+	double elapsed;
+
+	// Every third frame, whole, as deltas (as the viewer)
+	sub.divisor = 3;
+	sub.encoding = TELEMETRY_DELTA;
+	sub.fields = TELEMETRY_FIELD_RESULT | TELEMETRY_FIELD_IMAGE;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (i + 1 == argc)
+		{
+			usage(argv[0]);
+		}
+		if (strcmp(argv[i], "-h") == 0)
+		{
+			host = argv[++i];
+		}
+		else if (strcmp(argv[i], "-n") == 0)
+		{
+			n = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-t") == 0)
+		{
+			seconds = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-r") == 0)
+		{
+			sub.divisor = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-e") == 0)
+		{
+			i++;
+			for (sub.encoding = 0; sub.encoding < TELEMETRY_ENCODINGS; sub.encoding++)
+			{
+				if (strcmp(argv[i], encodings[sub.encoding]) == 0)
+				{
+					break;
+				}
+			}
+			if (sub.encoding == TELEMETRY_ENCODINGS)
+			{
+				usage(argv[0]);
+			}
+		}
+		else if (strcmp(argv[i], "-c") == 0
+			&& sscanf(argv[++i], "%u,%u,%u,%u", &x, &y, &w, &h) == 4)
+		{
+			sub.x = x;
+			sub.y = y;
+			sub.width = w;
+			sub.height = h;
+		}
+		else if (strcmp(argv[i], "-b") == 0)
+		{
+			rate = atol(argv[++i]) * 1024;
+		}
+		else if (strcmp(argv[i], "-s") == 0)
+		{
+			slow = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-l") == 0)
+		{
+			fps = atoi(argv[++i]);
+		}
+		else
+		{
+			usage(argv[0]);
+		}
+	}
+	if (n < 1 || n > MAX_CONNECTIONS || seconds < 1 || sub.divisor < 1)
+	{
+		usage(argv[0]);
+	}
+	if (slow < 0 || slow > n)
+	{
+		slow = n;
+	}
+
+	if (fps > 0)
+	{
+		host = "127.0.0.1";
+		if (broadcast_init() < 0 || !broadcast_start())
+		{
+			fprintf(stderr, "Could not start the broadcast server\n");
+			return 1;
+		}
+		pthread_create(&feeder, NULL, feed_thread, (void *) (long) fps);
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		c = &connections[i];
+		c->index = i;
+		c->last_seq = -1;
+		c->rate = i < slow ? rate : 0;
+
+		c->fd = connect_to(host);
+		if (c->fd < 0 || receiver_init(&c->rx, c->fd) < 0)
+		{
+			return 1;
+		}
+		if (c->rate > 0)
+		{
+			// Read a little at a time, through a small socket buffer
+			setsockopt(c->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+			c->rx.chunk = 4096;
+		}
+		if (receiver_subscribe(c->fd, &sub) < 0)
+		{
+			perror("send");
+			return 1;
+		}
+		pthread_create(&c->thread, NULL, receive_thread, c);
+	}
+
+	printf("%d connection(s) to %s, every %d frame(s), %s encoding", n, host,
+		sub.divisor, encodings[sub.encoding]);
+	if (rate > 0)
+	{
+		printf(", %d limited to %ld kB/s", slow, rate / 1024);
+	}
+	printf("\n");
+
+	sleep(seconds);
+
+	// What the server saw, while the connections are still open
+	if (fps > 0)
+	{
+		broadcast_print_stats();
+	}
+
+	running = 0;
+	for (i = 0; i < n; i++)
+	{
+		shutdown(connections[i].fd, SHUT_RDWR);
+		pthread_join(connections[i].thread, NULL);
+	}
+	if (fps > 0)
+	{
+		pthread_join(feeder, NULL);
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		c = &connections[i];
+		elapsed = (c->end_us - c->start_us) / 1e6;
+		printf("Connection %d%s: %lu frames (%.1f/s), %lu missed, %lu bad, "
+			"%.1f kB/s, ", i, c->rate > 0 ? " (slow)" : "", c->frames,
+			c->frames / elapsed, c->missed, c->errors,
+			c->bytes / 1024.0 / elapsed);
+		print_latency(c->latency, c->n_latency);
+
+		frames += c->frames;
+		missed += c->missed;
+		errors += c->errors;
+		bytes += c->bytes;
+		n_latency += c->n_latency;
+	}
+
+	latency = (long long *) malloc((n_latency + 1) * sizeof(long long));
+	n_latency = 0;
+	for (i = 0; i < n; i++)
+	{
+		memcpy(latency + n_latency, connections[i].latency,
+			connections[i].n_latency * sizeof(long long));
+		n_latency += connections[i].n_latency;
+	}
+	printf("Total: %lu frames, %lu missed, %lu bad, %.1f kB/s, ", frames,
+		missed, errors, bytes / 1024.0 / seconds);
+	print_latency(latency, n_latency);
+
+	return 0;
+}
@@ -2,8 +2,14 @@
 
 #include "common.h"
 #include "configuration.h"
+#include "governor.h"
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <limits.h>
+#include <float.h>
 #include <confuse.h>
 
 /**
@@ -46,6 +52,74 @@ static cfg_opt_t opts[] =
 	CFG_SIMPLE_INT("slice_lower_start", &conf.slice_lower_start),
 	CFG_SIMPLE_INT("slice_lower_end", &conf.slice_lower_end),
 
+	CFG_STR_LIST("pipeline", "{deinterleave, detect, com, undistort}", 
+		CFGF_NONE),
+	CFG_INT_LIST("threshold_bands", "{0, 44, 88, 144, 192, 240}", CFGF_NONE),
+	CFG_STR("detector", "threshold", CFGF_NONE),
+	CFG_INT("edge_threshold", 120, CFGF_NONE),
+	CFG_INT("edge_max_width", 80, CFGF_NONE),
+
+	CFG_INT("hough_angle_min", 0, CFGF_NONE),
+	CFG_INT("hough_angle_max", 180, CFGF_NONE),
+	CFG_INT("hough_sample", 100, CFGF_NONE),
+	CFG_INT("hough_min_votes", 40, CFGF_NONE),
+	CFG_SIMPLE_INT("hough_turn", &conf.hough_turn),
+
+	CFG_FLOAT("tracker_alpha", 0.5, 0),
+	CFG_FLOAT("tracker_beta", 0.1, 0),
+	CFG_INT("tracker_coast_ms", 150, CFGF_NONE),
+
+	CFG_STR_LIST("shadow_pipeline", "{}", CFGF_NONE),
+	CFG_INT("shadow_cpu", 3, CFGF_NONE),
+	CFG_INT("shadow_tolerance", 8, CFGF_NONE),
+	CFG_STR("shadow_log", "", CFGF_NONE),
+
+	CFG_INT("governor_max_level", 3, CFGF_NONE),
+	CFG_FLOAT("governor_high", 0.9, 0),
+	CFG_FLOAT("governor_low", 0.6, 0),
+	CFG_INT("governor_down_frames", 5, CFGF_NONE),
+	CFG_INT("governor_up_frames", 90, CFGF_NONE),
+	CFG_INT("governor_roi_start", 120, CFGF_NONE),
+
+	CFG_INT("mjpeg_port", 0, CFGF_NONE),
+	CFG_INT("mjpeg_quality", 75, CFGF_NONE),
+	CFG_INT("mjpeg_fps", 5, CFGF_NONE),
+	CFG_INT("mjpeg_budget_us", 15000, CFGF_NONE),
+
+	CFG_STR("telemetry_addr", "", CFGF_NONE),
+	CFG_INT("telemetry_port", 24001, CFGF_NONE),
+	CFG_INT("telemetry_ttl", 1, CFGF_NONE),
+
+	CFG_SIMPLE_INT("shm_slots", &conf.shm_slots),
+
+	CFG_FLOAT("k_brightness", 0, 0),
+	CFG_FLOAT("k_contrast", 1, 0),
+	CFG_FLOAT("k_gamma", 1, 0),
+
+	CFG_INT("avg_mass_count", 3, CFGF_NONE),
+
+	CFG_SIMPLE_INT("use_classifier", &conf.use_classifier),
+	CFG_INT("classifier_min_confidence", 50, CFGF_NONE),
+	CFG_INT("run_min_width", 3, CFGF_NONE),
+	CFG_INT("blob_min_area", 40, CFGF_NONE),
+	CFG_INT("track_wide_width", 160, CFGF_NONE),
+	CFG_INT("track_wide_rows", 8, CFGF_NONE),
+	CFG_INT("track_fork_rows", 10, CFGF_NONE),
+	CFG_INT("track_end_rows", 60, CFGF_NONE),
+
+	CFG_STR_LIST("route", "{}", CFGF_NONE),
+	CFG_INT("fork_passed_frames", 5, CFGF_NONE),
+
+	CFG_SIMPLE_INT("skip_unchanged", &conf.skip_unchanged),
+	CFG_INT("skip_grid", 16, CFGF_NONE),
+	CFG_INT("skip_tolerance", 2, CFGF_NONE),
+
+	CFG_FLOAT("denoise_alpha", 0.5, 0),
+	CFG_INT("denoise_motion", 24, CFGF_NONE),
+
+	CFG_SIMPLE_INT("flatfield", &conf.flatfield),
+	CFG_STR("flatfield_file", "flatfield.bin", CFGF_NONE),
+
 	CFG_SIMPLE_INT("mass_horizontal_lower", &conf.mass_horizontal_lower),
 	CFG_SIMPLE_INT("mass_horizontal_upper", &conf.mass_horizontal_upper),
 	CFG_SIMPLE_INT("mass_cross_lower", &conf.mass_cross_lower),
@@ -72,6 +146,17 @@ static cfg_opt_t opts[] =
 	CFG_SIMPLE_INT("dist_side_disappear_1", &conf.dist_side_disappear_1),
 	CFG_SIMPLE_INT("dist_side_disappear_2", &conf.dist_side_disappear_2),
 
+	CFG_SIMPLE_INT("undistort", &conf.undistort),
+	CFG_FLOAT("cam_fx", 0, 0),
+	CFG_FLOAT("cam_fy", 0, 0),
+	CFG_FLOAT("cam_cx", WIDTH / 2, 0),
+	CFG_FLOAT("cam_cy", HEIGHT / 2, 0),
+	CFG_FLOAT("cam_k1", 0, 0),
+	CFG_FLOAT("cam_k2", 0, 0),
+	CFG_FLOAT("cam_k3", 0, 0),
+	CFG_FLOAT("cam_p1", 0, 0),
+	CFG_FLOAT("cam_p2", 0, 0),
+
 	CFG_END()
 };
 
@@ -88,6 +173,8 @@ void config_init()
 
 int config_reload()
 {
+	int i, n;
+
 	if (cfg_parse(cfg, CONFIG_FILE) == CFG_PARSE_ERROR)
 	{
 		return -1;
@@ -108,6 +195,104 @@ int config_reload()
 	conf.w_k_d = cfg_getfloat(cfg, "w_k_d");
 	conf.w_diff_p = cfg_getfloat(cfg, "w_diff_p");
 
+	conf.avg_mass_count = cfg_getint(cfg, "avg_mass_count");
+	if (conf.avg_mass_count < 1)
+	{
+		conf.avg_mass_count = 1;
+	}
+
+	conf.classifier_min_confidence = 
+		cfg_getint(cfg, "classifier_min_confidence");
+	conf.run_min_width = cfg_getint(cfg, "run_min_width");
+	conf.blob_min_area = cfg_getint(cfg, "blob_min_area");
+	conf.track_wide_width = cfg_getint(cfg, "track_wide_width");
+	conf.track_wide_rows = cfg_getint(cfg, "track_wide_rows");
+	conf.track_fork_rows = cfg_getint(cfg, "track_fork_rows");
+	conf.track_end_rows = cfg_getint(cfg, "track_end_rows");
+
+	n = cfg_size(cfg, "route");
+	if (n > CONF_MAX_ROUTE)
+	{
+		n = CONF_MAX_ROUTE;
+	}
+	for (i = 0; i < n; i++)
+	{
+		const char * branch = cfg_getnstr(cfg, "route", i);
+		conf.route[i] = (branch[0] == 'r' || branch[0] == 'R') ? 
+			ROUTE_RIGHT : ROUTE_LEFT;
+	}
+	conf.n_route = n;
+	conf.fork_passed_frames = cfg_getint(cfg, "fork_passed_frames");
+
+	conf.skip_grid = cfg_getint(cfg, "skip_grid");
+	conf.skip_tolerance = cfg_getint(cfg, "skip_tolerance");
+
+	conf.denoise_alpha = cfg_getfloat(cfg, "denoise_alpha");
+	if (conf.denoise_alpha < 0) conf.denoise_alpha = 0;
+	if (conf.denoise_alpha > 1) conf.denoise_alpha = 1;
+	conf.denoise_motion = cfg_getint(cfg, "denoise_motion");
+	if (conf.denoise_motion < 0) conf.denoise_motion = 0;
+	if (conf.denoise_motion > 255) conf.denoise_motion = 255;
+
+	conf.k_brightness = cfg_getfloat(cfg, "k_brightness");
+	conf.k_contrast = cfg_getfloat(cfg, "k_contrast");
+	conf.k_gamma = cfg_getfloat(cfg, "k_gamma");
+
+	n = cfg_size(cfg, "threshold_bands");
+	if (n > CONF_MAX_BANDS + 1)
+	{
+		printf("[config] Too many threshold bands, using the first %d\n",
+			CONF_MAX_BANDS);
+		n = CONF_MAX_BANDS + 1;
+	}
+	for (i = 0; i < n; i++)
+	{
+		conf.threshold_bands[i] = cfg_getnint(cfg, "threshold_bands", i);
+	}
+	conf.n_threshold_bands = n;
+
+	conf.detector = strcmp(cfg_getstr(cfg, "detector"), "edge") == 0 ? 
+		DETECTOR_EDGE : DETECTOR_THRESHOLD;
+	conf.edge_threshold = cfg_getint(cfg, "edge_threshold");
+	conf.edge_max_width = cfg_getint(cfg, "edge_max_width");
+
+	conf.hough_angle_min = cfg_getint(cfg, "hough_angle_min");
+	conf.hough_angle_max = cfg_getint(cfg, "hough_angle_max");
+	conf.hough_sample = cfg_getint(cfg, "hough_sample");
+	conf.hough_min_votes = cfg_getint(cfg, "hough_min_votes");
+
+	conf.tracker_alpha = cfg_getfloat(cfg, "tracker_alpha");
+	conf.tracker_beta = cfg_getfloat(cfg, "tracker_beta");
+	conf.tracker_coast_ms = cfg_getint(cfg, "tracker_coast_ms");
+
+	conf.shadow_cpu = cfg_getint(cfg, "shadow_cpu");
+	conf.shadow_tolerance = cfg_getint(cfg, "shadow_tolerance");
+
+	conf.governor_max_level = cfg_getint(cfg, "governor_max_level");
+	conf.governor_high = cfg_getfloat(cfg, "governor_high");
+	conf.governor_low = cfg_getfloat(cfg, "governor_low");
+	conf.governor_down_frames = cfg_getint(cfg, "governor_down_frames");
+	conf.governor_up_frames = cfg_getint(cfg, "governor_up_frames");
+	conf.governor_roi_start = cfg_getint(cfg, "governor_roi_start");
+
+	conf.mjpeg_port = cfg_getint(cfg, "mjpeg_port");
+	conf.mjpeg_quality = cfg_getint(cfg, "mjpeg_quality");
+	conf.mjpeg_fps = cfg_getint(cfg, "mjpeg_fps");
+	conf.mjpeg_budget_us = cfg_getint(cfg, "mjpeg_budget_us");
+
+	conf.telemetry_port = cfg_getint(cfg, "telemetry_port");
+	conf.telemetry_ttl = cfg_getint(cfg, "telemetry_ttl");
+
+	conf.cam_fx = cfg_getfloat(cfg, "cam_fx");
+	conf.cam_fy = cfg_getfloat(cfg, "cam_fy");
+	conf.cam_cx = cfg_getfloat(cfg, "cam_cx");
+	conf.cam_cy = cfg_getfloat(cfg, "cam_cy");
+	conf.cam_k1 = cfg_getfloat(cfg, "cam_k1");
+	conf.cam_k2 = cfg_getfloat(cfg, "cam_k2");
+	conf.cam_k3 = cfg_getfloat(cfg, "cam_k3");
+	conf.cam_p1 = cfg_getfloat(cfg, "cam_p1");
+	conf.cam_p2 = cfg_getfloat(cfg, "cam_p2");
+
 	return 0;
 }
 
@@ -126,5 +311,213 @@ int config_get_int(const char * name)
 	return (int) cfg_getint(cfg, name);
 }
 
+int config_get_list_size(const char * name)
+{
+	return (int) cfg_size(cfg, name);
+}
 
+char * config_get_nstr(const char * name, int index)
+{
+	return cfg_getnstr(cfg, name, index);
+}
 
+int config_get_nint(const char * name, int index)
+{
+	return (int) cfg_getnint(cfg, name, index);
+}
+
+
+
+
+#define FIELD(name, type, live, min, max) \
+	{ #name, type, offsetof(conf_t, name), live, min, max }
+#define INT_FIELD(name, live) \
+	FIELD(name, CONFIG_FIELD_INT, live, INT_MIN, INT_MAX)
+#define FLOAT_FIELD(name, live) \
+	FIELD(name, CONFIG_FIELD_FLOAT, live, -FLT_MAX, FLT_MAX)
+#define INT_RANGE(name, live, min, max) \
+	FIELD(name, CONFIG_FIELD_INT, live, min, max)
+#define FLOAT_RANGE(name, live, min, max) \
+	FIELD(name, CONFIG_FIELD_FLOAT, live, min, max)
+
+/**
+ * The fields of conf_t that can be read and changed by name (the lists,
+ * route and threshold_bands, can't). Fields used as image rows, widths,
+ * counts or table indices are limited to the values the image processing
+ * can handle.
+ */
+const config_field_t config_fields[] = 
+{
+	INT_FIELD(speed_straight, 1),
+	INT_FIELD(speed_slow, 1),
+	INT_FIELD(speed_normal, 1),
+	INT_FIELD(speed_fast, 1),
+
+	FLOAT_FIELD(k_p, 1),
+	FLOAT_FIELD(k_i, 1),
+	FLOAT_FIELD(k_d, 1),
+	FLOAT_FIELD(k_error, 1),
+	FLOAT_FIELD(k_error_diff, 1),
+	FLOAT_FIELD(k_p_fast, 1),
+	FLOAT_FIELD(k_i_fast, 1),
+	FLOAT_FIELD(k_d_fast, 1),
+
+	FLOAT_FIELD(w_k_p, 1),
+	FLOAT_FIELD(w_k_i, 1),
+	FLOAT_FIELD(w_k_d, 1),
+	FLOAT_FIELD(w_diff_p, 1),
+	INT_FIELD(w_speed, 1),
+	INT_FIELD(w_setpoint, 1),
+	INT_FIELD(w_max_sum_error, 1),
+	INT_FIELD(w_max_error, 1),
+
+	INT_FIELD(mass_horizontal_lower, 1),
+	INT_FIELD(mass_horizontal_upper, 1),
+	INT_FIELD(mass_cross_lower, 1),
+	INT_FIELD(mass_cross_upper, 1),
+	INT_FIELD(mass_bypath_lower, 1),
+	INT_FIELD(mass_bypath_upper, 1),
+	INT_FIELD(mass_end_lower, 1),
+	INT_FIELD(mass_end_upper, 1),
+
+	INT_RANGE(slice_upper_start, 1, 0, HEIGHT),
+	INT_RANGE(slice_upper_end, 1, 0, HEIGHT),
+	INT_RANGE(slice_lower_start, 1, 0, HEIGHT),
+	INT_RANGE(slice_lower_end, 1, 0, HEIGHT),
+
+	FLOAT_RANGE(k_brightness, 1, -255, 255),
+	FLOAT_RANGE(k_contrast, 1, 0, 16),
+	FLOAT_RANGE(k_gamma, 1, 0.05, 20),
+
+	FLOAT_RANGE(denoise_alpha, 1, 0, 1),
+	INT_RANGE(denoise_motion, 1, 0, 255),
+
+	INT_FIELD(flatfield, 0),
+
+	INT_RANGE(skip_unchanged, 1, 0, 1),
+	INT_RANGE(skip_grid, 1, 4, HEIGHT),
+	INT_RANGE(skip_tolerance, 1, 0, 255),
+
+	INT_RANGE(avg_mass_count, 1, 1, 100),
+
+	INT_RANGE(use_classifier, 1, 0, 1),
+	INT_RANGE(classifier_min_confidence, 1, 0, 100),
+	INT_RANGE(run_min_width, 1, 1, WIDTH),
+	INT_RANGE(blob_min_area, 1, 0, IMG_SIZE),
+	INT_RANGE(track_wide_width, 1, 1, WIDTH),
+	INT_RANGE(track_wide_rows, 1, 1, HEIGHT),
+	INT_RANGE(track_fork_rows, 1, 1, HEIGHT),
+	INT_RANGE(track_end_rows, 1, 1, HEIGHT),
+	INT_RANGE(fork_passed_frames, 1, 0, 1000),
+
+	INT_RANGE(detector, 1, DETECTOR_THRESHOLD, DETECTOR_EDGE),
+	INT_RANGE(edge_threshold, 1, 0, 4 * 255),
+	INT_RANGE(edge_max_width, 1, 1, WIDTH),
+
+	INT_RANGE(hough_angle_min, 1, -180, 180),
+	INT_RANGE(hough_angle_max, 1, -180, 180),
+	INT_RANGE(hough_sample, 1, 0, 100),
+	INT_RANGE(hough_min_votes, 1, 0, 65535),
+	INT_RANGE(hough_turn, 1, 0, 1),
+
+	FLOAT_RANGE(tracker_alpha, 1, 0, 1),
+	FLOAT_RANGE(tracker_beta, 1, 0, 1),
+	INT_RANGE(tracker_coast_ms, 1, 0, 10000),
+
+	INT_FIELD(shadow_cpu, 0),
+	INT_FIELD(shadow_tolerance, 0),
+
+	INT_RANGE(governor_max_level, 1, 0, GOVERNOR_LEVELS - 1),
+	INT_RANGE(governor_roi_start, 1, 0, HEIGHT),
+	INT_RANGE(governor_down_frames, 1, 1, 10000),
+	INT_RANGE(governor_up_frames, 1, 1, 10000),
+	FLOAT_RANGE(governor_high, 1, 0, 10),
+	FLOAT_RANGE(governor_low, 1, 0, 10),
+
+	INT_FIELD(mjpeg_port, 0),
+	INT_FIELD(mjpeg_quality, 0),
+	INT_FIELD(mjpeg_fps, 0),
+	INT_FIELD(mjpeg_budget_us, 0),
+
+	INT_FIELD(telemetry_port, 0),
+	INT_FIELD(telemetry_ttl, 0),
+
+	INT_FIELD(shm_slots, 0),
+
+	INT_FIELD(dist_15_upper, 1),
+	INT_FIELD(dist_15_lower, 1),
+	INT_FIELD(dist_20_upper, 1),
+	INT_FIELD(dist_20_lower, 1),
+	INT_FIELD(dist_side_disappear_1, 1),
+	INT_FIELD(dist_side_disappear_2, 1),
+
+	INT_FIELD(undistort, 0),
+	FLOAT_FIELD(cam_fx, 0),
+	FLOAT_FIELD(cam_fy, 0),
+	FLOAT_FIELD(cam_cx, 0),
+	FLOAT_FIELD(cam_cy, 0),
+	FLOAT_FIELD(cam_k1, 0),
+	FLOAT_FIELD(cam_k2, 0),
+	FLOAT_FIELD(cam_k3, 0),
+	FLOAT_FIELD(cam_p1, 0),
+	FLOAT_FIELD(cam_p2, 0),
+};
+
+const int config_n_fields = sizeof(config_fields) / sizeof(config_fields[0]);
+
+/**
+ * Look up a field of conf_t by its name in the configuration file
+ *
+ * \return The field, or NULL if there is no such field
+ */
+const config_field_t * config_find_field(const char * name)
+{
+	int i;
+
+	for (i = 0; i < config_n_fields; i++)
+	{
+		if (strcmp(config_fields[i].name, name) == 0)
+		{
+			return &config_fields[i];
+		}
+	}
+	return NULL;
+}
+
+double config_get_field(const config_field_t * field)
+{
+	const char * p = (const char *) &conf + field->offset;
+
+	if (field->type == CONFIG_FIELD_FLOAT)
+	{
+		return *(const float *) p;
+	}
+	return *(const int *) p;
+}
+
+/**
+ * Change a field of conf. Integer fields are rounded to the nearest
+ * integer. Values outside the range of the field are not applied.
+ *
+ * \return 0 on success, -1 if the value is out of range
+ */
+int config_set_field(const config_field_t * field, double value)
+{
+	char * p = (char *) &conf + field->offset;
+
+	// Also false for NaN
+	if (!(value >= field->min && value <= field->max))
+	{
+		return -1;
+	}
+
+	if (field->type == CONFIG_FIELD_FLOAT)
+	{
+		*(float *) p = (float) value;
+	}
+	else
+	{
+		*(int *) p = (int) (value < 0 ? value - 0.5 : value + 0.5);
+	}
+	return 0;
+}
@@ -3,6 +3,15 @@
 #ifndef _CONFIGURATION_H_
 #define _CONFIGURATION_H_
 
+#define CONF_MAX_BANDS			16
+#define CONF_MAX_ROUTE			16
+
+#define ROUTE_LEFT				'L'
+#define ROUTE_RIGHT				'R'
+
+#define DETECTOR_THRESHOLD		0
+#define DETECTOR_EDGE			1
+
 typedef struct conf {
 
 	// Speeds
@@ -29,10 +38,77 @@ typedef struct conf {
 	int slice_upper_start, slice_upper_end;
 	int slice_lower_start, slice_lower_end;
 
+	// Contrast lookup table
+	float k_brightness, k_contrast, k_gamma;
+
+	// Temporal noise filter
+	float denoise_alpha;
+	int denoise_motion;
+
+	// Flat-field correction
+	int flatfield;
+
+	// Skipping of unchanged frames while idle
+	int skip_unchanged, skip_grid, skip_tolerance;
+
+	// Number of frames the line mass is averaged over
+	int avg_mass_count;
+
+	// Track feature classifier
+	int use_classifier, classifier_min_confidence;
+	int run_min_width;
+	// Smallest region of line pixels kept by the `blobs` stage
+	int blob_min_area;
+	int track_wide_width, track_wide_rows, track_fork_rows, track_end_rows;
+
+	// Branch to take at each fork, in order (ROUTE_LEFT / ROUTE_RIGHT)
+	char route[CONF_MAX_ROUTE];
+	int n_route;
+	int fork_passed_frames;
+
+	// Row boundaries of the thresholding bands
+	int threshold_bands[CONF_MAX_BANDS + 1];
+	int n_threshold_bands;
+
+	// Line detector used by the `detect` stage (DETECTOR_*)
+	int detector;
+	int edge_threshold, edge_max_width;
+
+	// Straight line fitting (Hough transform)
+	int hough_angle_min, hough_angle_max;
+	int hough_sample, hough_min_votes;
+	int hough_turn;
+
+	// Line tracker gains, and how long it may bridge a lost line
+	float tracker_alpha, tracker_beta;
+	int tracker_coast_ms;
+
+	// Shadow pipeline
+	int shadow_cpu, shadow_tolerance;
+
+	// Quality governor
+	int governor_max_level, governor_roi_start;
+	int governor_down_frames, governor_up_frames;
+	float governor_high, governor_low;
+
+	// Gray image stream (MJPEG over HTTP)
+	int mjpeg_port, mjpeg_quality, mjpeg_fps, mjpeg_budget_us;
+
+	// Per-frame UDP datagrams (the address is read with config_get_str)
+	int telemetry_port, telemetry_ttl;
+
+	// Frames kept in the shared memory ring (0: disabled)
+	int shm_slots;
+
 	int dist_15_upper, dist_15_lower;
 	int dist_20_upper, dist_20_lower;
 	int dist_side_disappear_1, dist_side_disappear_2;
 
+	// Lens distortion correction
+	int undistort;
+	float cam_fx, cam_fy, cam_cx, cam_cy;
+	float cam_k1, cam_k2, cam_k3, cam_p1, cam_p2;
+
 } conf_t;
 
 
@@ -41,12 +117,38 @@ typedef struct conf {
  */
 extern conf_t conf;
 
+/**
+ * Field of conf_t that can be read and changed by name (see 
+ * config_find_field). Fields that are only used when the configuration
+ * is loaded are not live: changing them takes a reload. Changes are
+ * limited to the range min - max.
+ */
+#define CONFIG_FIELD_INT		1
+#define CONFIG_FIELD_FLOAT		2
+
+typedef struct config_field {
+	const char * name;
+	int type;
+	int offset;
+	int live;
+	double min, max;
+} config_field_t;
+
+extern const config_field_t config_fields[];
+extern const int config_n_fields;
+
 
 void config_init();
 int config_reload();
 char * config_get_str(const char * name);
 float config_get_float(const char * name);
 int config_get_int(const char * name);
+int config_get_list_size(const char * name);
+char * config_get_nstr(const char * name, int index);
+int config_get_nint(const char * name, int index);
+const config_field_t * config_find_field(const char * name);
+double config_get_field(const config_field_t * field);
+int config_set_field(const config_field_t * field, double value);
 
 #endif
 
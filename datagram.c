@@ -0,0 +1,123 @@
+
+#include "datagram.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/**
+ * Sends the result of every frame as a UDP datagram (see telemetry.h), 
+ * to a single host or a multicast group. Datagrams are sent straight 
+ * from the vision thread without waiting: one that doesn't fit in the
+ * socket buffer is dropped.
+ */
+
+static int socket_fd = -1;
+static struct sockaddr_in destination;
+
+/**
+ * Held while the socket is replaced. The vision thread skips the
+ * datagram instead of waiting for it.
+ */
+static pthread_mutex_t socket_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long n_sent, n_failed;
+
+/**
+ * Send the datagrams to the given address and port. A multicast address
+ * is sent to with the given TTL. An empty address stops sending.
+ *
+ * \return 0 on success, -1 if the address can't be used
+ */
+int datagram_open(const char * address, int port, int ttl)
+{
+	struct sockaddr_in addr;
+	unsigned char mttl = ttl;
+	int fd = -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+
+	if (address != NULL && address[0] != '\0')
+	{
+		if (inet_aton(address, &addr.sin_addr) == 0)
+		{
+			printf("[datagram] Invalid address %s\n", address);
+			return -1;
+		}
+
+		fd = socket(AF_INET, SOCK_DGRAM, 0);
+		if (fd < 0)
+		{
+			perror("[datagram] socket()");
+			return -1;
+		}
+
+		if (IN_MULTICAST(ntohl(addr.sin_addr.s_addr)))
+		{
+			setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &mttl, sizeof(mttl));
+		}
+	}
+
+	pthread_mutex_lock(&socket_mutex);
+	if (socket_fd >= 0)
+	{
+		close(socket_fd);
+	}
+	socket_fd = fd;
+	destination = addr;
+	pthread_mutex_unlock(&socket_mutex);
+
+	if (fd >= 0)
+	{
+		printf("[datagram] Sending frame results to %s:%d\n", address, port);
+	}
+	return 0;
+}
+
+/**
+ * Complete the header of the datagram and send it. The caller fills in
+ * the sequence number and timestamp of the header, and the blocks.
+ */
+void datagram_send(telemetry_datagram_t * datagram)
+{
+	if (pthread_mutex_trylock(&socket_mutex) != 0)
+	{
+		return;
+	}
+
+	if (socket_fd >= 0)
+	{
+		datagram->header.magic = TELEMETRY_DATAGRAM_MAGIC;
+		datagram->header.version = TELEMETRY_VERSION;
+		datagram->header.fields_size = sizeof(telemetry_fields_t);
+		datagram->control.size = sizeof(telemetry_control_t);
+		datagram->header.length = sizeof(telemetry_datagram_t);
+
+		if (sendto(socket_fd, datagram, sizeof(telemetry_datagram_t), 
+			MSG_DONTWAIT, (struct sockaddr *) &destination, 
+			sizeof(destination)) < 0)
+		{
+			n_failed++;
+		}
+		else
+		{
+			n_sent++;
+		}
+	}
+
+	pthread_mutex_unlock(&socket_mutex);
+}
+
+void datagram_print_stats()
+{
+	printf("Datagrams: %lu sent, %lu dropped\n", n_sent, n_failed);
+}
+
@@ -0,0 +1,12 @@
+
+#ifndef _DATAGRAM_H_
+#define _DATAGRAM_H_
+
+#include "telemetry.h"
+
+int datagram_open(const char * address, int port, int ttl);
+void datagram_send(telemetry_datagram_t * datagram);
+void datagram_print_stats();
+
+#endif
+
@@ -0,0 +1,134 @@
+
+#include "common.h"
+#include "edge.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+
+/**
+ * Vertical part of the 3x3 Sobel operator: s = above + 2 * cur + below.
+ * The horizontal derivative of `s` is the horizontal Sobel gradient.
+ */
+static void smooth_rows(const unsigned char * above,
+	const unsigned char * cur, const unsigned char * below, uint16_t * s)
+{
+	int x;
+
+#ifdef __ARM_NEON__
+	for (x = 0; x < WIDTH; x += 8)
+	{
+		vst1q_u16(s + x, vaddq_u16(vaddl_u8(vld1_u8(above + x),
+			vld1_u8(below + x)), vshll_n_u8(vld1_u8(cur + x), 1)));
+	}
+#else
+	for (x = 0; x < WIDTH; x++)
+	{
+		s[x] = above[x] + 2 * cur[x] + below[x];
+	}
+#endif
+}
+
+/**
+ * Find the line segments of a single row. The line is darker than the
+ * floor, so it starts at a falling edge (strong negative gradient) and
+ * ends at the following rising edge. Each edge is placed at the extremum
+ * of the gradient. Pairs further apart than `max_width` are rejected.
+ */
+static inline void mark_segment(unsigned char * out, int fall, int rise,
+	int max_width)
+{
+	if (rise - fall <= max_width)
+	{
+		memset(out + fall, LINE, rise - fall + 1);
+	}
+}
+
+static void pair_edges(const uint16_t * s, unsigned char * out,
+	int threshold, int max_width)
+{
+	int x, g, in_fall = 0;
+	int fall = -1, fall_g = 0, rise = -1, rise_g = 0;
+
+	memset(out, FLOOR, WIDTH);
+
+	for (x = 1; x < WIDTH - 1; x++)
+	{
+		g = (int) s[x + 1] - (int) s[x - 1];
+
+		if (g < -threshold)
+		{
+			if (rise >= 0)
+			{
+				mark_segment(out, fall, rise, max_width);
+				rise = -1;
+			}
+			// A new falling edge replaces an unpaired one
+			if (!in_fall || g < fall_g)
+			{
+				fall = x;
+				fall_g = g;
+			}
+			in_fall = 1;
+		}
+		else
+		{
+			in_fall = 0;
+
+			if (g > threshold && fall >= 0)
+			{
+				if (rise < 0 || g > rise_g)
+				{
+					rise = x;
+					rise_g = g;
+				}
+			}
+			else if (rise >= 0)
+			{
+				// The rising edge has ended
+				mark_segment(out, fall, rise, max_width);
+				fall = rise = -1;
+			}
+		}
+	}
+
+	if (rise >= 0)
+	{
+		mark_segment(out, fall, rise, max_width);
+	}
+}
+
+/**
+ * Edge based line detection. For every row in [start, end) the horizontal
+ * Sobel gradient is calculated, and pairs of falling and rising edges are
+ * marked as line in the binary image. The result can be used in place of
+ * the thresholded image.
+ *
+ * \param gray Gray image
+ * \param bin Binary image (only rows start to end are written)
+ * \param start First row
+ * \param end Row after the last row
+ * \param threshold Minimum gradient magnitude of an edge
+ * \param max_width Maximum width of the line in pixels
+ */
+void edge_detect(const unsigned char * gray, unsigned char * bin, int start,
+	int end, int threshold, int max_width)
+{
+	uint16_t s[WIDTH] __attribute__ ((aligned (16)));
+	const unsigned char * above, * below;
+	int y;
+
+	for (y = start; y < end; y++)
+	{
+		// Repeat the border rows
+		above = gray + INDEX((y > 0 ? y - 1 : y));
+		below = gray + INDEX((y < HEIGHT - 1 ? y + 1 : y));
+
+		smooth_rows(above, gray + INDEX(y), below, s);
+		pair_edges(s, bin + INDEX(y), threshold, max_width);
+	}
+}
+
@@ -0,0 +1,9 @@
+
+#ifndef _EDGE_H_
+#define _EDGE_H_
+
+void edge_detect(const unsigned char * gray, unsigned char * bin, int start,
+	int end, int threshold, int max_width);
+
+#endif
+
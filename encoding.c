@@ -0,0 +1,224 @@
+
+#include "encoding.h"
+
+#include <string.h>
+
+/**
+ * Pack the image into 1 bit per pixel, most significant bit first. Pixels
+ * that are not 0 (floor) become 1.
+ *
+ * \param src Image
+ * \param pixels Number of pixels in the image
+ * \param dst Buffer of ENCODING_BITS_SIZE(pixels) bytes
+ * \return Size of the packed image
+ */
+int encode_bits(const unsigned char * src, int pixels, unsigned char * dst)
+{
+	int i, size = ENCODING_BITS_SIZE(pixels);
+	unsigned char b;
+
+	memset(dst, 0, size);
+	for (i = 0; i + 8 <= pixels; i += 8)
+	{
+		b = (src[i] ? 0x80 : 0) | (src[i + 1] ? 0x40 : 0)
+			| (src[i + 2] ? 0x20 : 0) | (src[i + 3] ? 0x10 : 0)
+			| (src[i + 4] ? 0x08 : 0) | (src[i + 5] ? 0x04 : 0)
+			| (src[i + 6] ? 0x02 : 0) | (src[i + 7] ? 0x01 : 0);
+		dst[i >> 3] = b;
+	}
+	for (; i < pixels; i++)
+	{
+		if (src[i])
+		{
+			dst[i >> 3] |= 0x80 >> (i & 7);
+		}
+	}
+	return size;
+}
+
+/**
+ * Unpack a 1 bit per pixel image, into pixels of 0 and 255
+ */
+int decode_bits(const unsigned char * src, int size, unsigned char * dst, 
+	int pixels)
+{
+	int i;
+
+	if (size < ENCODING_BITS_SIZE(pixels))
+	{
+		return -1;
+	}
+
+	for (i = 0; i < pixels; i++)
+	{
+		dst[i] = (src[i >> 3] & (0x80 >> (i & 7))) ? 255 : 0;
+	}
+	return 0;
+}
+
+/**
+ * Write a run: the value, followed by the length as a base 128 varint 
+ * (low 7 bits first, high bit set when more bytes follow).
+ */
+static int put_run(unsigned char * dst, int n, int max, unsigned char value, 
+	int length)
+{
+	if (n + 1 > max)
+	{
+		return -1;
+	}
+	dst[n++] = value;
+
+	while (length >= 0x80)
+	{
+		if (n + 1 > max)
+		{
+			return -1;
+		}
+		dst[n++] = (length & 0x7f) | 0x80;
+		length >>= 7;
+	}
+
+	if (n + 1 > max)
+	{
+		return -1;
+	}
+	dst[n++] = length;
+	return n;
+}
+
+/**
+ * Run-length encode src, or src XOR prev if prev is given
+ */
+static int rle(const unsigned char * src, const unsigned char * prev, 
+	int pixels, unsigned char * dst, int max)
+{
+	int i, start = 0, n = 0;
+	unsigned char value, v;
+
+	if (pixels == 0)
+	{
+		return 0;
+	}
+
+	value = prev ? src[0] ^ prev[0] : src[0];
+	for (i = 1; i < pixels; i++)
+	{
+		v = prev ? src[i] ^ prev[i] : src[i];
+		if (v != value)
+		{
+			if ((n = put_run(dst, n, max, value, i - start)) < 0)
+			{
+				return -1;
+			}
+			value = v;
+			start = i;
+		}
+	}
+	return put_run(dst, n, max, value, pixels - start);
+}
+
+/**
+ * Decode runs. With `xor` set the runs are applied to the image in dst
+ * instead of replacing it.
+ */
+static int unrle(const unsigned char * src, int size, unsigned char * dst, 
+	int pixels, int xor)
+{
+	int i = 0, n = 0, length, shift, k;
+	unsigned char value;
+
+	while (i < pixels)
+	{
+		if (n >= size)
+		{
+			return -1;
+		}
+		value = src[n++];
+
+		length = 0;
+		shift = 0;
+		do
+		{
+			if (n >= size || shift > 21)
+			{
+				return -1;
+			}
+			length |= (src[n] & 0x7f) << shift;
+			shift += 7;
+		}
+		while (src[n++] & 0x80);
+
+		if (length > pixels - i)
+		{
+			return -1;
+		}
+
+		if (xor)
+		{
+			if (value != 0)
+			{
+				for (k = 0; k < length; k++)
+				{
+					dst[i + k] ^= value;
+				}
+			}
+		}
+		else
+		{
+			memset(dst + i, value, length);
+		}
+		i += length;
+	}
+	return 0;
+}
+
+/**
+ * Run-length encode the image as runs of (value, varint length). A binary
+ * image with a line in it takes a few bytes per row.
+ *
+ * \param src Image
+ * \param pixels Number of pixels in the image
+ * \param dst Output buffer
+ * \param max Size of the output buffer
+ * \return Size of the encoded image, or -1 if it doesn't fit
+ */
+int encode_rle(const unsigned char * src, int pixels, unsigned char * dst, 
+	int max)
+{
+	return rle(src, NULL, pixels, dst, max);
+}
+
+int decode_rle(const unsigned char * src, int size, unsigned char * dst, 
+	int pixels)
+{
+	return unrle(src, size, dst, pixels, 0);
+}
+
+/**
+ * Encode the difference to the previous image: the run-length encoded 
+ * XOR of the two images. Unchanged parts of the image become long runs of
+ * zeros.
+ *
+ * \param src Image
+ * \param prev Previous image, as the receiver has it
+ * \param pixels Number of pixels in the image
+ * \param dst Output buffer
+ * \param max Size of the output buffer
+ * \return Size of the encoded difference, or -1 if it doesn't fit
+ */
+int encode_delta(const unsigned char * src, const unsigned char * prev, 
+	int pixels, unsigned char * dst, int max)
+{
+	return rle(src, prev, pixels, dst, max);
+}
+
+/**
+ * Apply a difference to the previous image in dst
+ */
+int decode_delta(const unsigned char * src, int size, unsigned char * dst, 
+	int pixels)
+{
+	return unrle(src, size, dst, pixels, 1);
+}
+
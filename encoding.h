@@ -0,0 +1,36 @@
+
+#ifndef _ENCODING_H_
+#define _ENCODING_H_
+
+#include <stdint.h>
+
+/**
+ * Encoders and decoders for the images sent by the broadcast server (see 
+ * the TELEMETRY_* encodings in telemetry.h). Shared with the viewer.
+ *
+ * The encoders return the size of the encoded image, or -1 if it doesn't 
+ * fit in `max` bytes (the image should then be sent raw). The decoders
+ * return 0, or -1 if the data is malformed.
+ */
+
+/**
+ * Size of a 1 bit per pixel image
+ */
+#define ENCODING_BITS_SIZE(pixels)	(((pixels) + 7) / 8)
+
+int encode_bits(const unsigned char * src, int pixels, unsigned char * dst);
+int decode_bits(const unsigned char * src, int size, unsigned char * dst, 
+	int pixels);
+
+int encode_rle(const unsigned char * src, int pixels, unsigned char * dst, 
+	int max);
+int decode_rle(const unsigned char * src, int size, unsigned char * dst, 
+	int pixels);
+
+int encode_delta(const unsigned char * src, const unsigned char * prev, 
+	int pixels, unsigned char * dst, int max);
+int decode_delta(const unsigned char * src, int size, unsigned char * dst, 
+	int pixels);
+
+#endif
+
@@ -0,0 +1,255 @@
+/**
+ * Remote control of a running eyecam through the broadcast server.
+ *
+ * Usage: eyectl [-h host] command
+ *
+ *   ping [n]             Send n pings (default 10) and print the round trip
+ *   start                Start the run with the current configuration
+ *   stop                 Brake and wait
+ *   state <n>            Go to state n (state_t in main.c)
+ *   get <field>          Print a configuration field
+ *   set <field> <value>  Change a configuration field while running (values
+ *                        outside the range of the field are refused)
+ *   dump                 Print all configuration fields
+ *
+ * Commands are applied at the start of the next frame. Each response
+ * shows the round trip, and how long the command waited for that frame.
+ * Changes are not written to eyebot.conf.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+
+#include "receiver.h"
+#include "timer.h"
+
+#define PORT				"24000"
+
+static const char * status_names[] = {
+	"ok",
+	"unknown command",
+	"unknown field",
+	"only read when the configuration is loaded",
+	"value out of range",
+	"busy"
+};
+
+static int connect_to(const char * host)
+{
+	struct addrinfo hints, * res;
+	struct timeval tv = { 2, 0 };
+	int fd, nodelay = 1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, PORT, &hints, &res) != 0)
+	{
+		fprintf(stderr, "Unknown host %s\n", host);
+		return -1;
+	}
+
+	fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (fd < 0 || connect(fd, res->ai_addr, res->ai_addrlen) < 0)
+	{
+		perror("connect");
+		freeaddrinfo(res);
+		return -1;
+	}
+	freeaddrinfo(res);
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+	// Don't wait forever for a response
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	return fd;
+}
+
+/**
+ * Wait for the next response to the command with the given id
+ */
+static int read_response(receiver_t * rx, uint32_t id,
+	telemetry_response_t * response)
+{
+	telemetry_header_t header;
+	telemetry_fields_t fields;
+	unsigned char * payload;
+	int size;
+
+	while (1)
+	{
+		size = receiver_read(rx, &header, &fields, &payload);
+		if (size < 0)
+		{
+			return -1;
+		}
+		if (header.magic != TELEMETRY_RESPONSE_MAGIC
+			|| size < (int) sizeof(telemetry_response_t))
+		{
+			continue;
+		}
+		memcpy(response, payload, sizeof(telemetry_response_t));
+		if (response->id == id)
+		{
+			return 0;
+		}
+	}
+}
+
+static void print_value(const telemetry_response_t * response)
+{
+	if (response->type == TELEMETRY_VALUE_FLOAT)
+	{
+		printf("%s = %g", response->name, response->value);
+	}
+	else if (response->type == TELEMETRY_VALUE_INT)
+	{
+		printf("%s = %d", response->name, (int) response->value);
+	}
+}
+
+static void usage(const char * name)
+{
+	fprintf(stderr, "Usage: %s [-h host] ping [n] | start | stop | "
+		"state <n> | get <field> | set <field> <value> | dump\n", name);
+	exit(1);
+}
+
+int main(int argc, char ** argv)
+{
+	const char * host = "10.42.0.71";
+	telemetry_subscription_t sub;
+	telemetry_command_t command;
+	telemetry_response_t response;
+	receiver_t rx;
+	long long sent_us, rtt, total = 0, max = 0;
+	int fd, i = 1, pings = 1, n = 0;
+
+	if (argc > 2 && strcmp(argv[1], "-h") == 0)
+	{
+		host = argv[2];
+		i = 3;
+	}
+	if (i >= argc)
+	{
+		usage(argv[0]);
+	}
+
+	memset(&command, 0, sizeof(command));
+	if (strcmp(argv[i], "ping") == 0)
+	{
+		command.op = TELEMETRY_CMD_PING;
+		pings = i + 1 < argc ? atoi(argv[i + 1]) : 10;
+	}
+	else if (strcmp(argv[i], "start") == 0)
+	{
+		command.op = TELEMETRY_CMD_START;
+	}
+	else if (strcmp(argv[i], "stop") == 0)
+	{
+		command.op = TELEMETRY_CMD_STOP;
+	}
+	else if (strcmp(argv[i], "state") == 0 && i + 1 < argc)
+	{
+		command.op = TELEMETRY_CMD_STATE;
+		command.value = atoi(argv[i + 1]);
+	}
+	else if (strcmp(argv[i], "get") == 0 && i + 1 < argc)
+	{
+		command.op = TELEMETRY_CMD_GET;
+		strncpy(command.name, argv[i + 1], TELEMETRY_NAME_SIZE - 1);
+	}
+	else if (strcmp(argv[i], "set") == 0 && i + 2 < argc)
+	{
+		command.op = TELEMETRY_CMD_SET;
+		strncpy(command.name, argv[i + 1], TELEMETRY_NAME_SIZE - 1);
+		command.value = atof(argv[i + 2]);
+	}
+	else if (strcmp(argv[i], "dump") == 0)
+	{
+		command.op = TELEMETRY_CMD_DUMP;
+	}
+	else
+	{
+		usage(argv[0]);
+	}
+
+	fd = connect_to(host);
+	if (fd < 0 || receiver_init(&rx, fd) < 0)
+	{
+		return 1;
+	}
+
+	// No frames, only the responses
+	memset(&sub, 0, sizeof(sub));
+	sub.divisor = 1;
+	if (receiver_subscribe(fd, &sub) < 0)
+	{
+		perror("send");
+		return 1;
+	}
+
+	for (command.id = 1; command.id <= (uint32_t) pings; command.id++)
+	{
+		sent_us = timer_now_us();
+		if (receiver_command(fd, &command) < 0)
+		{
+			perror("send");
+			return 1;
+		}
+
+		do
+		{
+			if (read_response(&rx, command.id, &response) < 0)
+			{
+				fprintf(stderr, "No response\n");
+				return 1;
+			}
+			rtt = timer_now_us() - sent_us;
+
+			print_value(&response);
+			if (response.status != TELEMETRY_OK)
+			{
+				printf("%s%s", response.type != TELEMETRY_VALUE_NONE ?
+					": " : "", response.status < 6 ?
+					status_names[response.status] : "error");
+			}
+			if (command.op != TELEMETRY_CMD_DUMP)
+			{
+				printf("%sstate %d, frame %u, round trip %lld us (%u us "
+					"waiting for the frame)\n",
+					response.type != TELEMETRY_VALUE_NONE
+					|| response.status != TELEMETRY_OK ? ", " : "",
+					response.state, response.frame, rtt, response.wait_us);
+			}
+			else
+			{
+				printf("\n");
+			}
+		}
+		while (response.remaining > 0);
+
+		n++;
+		total += rtt;
+		if (rtt > max)
+		{
+			max = rtt;
+		}
+	}
+
+	if (command.op == TELEMETRY_CMD_PING && n > 1)
+	{
+		printf("%d pings, round trip avg %lld us, max %lld us\n", n, total / n,
+			max);
+	}
+
+	close(fd);
+	receiver_free(&rx);
+	return 0;
+}
@@ -0,0 +1,280 @@
+
+#include "common.h"
+#include "flatfield.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * Memory mapped gain map file, and a pointer to the gains in it
+ */
+static void * map = NULL;
+static size_t map_size = 0;
+static const uint16_t * gains = NULL;
+
+/**
+ * Calibration state. The sum of the gray levels of every pixel over the
+ * captured frames. The frames are added while `capturing` is set; after
+ * that the sum belongs to the thread writing the gain map.
+ */
+static uint32_t * sum = NULL;
+static int capturing = 0;
+static int frames_wanted = 0, frames_captured = 0;
+static char capture_file[256];
+
+/**
+ * Map the gain map file into memory.
+ *
+ * \param file Path to the file
+ * \return 0 on success, -1 if the file is missing or invalid
+ */
+int flatfield_load(const char * file)
+{
+	struct stat st;
+	const flatfield_header_t * hdr;
+	void * ptr;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+	{
+		printf("[flatfield] No gain map '%s', correction disabled\n", file);
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0 || st.st_size !=
+		(off_t) (sizeof(flatfield_header_t) + IMG_SIZE * sizeof(uint16_t)))
+	{
+		printf("[flatfield] Gain map '%s' has the wrong size\n", file);
+		close(fd);
+		return -1;
+	}
+
+	ptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED)
+	{
+		perror("[flatfield] mmap()");
+		return -1;
+	}
+
+	hdr = (const flatfield_header_t *) ptr;
+	if (memcmp(hdr->magic, FLATFIELD_MAGIC, 4) != 0 ||
+		hdr->version != FLATFIELD_VERSION || hdr->width != WIDTH ||
+		hdr->height != HEIGHT)
+	{
+		printf("[flatfield] Gain map '%s' is not valid for %dx%d\n", file,
+			WIDTH, HEIGHT);
+		munmap(ptr, st.st_size);
+		return -1;
+	}
+
+	flatfield_unload();
+	map = ptr;
+	map_size = st.st_size;
+	gains = (const uint16_t *) (hdr + 1);
+
+	printf("[flatfield] Loaded gain map '%s'\n", file);
+	return 0;
+}
+
+/**
+ * Unmap the gain map, disabling the correction.
+ */
+void flatfield_unload()
+{
+	if (map != NULL)
+	{
+		gains = NULL;
+		munmap(map, map_size);
+		map = NULL;
+	}
+}
+
+/**
+ * Return the gain map, or NULL if no correction should be applied.
+ * The correction is disabled while capturing calibration frames.
+ */
+const uint16_t * flatfield_gains()
+{
+	return capturing ? NULL : gains;
+}
+
+/**
+ * Start capturing frames of a blank floor. Called between two frames
+ * (holding the lock of the frame loop). When the given number of frames
+ * has been added by `flatfield_capture_add`, the capture stops and the
+ * gain map is written by `flatfield_capture_write`.
+ *
+ * \return 0 on success, -1 if already capturing or out of memory
+ */
+int flatfield_capture_start(int frames, const char * file)
+{
+	if (sum != NULL || frames <= 0)
+	{
+		return -1;
+	}
+
+	strncpy(capture_file, file, sizeof(capture_file) - 1);
+	capture_file[sizeof(capture_file) - 1] = '\0';
+	frames_wanted = frames;
+	frames_captured = 0;
+
+	sum = (uint32_t *) calloc(IMG_SIZE, sizeof(uint32_t));
+	capturing = sum != NULL;
+	return sum == NULL ? -1 : 0;
+}
+
+int flatfield_capturing()
+{
+	return capturing;
+}
+
+/**
+ * Number of frames added to the running (or finished) capture
+ */
+int flatfield_captured()
+{
+	return frames_captured;
+}
+
+/**
+ * Stop the capture and drop the frames added so far. Called between two
+ * frames.
+ */
+void flatfield_capture_cancel()
+{
+	capturing = 0;
+	free(sum);
+	sum = NULL;
+}
+
+/**
+ * Add a frame (uncorrected gray levels) to the calibration.
+ *
+ * \return 1 when the last frame has been added, 0 otherwise
+ */
+int flatfield_capture_add(const unsigned char * gray)
+{
+	int i;
+
+	if (!capturing)
+	{
+		return 0;
+	}
+
+	for (i = 0; i < IMG_SIZE; i++)
+	{
+		sum[i] += gray[i];
+	}
+
+	if (++frames_captured < frames_wanted)
+	{
+		return 0;
+	}
+
+	capturing = 0;
+	return 1;
+}
+
+/**
+ * Calculate the gains from the accumulated frames and write the file.
+ * Every pixel is scaled towards the average level of the whole frame.
+ * The file is replaced atomically, so a failed write leaves the old gain
+ * map in place.
+ */
+static int write_gain_map()
+{
+	flatfield_header_t hdr;
+	uint16_t * g;
+	uint64_t total = 0;
+	uint32_t gain;
+	char tmp_file[sizeof(capture_file) + 4];
+	FILE * fp;
+	int i, ok;
+
+	g = (uint16_t *) malloc(IMG_SIZE * sizeof(uint16_t));
+	if (g == NULL)
+	{
+		return -1;
+	}
+
+	for (i = 0; i < IMG_SIZE; i++)
+	{
+		total += sum[i];
+	}
+
+	for (i = 0; i < IMG_SIZE; i++)
+	{
+		gain = sum[i] > 0 ? (total * FLATFIELD_ONE / IMG_SIZE) / sum[i] :
+			FLATFIELD_MAX_GAIN;
+		g[i] = gain > FLATFIELD_MAX_GAIN ? FLATFIELD_MAX_GAIN : gain;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, FLATFIELD_MAGIC, 4);
+	hdr.version = FLATFIELD_VERSION;
+	hdr.width = WIDTH;
+	hdr.height = HEIGHT;
+
+	// The current gain map may still be mapped and read by the vision
+	// thread: write a new file and rename it over the old one, which
+	// keeps the old file valid until it is unmapped
+	snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", capture_file);
+	fp = fopen(tmp_file, "wb");
+	if (fp == NULL)
+	{
+		free(g);
+		return -1;
+	}
+	ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+		fwrite(g, sizeof(uint16_t), IMG_SIZE, fp) == IMG_SIZE &&
+		fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+	ok = fclose(fp) == 0 && ok;
+	free(g);
+
+	if (!ok || rename(tmp_file, capture_file) < 0)
+	{
+		unlink(tmp_file);
+		return -1;
+	}
+
+	printf("[flatfield] Average level %u, gain map written to '%s'\n",
+		(unsigned int) (total / ((uint64_t) IMG_SIZE * frames_captured)),
+		capture_file);
+	return 0;
+}
+
+/**
+ * Write the gain map of the finished capture to the file given to
+ * `flatfield_capture_start`, and free the capture. Called outside the
+ * frame loop once `flatfield_capturing` is zero, as writing the file
+ * takes too long for a frame. The gain map is not loaded.
+ *
+ * \return 0 on success, -1 if there is no finished capture or the file
+ * could not be written
+ */
+int flatfield_capture_write()
+{
+	int ret;
+
+	if (sum == NULL || capturing)
+	{
+		return -1;
+	}
+
+	ret = write_gain_map();
+	if (ret < 0)
+	{
+		printf("[flatfield] Failed writing gain map to '%s'\n", capture_file);
+	}
+
+	free(sum);
+	sum = NULL;
+	return ret;
+}
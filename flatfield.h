@@ -0,0 +1,41 @@
+
+#ifndef _FLATFIELD_H_
+#define _FLATFIELD_H_
+
+#include <stdint.h>
+
+/**
+ * Gains are stored as fixed-point numbers with FLATFIELD_SHIFT fractional
+ * bits and limited to FLATFIELD_MAX_GAIN, so a gray level times its gain
+ * always fits in 16 bits.
+ */
+#define FLATFIELD_SHIFT			6
+#define FLATFIELD_ONE			(1 << FLATFIELD_SHIFT)
+#define FLATFIELD_MAX_GAIN		255
+
+#define FLATFIELD_MAGIC			"EYFF"
+#define FLATFIELD_VERSION		1
+
+/**
+ * Header of the gain map file. The IMG_SIZE gains follow directly
+ * after the header (16 bytes, keeping them aligned for vector loads).
+ */
+typedef struct flatfield_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t width, height;
+} flatfield_header_t;
+
+int flatfield_load(const char * file);
+void flatfield_unload();
+const uint16_t * flatfield_gains();
+
+int flatfield_capture_start(int frames, const char * file);
+int flatfield_capturing();
+int flatfield_captured();
+void flatfield_capture_cancel();
+int flatfield_capture_add(const unsigned char * gray);
+int flatfield_capture_write();
+
+#endif
+
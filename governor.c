@@ -0,0 +1,126 @@
+
+#include "governor.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/**
+ * Weight of a new frame in the smoothed load
+ */
+#define LOAD_WEIGHT				0.1f
+
+static const char * level_names[GOVERNOR_LEVELS] = {
+	"full",
+	"no dump copy",
+	"half broadcast rate",
+	"single band",
+	"region of interest",
+	"decimated"
+};
+
+void governor_init(governor_t * g)
+{
+	memset(g, 0, sizeof(governor_t));
+	g->budget_us = 1000000 / 30;
+	g->high = 0.9f;
+	g->low = 0.6f;
+	g->down_frames = 5;
+	g->up_frames = 90;
+}
+
+/**
+ * Set the budget and limits. The level is kept, unless it is above the
+ * new maximum level.
+ *
+ * \param g The governor
+ * \param fps Capture rate (the budget is one frame interval)
+ * \param high Load (fraction of the budget) to step down above
+ * \param low Load to step back up below
+ * \param down_frames Frames above `high` needed to step down
+ * \param up_frames Frames below `low` needed to step up
+ * \param max_level Lowest quality allowed (0 disables the governor)
+ */
+void governor_configure(governor_t * g, int fps, float high, float low,
+	int down_frames, int up_frames, int max_level)
+{
+	g->budget_us = 1000000 / (fps > 0 ? fps : 30);
+	g->high = high;
+	g->low = low;
+	g->down_frames = down_frames;
+	g->up_frames = up_frames;
+
+	if (max_level < 0) max_level = 0;
+	if (max_level >= GOVERNOR_LEVELS) max_level = GOVERNOR_LEVELS - 1;
+	g->max_level = max_level;
+
+	if (g->level > max_level)
+	{
+		g->level = max_level;
+		printf("[governor] Level %d (%s)\n", g->level,
+			governor_level_name(g->level));
+	}
+	g->over = g->under = 0;
+}
+
+static void set_level(governor_t * g, int level)
+{
+	printf("[governor] Level %d -> %d (%s), load %.0f%% of %lld us\n",
+		g->level, level, governor_level_name(level), g->load * 100,
+		g->budget_us);
+
+	g->level = level;
+	g->over = g->under = 0;
+	g->changes++;
+}
+
+/**
+ * Add the processing time of a frame and adjust the quality level.
+ * A change of level is logged.
+ *
+ * \param g The governor
+ * \param frame_us Processing time of the frame in microseconds
+ * \return The (new) quality level
+ */
+int governor_update(governor_t * g, long long frame_us)
+{
+	float load = (float) frame_us / g->budget_us;
+	int level = g->level;
+
+	g->load += LOAD_WEIGHT * (load - g->load);
+
+	if (g->load > g->high)
+	{
+		g->under = 0;
+		if (++g->over >= g->down_frames && g->level < g->max_level)
+		{
+			set_level(g, g->level + 1);
+		}
+	}
+	else if (g->load < g->low)
+	{
+		g->over = 0;
+		if (++g->under >= g->up_frames && g->level > 0)
+		{
+			set_level(g, g->level - 1);
+		}
+	}
+	else
+	{
+		g->over = g->under = 0;
+	}
+
+	// Restart the smoothing at the new level, so the next decision is
+	// based on frames processed at that level
+	if (g->level != level)
+	{
+		g->load = load;
+	}
+
+	return g->level;
+}
+
+const char * governor_level_name(int level)
+{
+	return level >= 0 && level < GOVERNOR_LEVELS ? level_names[level] : "?";
+}
+
@@ -0,0 +1,50 @@
+
+#ifndef _GOVERNOR_H_
+#define _GOVERNOR_H_
+
+/**
+ * Quality levels, from full quality to the cheapest. Each level also
+ * includes the degradations of the levels below it.
+ */
+typedef enum {
+	GOVERNOR_FULL,
+	// Don't copy the frame for the `dump` command
+	GOVERNOR_NO_DUMP,
+	// Broadcast half as many frames
+	GOVERNOR_BROADCAST,
+	// Threshold all bands with a single threshold
+	GOVERNOR_SINGLE_BAND,
+	// Only detect the line in the region of interest (lower rows)
+	GOVERNOR_ROI,
+	// Only detect the line in every second row
+	GOVERNOR_DECIMATE,
+	GOVERNOR_LEVELS
+} governor_level_t;
+
+/**
+ * Keeps the frame processing time within the frame interval by stepping
+ * the quality level down when overloaded, and back up when there is
+ * headroom again.
+ */
+typedef struct governor {
+	int level, max_level;
+	// Frame interval in microseconds
+	long long budget_us;
+	// Smoothed processing time relative to the budget
+	float load;
+	// Step down above `high` load, step up below `low` load
+	float high, low;
+	// Consecutive frames above/below the limits needed to change level
+	int down_frames, up_frames;
+	int over, under;
+	unsigned long changes;
+} governor_t;
+
+void governor_init(governor_t * g);
+void governor_configure(governor_t * g, int fps, float high, float low,
+	int down_frames, int up_frames, int max_level);
+int governor_update(governor_t * g, long long frame_us);
+const char * governor_level_name(int level);
+
+#endif
+
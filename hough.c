@@ -0,0 +1,167 @@
+
+#include "common.h"
+#include "hough.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/**
+ * Fractional bits of the sin/cos tables
+ */
+#define TRIG_SHIFT				14
+
+#define RHO_BINS				(2 * HOUGH_MAX_RHO + 1)
+
+/**
+ * Sine and cosine of every whole degree from -180 to 179 (Q14). Built
+ * once, by the first thread fitting a line.
+ */
+static int16_t sin_table[360], cos_table[360];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static void build_tables()
+{
+	int i;
+	double a;
+
+	for (i = 0; i < 360; i++)
+	{
+		a = (i - 180) * PI / 180.0;
+		sin_table[i] = (int16_t) lround(sin(a) * (1 << TRIG_SHIFT));
+		cos_table[i] = (int16_t) lround(cos(a) * (1 << TRIG_SHIFT));
+	}
+}
+
+/**
+ * xorshift32, used to pick the pixels that vote
+ */
+static inline uint32_t next_random(uint32_t * seed)
+{
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 17;
+	*seed ^= *seed << 5;
+	return *seed;
+}
+
+/**
+ * A line pixel is on the border of the line if one of its four
+ * neighbours (inside rows start to end) is floor.
+ */
+static inline int is_border(const unsigned char * bin, int x, int y,
+	int start, int end)
+{
+	const unsigned char * p = bin + INDEX2(x, y);
+
+	return (x > 0 && p[-1] == FLOOR) || (x < WIDTH - 1 && p[1] == FLOOR) ||
+		(y > start && p[-WIDTH] == FLOOR) || (y < end - 1 && p[WIDTH] == FLOOR);
+}
+
+/**
+ * Find the dominant straight line in rows `start` to `end` of the binary
+ * image. The border pixels of the line vote for all lines through them
+ * within the configured angle range, using fixed-point sin/cos tables.
+ * Only a random sample of the pixels vote when params->sample is below
+ * 100, trading accuracy for time.
+ *
+ * Both borders of a line give a peak at the same angle. If a second peak
+ * is found within max_width pixels, the offset is the midpoint of the two,
+ * i.e. the center of the line.
+ *
+ * \param bin Binary image
+ * \param start First row
+ * \param end Row after the last row
+ * \param params Angle range and limits
+ * \param acc Accumulator (HOUGH_ACC_SIZE cells)
+ * \param seed State of the random sampling (not zero), kept by the caller
+ * so every thread has its own
+ * \param line The line found (votes is 0 if none was found)
+ */
+void hough_detect(const unsigned char * bin, int start, int end,
+	const hough_params_t * params, uint16_t * acc, uint32_t * seed,
+	hough_line_t * line)
+{
+	int x, y, a, n_angles, rho, best_a = 0, best_r = 0, best = 0, other, r;
+	const int16_t * sin_a, * cos_a;
+	const uint16_t * row;
+
+	memset(line, 0, sizeof(hough_line_t));
+
+	pthread_once(&tables_once, build_tables);
+
+	if (params->angle_min < -180 || params->angle_max > 180)
+	{
+		return;
+	}
+	n_angles = params->angle_max - params->angle_min;
+	if (n_angles <= 0 || n_angles > HOUGH_MAX_ANGLES)
+	{
+		return;
+	}
+
+	if (start < 0) start = 0;
+	if (end > HEIGHT) end = HEIGHT;
+
+	sin_a = sin_table + params->angle_min + 180;
+	cos_a = cos_table + params->angle_min + 180;
+	memset(acc, 0, n_angles * RHO_BINS * sizeof(uint16_t));
+
+	for (y = start; y < end; y++)
+	{
+		for (x = 0; x < WIDTH; x++)
+		{
+			if (bin[INDEX2(x, y)] != LINE || !is_border(bin, x, y, start, end))
+			{
+				continue;
+			}
+			if (params->sample < 100 &&
+				(int) (next_random(seed) % 100) >= params->sample)
+			{
+				continue;
+			}
+
+			// Relative to the bottom center of the image
+			int dx = x - WIDTH / 2, dy = y - HEIGHT;
+
+			for (a = 0; a < n_angles; a++)
+			{
+				rho = (dx * cos_a[a] + dy * sin_a[a]) >> TRIG_SHIFT;
+				uint16_t * bin_acc = &acc[a * RHO_BINS + rho + HOUGH_MAX_RHO];
+
+				if (++(*bin_acc) > best)
+				{
+					best = *bin_acc;
+					best_a = a;
+					best_r = rho;
+				}
+			}
+		}
+	}
+
+	if (best < params->min_votes)
+	{
+		return;
+	}
+
+	// Look for the other border of the line at the same angle
+	row = acc + best_a * RHO_BINS + HOUGH_MAX_RHO;
+	other = best_r;
+	for (r = best_r - params->max_width; r <= best_r + params->max_width; r++)
+	{
+		if (r < -HOUGH_MAX_RHO || r > HOUGH_MAX_RHO || abs(r - best_r) <= 2)
+		{
+			continue;
+		}
+		if (row[r] * 2 >= best && (other == best_r || row[r] > row[other]))
+		{
+			other = r;
+		}
+	}
+
+	line->angle = best_a + params->angle_min;
+	line->offset = (best_r + other) / 2;
+	line->votes = best;
+}
+
@@ -0,0 +1,62 @@
+
+#ifndef _HOUGH_H_
+#define _HOUGH_H_
+
+#include <stdint.h>
+
+/**
+ * Range of the line offset in pixels
+ */
+#define HOUGH_MAX_RHO			300
+
+/**
+ * Largest angle range (in degrees, one degree per bin)
+ */
+#define HOUGH_MAX_ANGLES		180
+
+/**
+ * Number of accumulator cells needed by hough_detect
+ */
+#define HOUGH_ACC_SIZE			(HOUGH_MAX_ANGLES * (2 * HOUGH_MAX_RHO + 1))
+
+/**
+ * A straight line in the image, in normal form relative to the bottom
+ * center of the image (the position of the robot):
+ *
+ *   x * cos(angle) + y * sin(angle) = offset
+ *
+ * with y pointing down. The angle is that of the normal of the line, so
+ * 0 degrees is a line straight ahead and 90 degrees a horizontal line.
+ * Lines leaning to the right have small positive angles.
+ */
+typedef struct hough_line {
+	// Angle of the normal in degrees
+	int angle;
+	// Distance from the bottom center in pixels
+	int offset;
+	// Number of votes for the line, 0 if no line was found
+	int votes;
+} hough_line_t;
+
+typedef struct hough_params {
+	// Angles searched, from angle_min to angle_max (exclusive)
+	int angle_min, angle_max;
+	// Percentage of the edge pixels used for voting
+	int sample;
+	// Votes needed to accept a line
+	int min_votes;
+	// Largest distance between the two borders of the line
+	int max_width;
+} hough_params_t;
+
+/**
+ * Initial state of the random sampling
+ */
+#define HOUGH_SEED				2463534242u
+
+void hough_detect(const unsigned char * bin, int start, int end,
+	const hough_params_t * params, uint16_t * acc, uint32_t * seed,
+	hough_line_t * line);
+
+#endif
+
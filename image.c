@@ -4,6 +4,24 @@
 
 #include <math.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+
+/**
+ * Luminance of the first and second pixel of a YUYV word
+ * (little endian)
+ */
+#define YUYV_Y0(w)				((w) & 0xFF)
+#define YUYV_Y1(w)				(((w) >> 16) & 0xFF)
+
+/**
+ * Eight 16-bit lanes (maps to a NEON q-register / SSE register)
+ */
+typedef uint16_t v8u16 __attribute__ ((vector_size (16)));
 
 /**
  * Calculate the "center of mass" of the given portion of the image,
@@ -14,6 +32,7 @@ void calculate_center_of_mass(unsigned char * buffer, slice_t * pt,
 {
 	int offset_start, offset_end, sum = 0, x = 0, y = 0, i;
 	pt->x = pt->y = pt->error = 0;
+	pt->xq = pt->yq = pt->errorq = 0;
 
 	offset_start = y_offset_start * WIDTH;
 	offset_end = y_offset_end * WIDTH;
@@ -36,50 +55,86 @@ void calculate_center_of_mass(unsigned char * buffer, slice_t * pt,
 		pt->y = y / sum;
 		pt->error = (WIDTH / 2) - pt->x;
 		pt->mass = sum;
+
+		// The same centroid without truncation
+		pt->xq = (int) (((long long) x << SLICE_SHIFT) / sum);
+		pt->yq = (int) (((long long) y << SLICE_SHIFT) / sum);
+		pt->errorq = ((WIDTH / 2) << SLICE_SHIFT) - pt->xq;
 	}
 }
 
 /**
- * Calculates histogram.
+ * Calculates histogram of every `step` row from `start` to `end`.
  *
  * \param hist Pointer to float array where to put the histogram
  * \param start Start row
  * \param end End row
+ * \param step Row step
  */
-void histogram(unsigned char * buffer, float * hist, int start, int end)
+static void histogram_rows(const unsigned char * buffer, float * hist,
+	int start, int end, int step)
 {
-	int i;
+	int i, y, n = 0;
 	int ihist[256] = {0};
-	
-	start = INDEX(start);
-	end = INDEX(end);
+	const unsigned char * row;
 
-	for (i = start; i < end; i++)
+	for (y = start; y < end; y += step)
 	{
-		ihist[buffer[i]]++;
+		row = buffer + INDEX(y);
+		for (i = 0; i < WIDTH; i++)
+		{
+			ihist[row[i]]++;
+		}
+		n += WIDTH;
 	}
 	for (i = 0; i < 256; i++)
 	{
-		hist[i] = (float)ihist[i] / (float)(end - start);
+		hist[i] = n > 0 ? (float)ihist[i] / (float)n : 0;
 	}
 }
 
+/**
+ * Calculates histogram.
+ *
+ * \param hist Pointer to float array where to put the histogram
+ * \param start Start row
+ * \param end End row
+ */
+void histogram(const unsigned char * buffer, float * hist, int start, int end)
+{
+	histogram_rows(buffer, hist, start, end, 1);
+}
+
 /**
  * Optimum Thresholding algorithm from `The Pocket Handbook of Image 
  * Processing Algorithms in C`.
  *
+ * \param src Gray image
+ * \param dst Where the thresholded rows are written (may equal `src`)
  * \param start Start row (0 - HEIGHT)
  * \param end End row (0 - HEIGHT)
  */
-void optimum_thresholding(unsigned char * buffer, int start, int end, 
-	int nice)
+void optimum_thresholding(const unsigned char * src, unsigned char * dst,
+	int start, int end, int nice)
+{
+	image_threshold_rows(src, dst, start, end, 
+		image_optimum_threshold(src, start, end, 1) + nice, 1);
+}
+
+/**
+ * Find the optimum threshold of the rows from `start` to `end`: the first
+ * valley of the smoothed histogram above gray level 50 (0 if there is
+ * none). Only every `step` row is sampled.
+ */
+int image_optimum_threshold(const unsigned char * src, int start, int end,
+	int step)
 {
 	int y, x, j, flag, thr;
 
 	float sum;
 	float hist[256];
 	
-	histogram(buffer, hist, start, end);
+	histogram_rows(src, hist, start, end, step);
 
 	for (y = 0; y < 256; y++)
 	{
@@ -88,7 +143,7 @@ void optimum_thresholding(unsigned char * buffer, int start, int end,
 		for (x = -15; x <= 15; x++)
 		{
 			j++;
-			if ((y-x) >= 0)
+			if ((y-x) >= 0 && (y-x) < 256)
 			{
 				sum = sum + hist[y-x];
 			}
@@ -109,42 +164,163 @@ void optimum_thresholding(unsigned char * buffer, int start, int end,
 		}
 		y++;
 	}
-	
-	start = INDEX(start);
-	end = INDEX(end);
-	thr += nice;
-	
-	for (j = start; j < end; j++)
-	{
-		buffer[j] = buffer[j] < thr ? LINE : FLOOR;
-	}
+
+	return thr;
 }
 
 /**
- * Adjust contrast of the live image buffer.
+ * Threshold every `step` row from `start` to `end`. Each thresholded row
+ * is also copied to the `step - 1` rows below it, so the line keeps its
+ * mass when rows are skipped.
  */
- /*
-void constrast(unsigned char * buffer)
+void image_threshold_rows(const unsigned char * src, unsigned char * dst,
+	int start, int end, int thr, int step)
 {
-	int i, tmp;
-	for (i = 0; i < IMG_SIZE; i++)
+	int x, y, k;
+	const unsigned char * s;
+	unsigned char * d;
+
+	for (y = start; y < end; y += step)
 	{
-		tmp = buffer[i] * k_constrast;
-		if (tmp > 255)
+		s = src + INDEX(y);
+		d = dst + INDEX(y);
+		for (x = 0; x < WIDTH; x++)
 		{
-			buffer[i] = 255;
+			d[x] = s[x] < thr ? LINE : FLOOR;
 		}
-		else if (tmp < 0)
+		for (k = 1; k < step && y + k < end; k++)
 		{
-			buffer[i] = 0;
+			memcpy(d + k * WIDTH, d, WIDTH);
 		}
-		else
+	}
+}
+
+/**
+ * Threshold every `step` row from `start` to `end` like 
+ * image_threshold_rows, and in the same pass sum up the line pixels of
+ * each row weighted by how much darker than the threshold they are.
+ * Skipped rows get a copy of the row above, including its sums.
+ *
+ * \param rows Sums of each row of the image (only rows start to end
+ * are written)
+ */
+void image_threshold_weighted(const unsigned char * src, unsigned char * dst,
+	int start, int end, int thr, int step, row_moments_t * rows)
+{
+	uint32_t weight, moment, w;
+	int x, y, k, count;
+	const unsigned char * s;
+	unsigned char * d;
+
+	for (y = start; y < end; y += step)
+	{
+		s = src + INDEX(y);
+		d = dst + INDEX(y);
+		weight = moment = 0;
+		count = 0;
+
+		for (x = 0; x < WIDTH; x++)
 		{
-			buffer[i] = (unsigned char)tmp;
+			if (s[x] < thr)
+			{
+				w = thr - s[x];
+				weight += w;
+				moment += w * x;
+				count++;
+				d[x] = LINE;
+			}
+			else
+			{
+				d[x] = FLOOR;
+			}
+		}
+
+		rows[y].weight = weight;
+		rows[y].moment = moment;
+		rows[y].count = count;
+
+		for (k = 1; k < step && y + k < end; k++)
+		{
+			memcpy(d + k * WIDTH, d, WIDTH);
+			rows[y + k] = rows[y];
 		}
 	}
 }
-*/
+
+/**
+ * Sub-pixel center of mass of rows `start` to `end` from the darkness
+ * weighted row sums. The mass is the number of line pixels, as for
+ * calculate_center_of_mass.
+ */
+void image_weighted_centroid(const row_moments_t * rows, slice_t * pt,
+	int start, int end)
+{
+	uint64_t weight = 0, moment_x = 0, moment_y = 0;
+	int y, count = 0;
+
+	memset(pt, 0, sizeof(slice_t));
+
+	for (y = start; y < end; y++)
+	{
+		weight += rows[y].weight;
+		moment_x += rows[y].moment;
+		moment_y += (uint64_t) rows[y].weight * y;
+		count += rows[y].count;
+	}
+
+	if (weight == 0)
+	{
+		return;
+	}
+
+	slice_set_centroid(pt, (int) ((moment_x << SLICE_SHIFT) / weight),
+		(int) ((moment_y << SLICE_SHIFT) / weight));
+	pt->mass = count;
+}
+
+/**
+ * Build a 256-entry lookup table applying gamma, contrast (gain) and
+ * brightness (offset) to a gray level:
+ *
+ *     out = 255 * (in / 255)^gamma * contrast + brightness
+ *
+ * \param lut The table to fill
+ * \return 1 if the table is the identity mapping, 0 otherwise
+ */
+int image_build_lut(unsigned char * lut, float brightness, float contrast,
+	float gamma)
+{
+	int i, v, identity = 1;
+	float f;
+
+	for (i = 0; i < 256; i++)
+	{
+		f = 255.0f * powf(i / 255.0f, gamma);
+		v = (int) (f * contrast + brightness + 0.5f);
+
+		if (v > 255) v = 255;
+		if (v < 0) v = 0;
+
+		lut[i] = (unsigned char) v;
+		identity &= (v == i);
+	}
+	return identity;
+}
+
+/**
+ * Map every pixel of the image through the lookup table.
+ */
+void image_apply_lut(unsigned char * buffer, const unsigned char * lut)
+{
+	int i;
+	for (i = 0; i < IMG_SIZE; i += 4)
+	{
+		buffer[i] = lut[buffer[i]];
+		buffer[i + 1] = lut[buffer[i + 1]];
+		buffer[i + 2] = lut[buffer[i + 2]];
+		buffer[i + 3] = lut[buffer[i + 3]];
+	}
+}
 
 /**
  * Calculate the robot's angle relative to the line.
@@ -176,13 +352,187 @@ double angle_to_line(slice_t * upper, slice_t * lower)
 /**
  * Extract a specific part of the image
  *
+ * \param src
+ * \param dst
  * \param start
  * \param end
  * \param nice
  */
-void extract_slice(unsigned char * buffer, int start, int end, int nice)
+void extract_slice(const unsigned char * src, unsigned char * dst, int start,
+	int end, int nice)
+{
+	optimum_thresholding(src, dst, start, end, nice);
+}
+
+/**
+ * Copy the luminance (Y) channel of a YUYV frame to `dst`, optionally
+ * mapping it through a lookup table in the same pass.
+ *
+ * The frame is read one 32-bit word (Y0 U Y1 V) at a time, four words
+ * per iteration, which saves three out of four loads compared to reading
+ * byte by byte. The camera buffers are page aligned.
+ *
+ * \param frame YUYV frame data
+ * \param dst Buffer of IMG_SIZE bytes
+ * \param lut Lookup table, or NULL to copy the gray levels as is
+ */
+void image_deinterleave(const unsigned char * frame, unsigned char * dst,
+	const unsigned char * lut)
+{
+	const uint32_t * src = (const uint32_t *) frame;
+	uint32_t w0, w1, w2, w3;
+	int i;
+
+	if (lut == NULL)
+	{
+		for (i = 0; i < IMG_SIZE; i += 8, src += 4)
+		{
+			w0 = src[0]; w1 = src[1]; w2 = src[2]; w3 = src[3];
+			dst[i] = YUYV_Y0(w0); dst[i + 1] = YUYV_Y1(w0);
+			dst[i + 2] = YUYV_Y0(w1); dst[i + 3] = YUYV_Y1(w1);
+			dst[i + 4] = YUYV_Y0(w2); dst[i + 5] = YUYV_Y1(w2);
+			dst[i + 6] = YUYV_Y0(w3); dst[i + 7] = YUYV_Y1(w3);
+		}
+		return;
+	}
+
+	for (i = 0; i < IMG_SIZE; i += 8, src += 4)
+	{
+		w0 = src[0]; w1 = src[1]; w2 = src[2]; w3 = src[3];
+		dst[i] = lut[YUYV_Y0(w0)]; dst[i + 1] = lut[YUYV_Y1(w0)];
+		dst[i + 2] = lut[YUYV_Y0(w1)]; dst[i + 3] = lut[YUYV_Y1(w1)];
+		dst[i + 4] = lut[YUYV_Y0(w2)]; dst[i + 5] = lut[YUYV_Y1(w2)];
+		dst[i + 6] = lut[YUYV_Y0(w3)]; dst[i + 7] = lut[YUYV_Y1(w3)];
+	}
+}
+
+/**
+ * Copy the luminance channel of a YUYV frame to `dst` while multiplying
+ * every pixel by its gain, and optionally mapping the result through a
+ * lookup table.
+ *
+ * The frame is processed one row at a time: the row is deinterleaved into
+ * a small buffer that stays in the L1 cache, multiplied by the gains eight
+ * pixels at a time and then stored, so the frame is still only traversed
+ * once.
+ *
+ * \param frame YUYV frame data
+ * \param dst Buffer of IMG_SIZE bytes
+ * \param gain Per-pixel gains (16-byte aligned) with `gain_shift` 
+ * fractional bits. A gray level times its gain must fit in 16 bits.
+ * \param gain_shift Number of fractional bits of the gains
+ * \param lut Lookup table, or NULL
+ */
+void image_deinterleave_gain(const unsigned char * frame, unsigned char * dst,
+	const uint16_t * gain, int gain_shift, const unsigned char * lut)
 {
-	optimum_thresholding(buffer, start, end, nice);
+	v8u16 row[WIDTH / 8];
+	const uint32_t * src = (const uint32_t *) frame;
+	const v8u16 * g = (const v8u16 *) gain;
+	const v8u16 max = { 255, 255, 255, 255, 255, 255, 255, 255 };
+	uint16_t * r = (uint16_t *) row;
+	v8u16 v, over;
+	uint32_t w;
+	int x, y, i;
+
+	for (y = 0; y < HEIGHT; y++)
+	{
+		// Deinterleave
+		for (x = 0; x < WIDTH; x += 2)
+		{
+			w = *src++;
+			r[x] = YUYV_Y0(w);
+			r[x + 1] = YUYV_Y1(w);
+		}
+
+		// Multiply by the gains and saturate at 255
+		for (i = 0; i < WIDTH / 8; i++)
+		{
+			v = (row[i] * *g++) >> gain_shift;
+			over = (v8u16) (v > max);
+			row[i] = (v & ~over) | (max & over);
+		}
+
+		// Store
+		if (lut == NULL)
+		{
+			for (x = 0; x < WIDTH; x++)
+			{
+				dst[x] = (unsigned char) r[x];
+			}
+		}
+		else
+		{
+			for (x = 0; x < WIDTH; x++)
+			{
+				dst[x] = lut[r[x]];
+			}
+		}
+		dst += WIDTH;
+	}
 }
 
+/**
+ * Temporal noise filter. Every pixel is blended with its history using
+ * an exponential moving average in fixed point:
+ *
+ *     h = h + (x - h) * alpha
+ *
+ * Pixels that differ more than `motion` gray levels from their history
+ * are considered moving, and take the new value directly, so moving edges
+ * are not smeared. The history is kept with IMAGE_HISTORY_SHIFT fractional
+ * bits, and the filtered image is written back to `gray`.
+ *
+ * \param gray Image to filter (in place)
+ * \param history History of IMG_SIZE values, 16-byte aligned
+ * \param alpha Weight of the new frame (Q15, 0-32767)
+ * \param motion Motion threshold in gray levels
+ */
+void image_denoise(unsigned char * gray, int16_t * history, int alpha,
+	int motion)
+{
+	int i;
+	int motion_fp = motion << IMAGE_HISTORY_SHIFT;
+
+#ifdef __ARM_NEON__
+	const int16x8_t m = vdupq_n_s16(motion_fp);
+	int16x8_t x, h, d;
+	uint16x8_t moving;
+
+	for (i = 0; i < IMG_SIZE; i += 8)
+	{
+		x = vreinterpretq_s16_u16(vshll_n_u8(vld1_u8(gray + i), 
+			IMAGE_HISTORY_SHIFT));
+		h = vld1q_s16(history + i);
+		d = vsubq_s16(x, h);
+
+		// Rounding (d * alpha) >> 15
+		moving = vcgtq_s16(vabsq_s16(d), m);
+		h = vbslq_s16(moving, x, vaddq_s16(h, vqrdmulhq_n_s16(d, alpha)));
+
+		vst1q_s16(history + i, h);
+		vst1_u8(gray + i, vqrshrun_n_s16(h, IMAGE_HISTORY_SHIFT));
+	}
+#else
+	int x, h, d;
 
+	for (i = 0; i < IMG_SIZE; i++)
+	{
+		x = gray[i] << IMAGE_HISTORY_SHIFT;
+		h = history[i];
+		d = x - h;
+
+		if (d > motion_fp || d < -motion_fp)
+		{
+			h = x;
+		}
+		else
+		{
+			h += (d * alpha + (1 << 14)) >> 15;
+		}
+
+		history[i] = h;
+		gray[i] = (h + (1 << (IMAGE_HISTORY_SHIFT - 1))) >> IMAGE_HISTORY_SHIFT;
+	}
+#endif
+}
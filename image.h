@@ -2,25 +2,93 @@
 #ifndef _IMAGE_H_
 #define _IMAGE_H_
 
+#include <stdint.h>
+#include "common.h"
+
+/**
+ * Fractional bits of the temporal filter history
+ */
+#define IMAGE_HISTORY_SHIFT		7
+
+/**
+ * Fractional bits of the sub-pixel centroid
+ */
+#define SLICE_SHIFT				8
+#define SLICE_ONE				(1 << SLICE_SHIFT)
+
 /**
  * Information about a `slice` of the image, 
  * including mass of the line, error and so on.
  */
 typedef struct slice {
 	int x, y, mass, error;
+	// Centroid and error in 1/SLICE_ONE pixels
+	int xq, yq, errorq;
 } slice_t;
 
+/**
+ * Darkness weighted sums of the line pixels of a single row
+ */
+typedef struct row_moments {
+	// Sum of the weights, and of the weights times the column
+	uint32_t weight, moment;
+	// Number of line pixels
+	int count;
+} row_moments_t;
+
+/**
+ * Set the sub-pixel centroid of a slice, and the whole pixel 
+ * position and errors from it.
+ */
+static inline void slice_set_centroid(slice_t * pt, int xq, int yq)
+{
+	pt->xq = xq;
+	pt->yq = yq;
+	pt->x = (xq + SLICE_ONE / 2) >> SLICE_SHIFT;
+	pt->y = (yq + SLICE_ONE / 2) >> SLICE_SHIFT;
+	pt->error = (WIDTH / 2) - pt->x;
+	pt->errorq = ((WIDTH / 2) << SLICE_SHIFT) - xq;
+}
+
 
 void calculate_center_of_mass(unsigned char * buffer, slice_t * pt, 
 	int y_offset_start, int y_offset_end);
 
-void histogram(unsigned char * buffer, float * hist, int start, int end);
+void histogram(const unsigned char * buffer, float * hist, int start, int end);
+
+void optimum_thresholding(const unsigned char * src, unsigned char * dst,
+	int start, int end, int nice);
+
+int image_optimum_threshold(const unsigned char * src, int start, int end,
+	int step);
+
+void image_threshold_rows(const unsigned char * src, unsigned char * dst,
+	int start, int end, int thr, int step);
+
+void image_threshold_weighted(const unsigned char * src, unsigned char * dst,
+	int start, int end, int thr, int step, row_moments_t * rows);
 
-void optimum_thresholding(unsigned char * buffer,int start, int end, int nice);
+void image_weighted_centroid(const row_moments_t * rows, slice_t * pt,
+	int start, int end);
 
 double angle_to_line(slice_t * upper, slice_t * lower);
 
-void extract_slice(unsigned char * buffer, int start, int end, int nice);
+void extract_slice(const unsigned char * src, unsigned char * dst, int start,
+	int end, int nice);
+
+void image_deinterleave(const unsigned char * frame, unsigned char * dst,
+	const unsigned char * lut);
+
+void image_deinterleave_gain(const unsigned char * frame, unsigned char * dst,
+	const uint16_t * gain, int gain_shift, const unsigned char * lut);
+
+int image_build_lut(unsigned char * lut, float brightness, float contrast,
+	float gamma);
+
+void image_apply_lut(unsigned char * buffer, const unsigned char * lut);
+
+void image_denoise(unsigned char * gray, int16_t * history, int alpha,
+	int motion);
 
 #endif
 
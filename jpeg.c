@@ -0,0 +1,558 @@
+
+#include "jpeg.h"
+
+#include <string.h>
+
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+
+/**
+ * Fixed point precision of the DCT (as the "islow" DCT of the IJG
+ * library): constants have CONST_BITS fraction bits, and the output of
+ * the first pass is kept PASS1_BITS bits larger. The output is 8 times
+ * the real DCT, which is divided out by the quantizer.
+ */
+#define CONST_BITS				13
+#define PASS1_BITS				2
+
+#define FIX_0_298631336			2446
+#define FIX_0_390180644			3196
+#define FIX_0_541196100			4433
+#define FIX_0_765366865			6270
+#define FIX_0_899976223			7373
+#define FIX_1_175875602			9633
+#define FIX_1_501321110			12299
+#define FIX_1_847759065			15137
+#define FIX_1_961570560			16069
+#define FIX_2_053119869			16819
+#define FIX_2_562915447			20995
+#define FIX_3_072711026			25172
+
+#define DESCALE(x, n)			(((x) + (1 << ((n) - 1))) >> (n))
+
+/**
+ * Fraction bits of the quantizer reciprocals
+ */
+#define RECIP_SHIFT				20
+
+/**
+ * Natural index of each coefficient in zigzag order
+ */
+static const uint8_t zigzag[64] = {
+	 0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+	12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+
+/**
+ * Luminance quantization table of the JPEG standard (Annex K), in
+ * natural order
+ */
+static const uint8_t std_luminance_quant[64] = {
+	16, 11, 10, 16,  24,  40,  51,  61,
+	12, 12, 14, 19,  26,  58,  60,  55,
+	14, 13, 16, 24,  40,  57,  69,  56,
+	14, 17, 22, 29,  51,  87,  80,  62,
+	18, 22, 37, 56,  68, 109, 103,  77,
+	24, 35, 55, 64,  81, 104, 113,  92,
+	49, 64, 78, 87, 103, 121, 120, 101,
+	72, 92, 95, 98, 112, 100, 103,  99
+};
+
+/**
+ * Luminance Huffman tables of the JPEG standard: the number of codes of
+ * each length (1 - 16 bits), followed by the symbols
+ */
+static const uint8_t dc_bits[16] = {
+	0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0
+};
+static const uint8_t dc_vals[12] = {
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11
+};
+static const uint8_t ac_bits[16] = {
+	0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d
+};
+static const uint8_t ac_vals[162] = {
+	0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12,
+	0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+	0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08,
+	0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+	0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16,
+	0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+	0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39,
+	0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+	0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+	0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+	0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79,
+	0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+	0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98,
+	0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+	0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6,
+	0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+	0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4,
+	0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+	0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea,
+	0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+	0xf9, 0xfa
+};
+
+/**
+ * Output of the entropy coder. Bits are collected in `acc` and written
+ * a byte at a time, with a 0 stuffed after each 0xff byte.
+ */
+typedef struct bit_writer {
+	unsigned char * out;
+	int n, max;
+	uint32_t acc;
+	int bits;
+	int overflow;
+} bit_writer_t;
+
+static void build_codes(const uint8_t * bits, const uint8_t * vals,
+	uint16_t * codes, uint8_t * sizes)
+{
+	int length, i, k = 0;
+	uint16_t code = 0;
+
+	for (length = 1; length <= 16; length++)
+	{
+		for (i = 0; i < bits[length - 1]; i++)
+		{
+			codes[vals[k]] = code++;
+			sizes[vals[k]] = length;
+			k++;
+		}
+		code <<= 1;
+	}
+}
+
+/**
+ * Set up the encoder for the given quality (1 - 100, as the IJG library)
+ */
+void jpeg_init(jpeg_encoder_t * enc, int quality)
+{
+	int i, q[64], scale;
+
+	memset(enc, 0, sizeof(jpeg_encoder_t));
+
+	if (quality < 1) quality = 1;
+	if (quality > 100) quality = 100;
+	enc->quality = quality;
+	scale = quality < 50 ? 5000 / quality : 200 - 2 * quality;
+
+	for (i = 0; i < 64; i++)
+	{
+		q[i] = (std_luminance_quant[i] * scale + 50) / 100;
+		if (q[i] < 1) q[i] = 1;
+		if (q[i] > 255) q[i] = 255;
+
+		// The DCT output is 8 times too large
+		enc->recip[i] = ((1 << RECIP_SHIFT) + 4 * q[i]) / (8 * q[i]);
+		enc->half[i] = 4 * q[i];
+	}
+	for (i = 0; i < 64; i++)
+	{
+		enc->qtable[i] = q[zigzag[i]];
+	}
+
+	build_codes(dc_bits, dc_vals, enc->dc_code, enc->dc_size);
+	build_codes(ac_bits, ac_vals, enc->ac_code, enc->ac_size);
+}
+
+/**
+ * Load an 8x8 block, shifted to signed values. Blocks at the right and
+ * bottom border repeat the last column and row of the image.
+ */
+static void load_block(const unsigned char * gray, int width, int height,
+	int x, int y, int32_t * block)
+{
+	int r, c, yy, xx;
+	const unsigned char * row;
+
+	for (r = 0; r < 8; r++)
+	{
+		yy = y + r < height ? y + r : height - 1;
+		row = gray + yy * width;
+
+		if (x + 8 <= width)
+		{
+#ifdef __ARM_NEON__
+			int16x8_t v = vreinterpretq_s16_u16(vsubl_u8(vld1_u8(row + x),
+				vdup_n_u8(128)));
+			vst1q_s32(block + r * 8, vmovl_s16(vget_low_s16(v)));
+			vst1q_s32(block + r * 8 + 4, vmovl_s16(vget_high_s16(v)));
+#else
+			for (c = 0; c < 8; c++)
+			{
+				block[r * 8 + c] = row[x + c] - 128;
+			}
+#endif
+		}
+		else
+		{
+			for (c = 0; c < 8; c++)
+			{
+				xx = x + c < width ? x + c : width - 1;
+				block[r * 8 + c] = row[xx] - 128;
+			}
+		}
+	}
+}
+
+/**
+ * Forward DCT of the block, in place (Loeffler, Ligtenberg and Moschytz,
+ * as used by the "islow" DCT of the IJG library)
+ */
+static void fdct(int32_t * block)
+{
+	int32_t tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+	int32_t tmp10, tmp11, tmp12, tmp13;
+	int32_t z1, z2, z3, z4, z5;
+	int32_t * d;
+	int i;
+
+	// Rows
+	for (i = 0, d = block; i < 8; i++, d += 8)
+	{
+		tmp0 = d[0] + d[7];
+		tmp7 = d[0] - d[7];
+		tmp1 = d[1] + d[6];
+		tmp6 = d[1] - d[6];
+		tmp2 = d[2] + d[5];
+		tmp5 = d[2] - d[5];
+		tmp3 = d[3] + d[4];
+		tmp4 = d[3] - d[4];
+
+		tmp10 = tmp0 + tmp3;
+		tmp13 = tmp0 - tmp3;
+		tmp11 = tmp1 + tmp2;
+		tmp12 = tmp1 - tmp2;
+
+		d[0] = (tmp10 + tmp11) << PASS1_BITS;
+		d[4] = (tmp10 - tmp11) << PASS1_BITS;
+
+		z1 = (tmp12 + tmp13) * FIX_0_541196100;
+		d[2] = DESCALE(z1 + tmp13 * FIX_0_765366865, CONST_BITS - PASS1_BITS);
+		d[6] = DESCALE(z1 - tmp12 * FIX_1_847759065, CONST_BITS - PASS1_BITS);
+
+		z1 = tmp4 + tmp7;
+		z2 = tmp5 + tmp6;
+		z3 = tmp4 + tmp6;
+		z4 = tmp5 + tmp7;
+		z5 = (z3 + z4) * FIX_1_175875602;
+
+		tmp4 *= FIX_0_298631336;
+		tmp5 *= FIX_2_053119869;
+		tmp6 *= FIX_3_072711026;
+		tmp7 *= FIX_1_501321110;
+		z1 *= -FIX_0_899976223;
+		z2 *= -FIX_2_562915447;
+		z3 = z3 * -FIX_1_961570560 + z5;
+		z4 = z4 * -FIX_0_390180644 + z5;
+
+		d[7] = DESCALE(tmp4 + z1 + z3, CONST_BITS - PASS1_BITS);
+		d[5] = DESCALE(tmp5 + z2 + z4, CONST_BITS - PASS1_BITS);
+		d[3] = DESCALE(tmp6 + z2 + z3, CONST_BITS - PASS1_BITS);
+		d[1] = DESCALE(tmp7 + z1 + z4, CONST_BITS - PASS1_BITS);
+	}
+
+	// Columns
+	for (i = 0, d = block; i < 8; i++, d++)
+	{
+		tmp0 = d[0] + d[56];
+		tmp7 = d[0] - d[56];
+		tmp1 = d[8] + d[48];
+		tmp6 = d[8] - d[48];
+		tmp2 = d[16] + d[40];
+		tmp5 = d[16] - d[40];
+		tmp3 = d[24] + d[32];
+		tmp4 = d[24] - d[32];
+
+		tmp10 = tmp0 + tmp3;
+		tmp13 = tmp0 - tmp3;
+		tmp11 = tmp1 + tmp2;
+		tmp12 = tmp1 - tmp2;
+
+		d[0] = DESCALE(tmp10 + tmp11, PASS1_BITS);
+		d[32] = DESCALE(tmp10 - tmp11, PASS1_BITS);
+
+		z1 = (tmp12 + tmp13) * FIX_0_541196100;
+		d[16] = DESCALE(z1 + tmp13 * FIX_0_765366865, CONST_BITS + PASS1_BITS);
+		d[48] = DESCALE(z1 - tmp12 * FIX_1_847759065, CONST_BITS + PASS1_BITS);
+
+		z1 = tmp4 + tmp7;
+		z2 = tmp5 + tmp6;
+		z3 = tmp4 + tmp6;
+		z4 = tmp5 + tmp7;
+		z5 = (z3 + z4) * FIX_1_175875602;
+
+		tmp4 *= FIX_0_298631336;
+		tmp5 *= FIX_2_053119869;
+		tmp6 *= FIX_3_072711026;
+		tmp7 *= FIX_1_501321110;
+		z1 *= -FIX_0_899976223;
+		z2 *= -FIX_2_562915447;
+		z3 = z3 * -FIX_1_961570560 + z5;
+		z4 = z4 * -FIX_0_390180644 + z5;
+
+		d[56] = DESCALE(tmp4 + z1 + z3, CONST_BITS + PASS1_BITS);
+		d[40] = DESCALE(tmp5 + z2 + z4, CONST_BITS + PASS1_BITS);
+		d[24] = DESCALE(tmp6 + z2 + z3, CONST_BITS + PASS1_BITS);
+		d[8] = DESCALE(tmp7 + z1 + z4, CONST_BITS + PASS1_BITS);
+	}
+}
+
+/**
+ * Divide the coefficients by the quantization table, rounding to the
+ * nearest integer (multiplying by the reciprocal, as there may be no
+ * hardware divide)
+ */
+static void quantize(const jpeg_encoder_t * enc, const int32_t * block,
+	int16_t * coef)
+{
+	int i;
+
+#ifdef __ARM_NEON__
+	for (i = 0; i < 64; i += 4)
+	{
+		int32x4_t v = vld1q_s32(block + i);
+		uint32x4_t mag = vreinterpretq_u32_s32(vabsq_s32(v));
+		uint32x4_t half = vmovl_u16(vld1_u16(enc->half + i));
+
+		mag = vmulq_u32(vaddq_u32(mag, half), vld1q_u32(enc->recip + i));
+		mag = vshrq_n_u32(mag, RECIP_SHIFT);
+
+		// Restore the sign
+		int32x4_t q = vreinterpretq_s32_u32(mag);
+		uint32x4_t neg = vcltq_s32(v, vdupq_n_s32(0));
+		q = vbslq_s32(neg, vnegq_s32(q), q);
+		vst1_s16(coef + i, vmovn_s32(q));
+	}
+#else
+	int32_t v;
+	uint32_t mag;
+
+	for (i = 0; i < 64; i++)
+	{
+		v = block[i];
+		mag = v < 0 ? -v : v;
+		mag = ((mag + enc->half[i]) * enc->recip[i]) >> RECIP_SHIFT;
+		coef[i] = v < 0 ? -(int32_t) mag : (int32_t) mag;
+	}
+#endif
+}
+
+static void put_byte(bit_writer_t * w, unsigned char b)
+{
+	if (w->n + 2 > w->max)
+	{
+		w->overflow = 1;
+		return;
+	}
+	w->out[w->n++] = b;
+	if (b == 0xff)
+	{
+		w->out[w->n++] = 0;
+	}
+}
+
+static void put_bits(bit_writer_t * w, uint32_t code, int size)
+{
+	w->acc = (w->acc << size) | (code & ((1 << size) - 1));
+	w->bits += size;
+
+	while (w->bits >= 8)
+	{
+		w->bits -= 8;
+		put_byte(w, (w->acc >> w->bits) & 0xff);
+	}
+}
+
+/**
+ * Number of bits needed for the magnitude of v (the JPEG category)
+ */
+static int category(int v)
+{
+	int n = 0;
+
+	if (v < 0) v = -v;
+	while (v)
+	{
+		n++;
+		v >>= 1;
+	}
+	return n;
+}
+
+static void encode_block(const jpeg_encoder_t * enc, bit_writer_t * w,
+	const int16_t * coef, int * dc)
+{
+	int k, v, size, run = 0;
+
+	// DC, as the difference to the previous block
+	v = coef[0] - *dc;
+	*dc = coef[0];
+	size = category(v);
+	put_bits(w, enc->dc_code[size], enc->dc_size[size]);
+	if (size)
+	{
+		put_bits(w, v < 0 ? v - 1 : v, size);
+	}
+
+	// AC, as runs of zeros followed by a value
+	for (k = 1; k < 64; k++)
+	{
+		v = coef[zigzag[k]];
+		if (v == 0)
+		{
+			run++;
+			continue;
+		}
+
+		while (run >= 16)
+		{
+			put_bits(w, enc->ac_code[0xf0], enc->ac_size[0xf0]);
+			run -= 16;
+		}
+
+		size = category(v);
+		put_bits(w, enc->ac_code[(run << 4) | size],
+			enc->ac_size[(run << 4) | size]);
+		put_bits(w, v < 0 ? v - 1 : v, size);
+		run = 0;
+	}
+
+	if (run > 0)
+	{
+		// End of block
+		put_bits(w, enc->ac_code[0x00], enc->ac_size[0x00]);
+	}
+}
+
+static unsigned char * put_marker(unsigned char * p, int marker, int length)
+{
+	*p++ = 0xff;
+	*p++ = marker;
+	if (length > 0)
+	{
+		*p++ = length >> 8;
+		*p++ = length & 0xff;
+	}
+	return p;
+}
+
+static unsigned char * put_huffman_table(unsigned char * p, int id,
+	const uint8_t * bits, const uint8_t * vals, int n)
+{
+	p = put_marker(p, 0xc4, 2 + 1 + 16 + n);
+	*p++ = id;
+	memcpy(p, bits, 16);
+	p += 16;
+	memcpy(p, vals, n);
+	return p + n;
+}
+
+static int write_headers(const jpeg_encoder_t * enc, int width, int height,
+	unsigned char * out)
+{
+	static const unsigned char jfif[14] = {
+		'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0
+	};
+	unsigned char * p = out;
+
+	p = put_marker(p, 0xd8, 0);
+
+	p = put_marker(p, 0xe0, 2 + sizeof(jfif));
+	memcpy(p, jfif, sizeof(jfif));
+	p += sizeof(jfif);
+
+	p = put_marker(p, 0xdb, 2 + 1 + 64);
+	*p++ = 0;
+	memcpy(p, enc->qtable, 64);
+	p += 64;
+
+	// Baseline, 8 bit, one component using quantization table 0
+	p = put_marker(p, 0xc0, 2 + 6 + 3);
+	*p++ = 8;
+	*p++ = height >> 8;
+	*p++ = height & 0xff;
+	*p++ = width >> 8;
+	*p++ = width & 0xff;
+	*p++ = 1;
+	*p++ = 1;
+	*p++ = 0x11;
+	*p++ = 0;
+
+	p = put_huffman_table(p, 0x00, dc_bits, dc_vals, sizeof(dc_vals));
+	p = put_huffman_table(p, 0x10, ac_bits, ac_vals, sizeof(ac_vals));
+
+	// Start of scan: component 1 with Huffman tables 0
+	p = put_marker(p, 0xda, 2 + 1 + 2 + 3);
+	*p++ = 1;
+	*p++ = 1;
+	*p++ = 0x00;
+	*p++ = 0;
+	*p++ = 63;
+	*p++ = 0;
+
+	return p - out;
+}
+
+/**
+ * Encode a grayscale image as a baseline JPEG file.
+ *
+ * \param enc Encoder set up by jpeg_init
+ * \param gray Image, one byte per pixel
+ * \param width Width of the image
+ * \param height Height of the image
+ * \param out Output buffer
+ * \param max Size of the output buffer
+ * \return Size of the JPEG file, or -1 if it doesn't fit in the buffer
+ */
+int jpeg_encode(const jpeg_encoder_t * enc, const unsigned char * gray,
+	int width, int height, unsigned char * out, int max)
+{
+	bit_writer_t w;
+	int32_t block[64];
+	int16_t coef[64];
+	int x, y, dc = 0;
+
+	if (max < JPEG_HEADER_SIZE)
+	{
+		return -1;
+	}
+
+	memset(&w, 0, sizeof(w));
+	w.out = out;
+	w.max = max - 2;
+	w.n = write_headers(enc, width, height, out);
+
+	for (y = 0; y < height && !w.overflow; y += 8)
+	{
+		for (x = 0; x < width; x += 8)
+		{
+			load_block(gray, width, height, x, y, block);
+			fdct(block);
+			quantize(enc, block, coef);
+			encode_block(enc, &w, coef, &dc);
+		}
+	}
+
+	// Pad the last byte with ones
+	if (w.bits > 0)
+	{
+		put_bits(&w, 0x7f, 8 - w.bits);
+	}
+	if (w.overflow)
+	{
+		return -1;
+	}
+
+	// End of image (room was kept for it)
+	out[w.n++] = 0xff;
+	out[w.n++] = 0xd9;
+	return w.n;
+}
+
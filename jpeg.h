@@ -0,0 +1,36 @@
+
+#ifndef _JPEG_H_
+#define _JPEG_H_
+
+#include <stdint.h>
+
+/**
+ * Baseline JPEG encoder for 8 bit grayscale images. The encoder doesn't
+ * allocate memory: the tables live in the encoder struct, and the image
+ * is written to a buffer given by the caller.
+ */
+typedef struct jpeg_encoder {
+	int quality;
+	// Quantization table, in zigzag order (as written to the file)
+	uint8_t qtable[64];
+	// Reciprocals of the quantizer divisors, in natural order
+	uint32_t recip[64];
+	uint16_t half[64];
+	// Huffman codes of the DC categories and the AC symbols
+	uint16_t dc_code[12];
+	uint8_t dc_size[12];
+	uint16_t ac_code[256];
+	uint8_t ac_size[256];
+} jpeg_encoder_t;
+
+/**
+ * Room for the headers written in front of the image data
+ */
+#define JPEG_HEADER_SIZE		700
+
+void jpeg_init(jpeg_encoder_t * enc, int quality);
+int jpeg_encode(const jpeg_encoder_t * enc, const unsigned char * gray,
+	int width, int height, unsigned char * out, int max);
+
+#endif
+
@@ -12,6 +12,7 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <limits.h>
 
 #include "common.h"
 #include "configuration.h"
@@ -24,6 +25,17 @@
 #include "ioexp.h"
 #include "image.h"
 #include "pid.h"
+#include "undistort.h"
+#include "pipeline.h"
+#include "flatfield.h"
+#include "tracker.h"
+#include "shadow.h"
+#include "governor.h"
+#include "mjpeg.h"
+#include "datagram.h"
+#include "shmring.h"
+#include "remote.h"
+#include "timer.h"
 
 #define delay(ms) 				(usleep(ms * 1000))
 
@@ -32,7 +44,6 @@
 #define P_135					(3 * P_45)
 #define P_180					(4 * P_45)
 
-#define AVG_MASS_CNT			3
 #define AVG_DIST_CNT			10
 
 #define SPEED_LIMIT				100
@@ -46,12 +57,20 @@
 #define DIST_SAMPLE_DELAY		50
 #define DIST_VAR_LIM			4
 
+#define FLATCAL_POLL			50
+#define FLATCAL_TIMEOUT			2000
+
 /**
  * Function prototypes
  */
-static int update_loop(int mass, slice_t * upper, slice_t * lower);
+static int update_loop(int mass, slice_t * upper, slice_t * lower,
+	const track_event_t * event, const hough_line_t * line);
 static void motor_set_control_value(pid_data_t * pid, float cv);
 static unsigned char get_limited_speed(int speed);
+static int found_feature(const track_event_t * event, track_type_t type, 
+	int mass, int lower, int upper);
+static int turn_onto_line(const hough_line_t * line, int nominal);
+static void apply_command(const remote_command_t * command);
 
 
 /**
@@ -79,6 +98,18 @@ typedef enum {
 	FOLLOW_LINE_TEST
 } state_t;
 
+/**
+ * States where the robot stands still and the image is only watched
+ */
+#define IS_IDLE(state)			((state) == WAITING || (state) == CALIBRATE)
+
+/**
+ * States where the line controller is steering
+ */
+#define IS_FOLLOWING_LINE(state)	((state) == FOLLOW_LINE ||				\
+	(state) == FOLLOW_LINE_AFTER_WALL || (state) == FOLLOW_LINE_SPEEDY ||	\
+	(state) == FOLLOW_LINE_TEST)
+
 typedef enum {
 	OFF,
 	BLINK,
@@ -106,11 +137,11 @@ static log_list_t * logs;
 static camera_t * cam;
 
 /**
- * Buffer for temporary image data.
- * This buffer is the primary working buffer when
- * doing the image processing.
- */ 
-static unsigned char * buffer;
+ * The image processing stages, and the context holding the
+ * working buffers they operate on.
+ */
+static pipeline_t pipeline;
+static pipeline_ctx_t vision;
 
 /**
  * Copy of the buffer used when dumping the current
@@ -143,10 +174,42 @@ static led_state_t led_current_state = OFF;
 static float last_error = 0;
 static int I_sum = 0;
 
+/**
+ * State of the controller in the current frame, sent with the per-frame
+ * datagram
+ */
+static telemetry_control_t control;
+
+/**
+ * Shared memory ring of the last frames, NULL if disabled
+ */
+static shm_ring_t * shm_ring = NULL;
+
 static avg_num_t avg_mass;
 static avg_num_t avg_front_dist;
 static avg_num_t avg_side_dist;
 
+/**
+ * Position in the configured route, and the state of the fork
+ * currently being passed.
+ */
+static int route_idx = 0;
+static int fork_active = 0;
+static int fork_gone_cnt = 0;
+
+/**
+ * Estimate of the line position, used to bridge frames where the
+ * line is lost
+ */
+static tracker_t tracker;
+static unsigned long coasted_frames = 0;
+
+/**
+ * Lowers the image quality when frames take longer than the frame
+ * interval to process
+ */
+static governor_t governor;
+
 static int settling_cnt = 0;
 static int settling_en = 0;
 
@@ -253,7 +316,7 @@ void dump_to_pgm(unsigned char * buffer, int x1, int y1, int x2, int y2,
 
 static float get_angle_to_pulses(float angle)
 {
-	return angle * ((float) (512/90));
+	return angle * ((float) P_90 / 90);
 }
 
 /**
@@ -379,91 +442,291 @@ static void reset()
 	avg_num_clear(&avg_side_dist);
 	goto_speed_mode();
 	I_sum = 0;
+	route_idx = 0;
+	fork_active = 0;
+	tracker_reset(&tracker);
+}
+
+/**
+ * Update the line tracker with the slices of the frame. If the line is
+ * not seen in the lower slice, the slice errors are replaced with the
+ * position predicted by the tracker, as long as the last measurement is
+ * at most tracker_coast_ms old.
+ *
+ * \param upper Upper slice (replaced if the line is lost)
+ * \param lower Lower slice (replaced if the line is lost)
+ * \param t_us Time the frame was captured
+ */
+static void track_line(slice_t * upper, slice_t * lower, long long t_us)
+{
+	tracker_state_t est;
+	long long age;
+	float heading;
+
+	age = tracker_predict(&tracker, t_us, &est);
+
+	if (lower->mass > 0)
+	{
+		// Keep the predicted heading if the upper slice is empty
+		heading = upper->mass > 0 ? 
+			(float) (upper->errorq - lower->errorq) / SLICE_ONE :
+			(age >= 0 ? est.heading : 0);
+		tracker_update(&tracker, (float) lower->errorq / SLICE_ONE, heading,
+			t_us);
+		return;
+	}
+
+	if (age < 0 || age > conf.tracker_coast_ms * 1000LL)
+	{
+		return;
+	}
+
+	lower->error = (int) lroundf(est.offset);
+	lower->errorq = (int) lroundf(est.offset * SLICE_ONE);
+	upper->error = (int) lroundf(est.offset + est.heading);
+	upper->errorq = (int) lroundf((est.offset + est.heading) * SLICE_ONE);
+	coasted_frames++;
+}
+
+/**
+ * When the line forks, replace the upper and lower slice with the
+ * centroid of the branch given by the route, so the controller follows
+ * that branch. The next route entry is used once the fork has been out
+ * of sight for a number of frames.
+ *
+ * \param result Vision result of the frame
+ * \param mass Averaged mass of the line
+ * \param upper Upper slice (replaced while following a branch)
+ * \param lower Lower slice (replaced while following a branch)
+ */
+static void follow_route(const vision_result_t * result, int mass, 
+	slice_t * upper, slice_t * lower)
+{
+	const track_branches_t * br = &result->branches;
+	slice_t branch;
+	int fork;
+
+	if (conf.n_route == 0)
+	{
+		return;
+	}
+
+	fork = br->rows >= conf.track_fork_rows && found_feature(&result->event,
+		TRACK_FORK, mass, conf.mass_bypath_lower, conf.mass_bypath_upper);
+
+	if (!fork)
+	{
+		if (fork_active && ++fork_gone_cnt > conf.fork_passed_frames)
+		{
+			fork_active = 0;
+			route_idx++;
+			printf("Passed fork, next branch: %c\n", 
+				conf.route[route_idx % conf.n_route]);
+		}
+		return;
+	}
+
+	if (!fork_active)
+	{
+		printf("Fork found, taking branch: %c\n", 
+			conf.route[route_idx % conf.n_route]);
+	}
+	fork_active = 1;
+	fork_gone_cnt = 0;
+
+	if (conf.route[route_idx % conf.n_route] == ROUTE_RIGHT)
+	{
+		slice_set_centroid(&branch, br->right_x << SLICE_SHIFT, 
+			br->right_y << SLICE_SHIFT);
+		branch.mass = br->right_mass;
+	}
+	else
+	{
+		slice_set_centroid(&branch, br->left_x << SLICE_SHIFT, 
+			br->left_y << SLICE_SHIFT);
+		branch.mass = br->left_mass;
+	}
+
+	*upper = *lower = branch;
 }
 
-/** 
- * Extract the line
+/**
+ * Send the result of the frame, and what the controller did with it, as
+ * a datagram (if enabled).
  */
-static void extract_line()
+static void send_datagram(const slice_t * upper, const slice_t * lower,
+	int mass, long long t_frame)
 {
-	extract_slice(buffer, 0, 44, 0);
-	extract_slice(buffer, 44, 88, 0);
-	extract_slice(buffer, 88, 144, 0);
-	extract_slice(buffer, 144, 192, 0);
-	extract_slice(buffer, 192, 240, 0);
+	telemetry_datagram_t datagram;
+
+	memset(&datagram, 0, sizeof(datagram));
+	datagram.header.seq = frame_counter;
+	datagram.header.timestamp_us = t_frame;
+
+	datagram.fields.l_x = lower->x;
+	datagram.fields.l_y = lower->y;
+	datagram.fields.u_x = upper->x;
+	datagram.fields.u_y = upper->y;
+	datagram.fields.error_lower = lower->error;
+	datagram.fields.error_upper = upper->error;
+	datagram.fields.mass = mass;
+
+	datagram.control = control;
+	datagram.control.state = current_state;
+	datagram.control.frame_us = timer_now_us() - t_frame;
+	datagram.control.quality = governor.level;
+
+	datagram_send(&datagram);
 }
 
+/**
+ * Copy the frame and its result to the shared memory ring
+ */
+static void publish_frame(long long t_frame)
+{
+	const vision_result_t * r = &vision.result;
+	shm_result_t result;
+
+	result.l_x = r->lower.x;
+	result.l_y = r->lower.y;
+	result.u_x = r->upper.x;
+	result.u_y = r->upper.y;
+	result.error_lower = r->lower.error;
+	result.error_upper = r->upper.error;
+	result.errorq_lower = r->lower.errorq;
+	result.errorq_upper = r->upper.errorq;
+	result.mass = r->mass;
+	result.event = r->event.type;
+	result.line_angle = r->line.angle;
+	result.line_offset = r->line.offset;
+	result.line_votes = r->line.votes;
+
+	shm_ring_publish(shm_ring, t_frame, &result, vision.gray, vision.out);
+}
 
 /**
  * Callback fired when a frame is ready.
- * 
+ *
  * \param cam Pointer to the current camera context
  * \param frame Pointer to the frame data (planar image data)
  * \param length The of the frame data (in bytes, not pixels)
  */
 static void frame_callback(struct camera * cam, void * frame, int length)
 {
-	int i;
-	unsigned char * ptr;
+	int processed, divisor;
 	unsigned int count;
+	long long t_frame = timer_now_us();
 	slice_t lower, upper;
-
-	count = 0;
-	ptr = (unsigned char *) frame;
+	track_event_t event;
+	hough_line_t line;
+	remote_command_t command;
 
 	// Get mutual access to buffer
 	pthread_mutex_lock(&buffer_mutex);
 
-	// Copy to working buffer
-	for (i = 0; i < IMG_SIZE; i++)
+	// Apply the remote control commands received since the last frame
+	while (remote_take(&command))
 	{
-		buffer[i] = (*ptr);
-		ptr += 2;
+		apply_command(&command);
 	}
-
-	if (current_state != CALIBRATE)
+	remote_flush();
+
+	// Run the image processing stages (no analysis while calibrating).
+	// While idle, frames that are unchanged since the last processed one
+	// are skipped and the previous result is reused, except during a
+	// flat-field calibration, which needs every frame.
+	vision.frame = (const unsigned char *) frame;
+	vision.length = length;
+	vision.analyze = current_state != CALIBRATE;
+	vision.fit_line = current_state == GOTO_LINE || 
+		current_state == FROM_WALL_TO_LINE;
+
+	processed = !conf.skip_unchanged || !IS_IDLE(current_state) ||
+		flatfield_capturing() ||
+		pipeline_frame_changed(&vision, conf.skip_grid, conf.skip_tolerance);
+	if (processed)
 	{
-		// Extract line
-		extract_line();
-
-		// Calculate center of mass at the upper half of the image.
-		// (this is where the line is farest away)
-		calculate_center_of_mass(buffer, &upper, conf.slice_upper_start, 
-			conf.slice_upper_end);
-
-		// Calculate center of mass at the lower half of the image
-		calculate_center_of_mass(buffer, &lower, conf.slice_lower_start, 
-			conf.slice_lower_end);
-
-		// Aggregated mass of line
-		count = upper.mass + lower.mass;
+		// Quality of the detector stages set by the governor
+		vision.single_band = governor.level >= GOVERNOR_SINGLE_BAND;
+		vision.roi_start = governor.level >= GOVERNOR_ROI ? 
+			conf.governor_roi_start : 0;
+		vision.row_step = governor.level >= GOVERNOR_DECIMATE ? 2 : 1;
+
+		// Write to the gray plane the shadow pipeline is not reading,
+		// and hand the frame to it afterwards
+		shadow_select_plane(&vision);
+		pipeline_run(&pipeline, &vision);
+		shadow_submit(&vision, pipeline.last_us, frame_counter);
+		mjpeg_submit(vision.gray);
 	}
 
+	upper = vision.result.upper;
+	lower = vision.result.lower;
+	event = vision.result.event;
+	line = vision.result.line;
+
+	// Aggregated mass of line
+	count = vision.result.mass;
 	count = avg_num_add(&avg_mass, count);
 
-	// Transmit every 4rd frame over sockets.
-	// This is 15 frames per second when we are capturing
-	// 60 frames per second from the camera.
-	if (frame_counter % 3 == 0)
+	// Transmit over sockets at the rate the clients subscribed to (every
+	// third frame unless they ask otherwise), half that when the governor 
+	// lowers the broadcast rate.
+	divisor = broadcast_divisor();
+	if (governor.level >= GOVERNOR_BROADCAST)
+	{
+		divisor *= 2;
+	}
+	if (divisor > 0 && frame_counter % divisor == 0)
 	{
 		//printf("%d %d -- %d %d\n", lower.x, lower.y, upper.x, upper.y);
-		broadcast_send(lower.x, lower.y, upper.x, upper.y, lower.error, 
-			upper.error, avg_mass.avg, buffer);
+		broadcast_send(frame_counter, lower.x, lower.y, upper.x, upper.y, 
+			lower.error, upper.error, avg_mass.avg, vision.out);
 	}
 
 
+	// Publish the frame to local readers
+	if (processed && shm_ring != NULL)
+	{
+		publish_frame(t_frame);
+	}
+
 	// Create copy for dumping later
-	memcpy(buffer_copy, buffer, IMG_SIZE);
+	if (processed && governor.level < GOVERNOR_NO_DUMP)
+	{
+		memcpy(buffer_copy, vision.out, IMG_SIZE);
+	}
 	latest_upper_error = upper;
 	latest_lower_error = lower;
 
+	// Adjust the quality to the time spent on this frame
+	if (processed)
+	{
+		governor_update(&governor, timer_now_us() - t_frame);
+	}
+
 	// Release mutex
 	pthread_mutex_unlock(&buffer_mutex);
 
 	frame_counter++;
 
+	// Track the line, and predict it in frames where it is lost
+	if (IS_FOLLOWING_LINE(current_state))
+	{
+		track_line(&upper, &lower, t_frame);
+	}
+
+	// Follow the branch given by the route if the line forks
+	if (IS_FOLLOWING_LINE(current_state))
+	{
+		follow_route(&vision.result, avg_mass.avg, &upper, &lower);
+	}
+
 	// Dispatch the updating to another function
-	update_loop(avg_mass.avg, &upper, &lower);
+	memset(&control, 0, sizeof(control));
+	update_loop(avg_mass.avg, &upper, &lower, &event, &line);
+
+	send_datagram(&upper, &lower, avg_mass.avg, t_frame);
 }
 
 
@@ -488,8 +751,8 @@ static void pid_controller(int mass, slice_t * upper, slice_t * lower,
 	float err_diff;
 	int speed_r, speed_l;
 
-	// Scale error down
-	err = lower->error * Kerr;
+	// Scale error down (using the sub-pixel error)
+	err = (float) lower->errorq / SLICE_ONE * Kerr;
 
 	//
 	// Calculate PID
@@ -511,7 +774,8 @@ static void pid_controller(int mass, slice_t * upper, slice_t * lower,
 
 	// Limit speed if the line has big changes in direction 
 	// in the future
-	err_diff = abs(lower->error - upper->error) * conf.k_error_diff;
+	err_diff = fabsf((float) (lower->errorq - upper->errorq) / SLICE_ONE) * 
+		conf.k_error_diff;
 
 	// Calculate new speed
 	speed_l = (int) round(speed - err_diff - correction);
@@ -542,6 +806,14 @@ static void pid_controller(int mass, slice_t * upper, slice_t * lower,
 	f->speed_ref_left = speed;
 	f->speed_ref_right = speed;
 	log_add(logs, entry);	
+
+	control.p = P;
+	control.i = I;
+	control.d = D;
+	control.correction = correction;
+	control.speed_left = speed_l;
+	control.speed_right = speed_r;
+	control.speed_ref = speed;
 }
 
 /**
@@ -601,6 +873,56 @@ static void goto_wall(int limit_lower, int limit_upper)
 	}
 }
 
+/**
+ * Check if a track feature is seen. With the classifier enabled, the 
+ * feature classified in the current frame is used. Otherwise the averaged
+ * mass must be inside the given window.
+ *
+ * \param event Feature classified in the current frame
+ * \param type The feature to look for
+ * \param mass Averaged mass of the line
+ * \param lower Lower limit of the mass window
+ * \param upper Upper limit of the mass window
+ */
+static int found_feature(const track_event_t * event, track_type_t type, 
+	int mass, int lower, int upper)
+{
+	if (conf.use_classifier)
+	{
+		return event->type == type && 
+			event->confidence >= conf.classifier_min_confidence;
+	}
+	return mass > lower && mass < upper;
+}
+
+/**
+ * Number of pulses to turn left onto the line that crosses the path.
+ * The fixed turn `nominal` is made for a line perpendicular to the path,
+ * and is corrected by how much the fitted line deviates from that.
+ *
+ * \param line Line fitted in the last frame
+ * \param nominal Pulses for a perpendicular line
+ */
+static int turn_onto_line(const hough_line_t * line, int nominal)
+{
+	int angle, pulses;
+
+	if (!conf.hough_turn || line->votes == 0)
+	{
+		return nominal;
+	}
+
+	// Angle of the normal in [0, 180), 90 being perpendicular to the path
+	angle = line->angle < 0 ? line->angle + 180 : line->angle;
+	angle = angle >= 180 ? angle - 180 : angle;
+
+	pulses = nominal + (int) get_angle_to_pulses(90 - angle);
+	printf("Line at %d deg (offset %d, %d votes), turning %d pulses\n",
+		angle, line->offset, line->votes, pulses);
+
+	return pulses > 0 ? pulses : 0;
+}
+
 /**
  * Update loop callback. Called whenever a new image has been processed.
  * From this point, it's all about calculating new speeds for the motors,
@@ -610,8 +932,11 @@ static void goto_wall(int limit_lower, int limit_upper)
  * \param x The calculated X position of the center mass of the line
  * \param x The calculated Y position of the center mass of the line
  * \param mass The number of pixels identified as the line
+ * \param event The track feature classified in the frame
+ * \param line Straight line fitted while looking for the line
  */
-static int update_loop(int mass, slice_t * upper, slice_t * lower)
+static int update_loop(int mass, slice_t * upper, slice_t * lower,
+	const track_event_t * event, const hough_line_t * line)
 {
 	static float kp, ki, kd;
 	static int speed;
@@ -638,14 +963,14 @@ static int update_loop(int mass, slice_t * upper, slice_t * lower)
 		 */
 		case GOTO_LINE:
 		{
-			printf("mass: %d\n", mass);
-			if (mass > conf.mass_horizontal_lower && 
-				mass < conf.mass_horizontal_upper)
+			printf("mass: %d (%s)\n", mass, track_type_name(event->type));
+			if (found_feature(event, TRACK_HORIZONTAL_LINE, mass, 
+				conf.mass_horizontal_lower, conf.mass_horizontal_upper))
 			{
 				beep();
 				printf("Found the line (%d)\n", mass);
 				
-				rotate(ROTATE_LEFT, P_45);
+				rotate(ROTATE_LEFT, turn_onto_line(line, P_45));
 				goto_speed_mode();
 
 				beep_state_change();
@@ -666,7 +991,8 @@ static int update_loop(int mass, slice_t * upper, slice_t * lower)
 			pid_controller(mass, upper, lower, conf.speed_slow, conf.k_error, 
 				conf.k_p, conf.k_i, conf.k_d);
 
-			if (mass > conf.mass_cross_lower && mass < conf.mass_cross_upper)
+			if (found_feature(event, TRACK_CROSSING, mass, 
+				conf.mass_cross_lower, conf.mass_cross_upper))
 			{
 				printf("Found the crossing! (%d)\n", mass);
 				beep();
@@ -739,9 +1065,16 @@ static int update_loop(int mass, slice_t * upper, slice_t * lower)
 			settling_check();
 
 			printf("Mass %d\n", mass);
-			if (mass > 10000 && mass < 33000)
+			if (conf.use_classifier ? (event->type != TRACK_NONE &&
+				event->confidence >= conf.classifier_min_confidence) :
+				(mass > 10000 && mass < 33000))
 			{
 				printf("Found the line (%d)\n", mass);
+				if (line->votes > 0)
+				{
+					printf("Line at %d deg, offset %d\n", line->angle, 
+						line->offset);
+				}
 
 				// Speed motor state, next state, settling delay
 				goto_speed_mode();
@@ -802,7 +1135,8 @@ static int update_loop(int mass, slice_t * upper, slice_t * lower)
 			kd = conf.k_d_fast;
 			speed = conf.speed_fast;
 
-			if (mass > 23000)
+			if (found_feature(event, TRACK_END, mass, 23000, INT_MAX) ||
+				found_feature(event, TRACK_HORIZONTAL_LINE, mass, 23000, INT_MAX))
 			{
 				printf("Found end (%d)\n", mass);
 
@@ -1001,17 +1335,174 @@ static int update_loop(int mass, slice_t * upper, slice_t * lower)
  * Load the configuration variables into memory.
  */
 
-static void load_config()
+/**
+ * Update what is derived from the configuration and cheap to rebuild.
+ * Called between two frames (with buffer_mutex held).
+ */
+static void apply_config()
 {
-	config_reload();
-
 	wall_pid.P = conf.w_k_p;
 	wall_pid.I = conf.w_k_i;
 	wall_pid.D = conf.w_k_d;
 	wall_pid.max_sum_error = conf.w_max_sum_error;
 	wall_pid.set_point = conf.w_setpoint;
+
+	tracker_set_gains(&tracker, conf.tracker_alpha, conf.tracker_beta);
+
+	governor_configure(&governor, config_get_int("fps"), conf.governor_high,
+		conf.governor_low, conf.governor_down_frames, conf.governor_up_frames,
+		conf.governor_max_level);
+
+	if (conf.avg_mass_count < 1)
+	{
+		conf.avg_mass_count = 1;
+	}
+	if (avg_mass.length != conf.avg_mass_count)
+	{
+		avg_num_free(&avg_mass);
+		avg_num_create(&avg_mass, conf.avg_mass_count);
+	}
 }
 
+static void load_config()
+{
+	cam_model_t model;
+
+	config_reload();
+
+	shadow_configure("shadow_pipeline", conf.shadow_cpu, 
+		conf.shadow_tolerance, config_get_str("shadow_log"));
+
+	mjpeg_configure(conf.mjpeg_quality, conf.mjpeg_fps, conf.mjpeg_budget_us);
+
+	datagram_open(config_get_str("telemetry_addr"), conf.telemetry_port, 
+		conf.telemetry_ttl);
+
+	// Camera model of the lens correction table (rebuilt if it changed)
+	model.fx = conf.cam_fx;
+	model.fy = conf.cam_fy;
+	model.cx = conf.cam_cx;
+	model.cy = conf.cam_cy;
+	model.k1 = conf.cam_k1;
+	model.k2 = conf.cam_k2;
+	model.k3 = conf.cam_k3;
+	model.p1 = conf.cam_p1;
+	model.p2 = conf.cam_p2;
+
+	// Rebuild the image processing pipeline, the lens correction table
+	// and (re)map the flat-field gains between two frames
+	pthread_mutex_lock(&buffer_mutex);
+	undistort_update(&model, conf.undistort);
+	pipeline_configure(&pipeline, "pipeline");
+	apply_config();
+	if (conf.flatfield)
+	{
+		flatfield_load(config_get_str("flatfield_file"));
+	}
+	else
+	{
+		flatfield_unload();
+	}
+	pthread_mutex_unlock(&buffer_mutex);
+}
+
+static void response_field(telemetry_response_t * response, 
+	const config_field_t * field)
+{
+	strncpy(response->name, field->name, TELEMETRY_NAME_SIZE - 1);
+	response->type = field->type == CONFIG_FIELD_FLOAT ? 
+		TELEMETRY_VALUE_FLOAT : TELEMETRY_VALUE_INT;
+	response->value = config_get_field(field);
+}
+
+/**
+ * Apply a remote control command (see telemetry.h) and answer it. Runs
+ * in the vision thread, at the start of a frame.
+ */
+static void apply_command(const remote_command_t * command)
+{
+	const telemetry_command_t * cmd = &command->command;
+	const config_field_t * field;
+	telemetry_response_t response;
+	int i;
+
+	memset(&response, 0, sizeof(response));
+	response.frame = frame_counter;
+
+	switch (cmd->op)
+	{
+		case TELEMETRY_CMD_PING:
+			break;
+
+		case TELEMETRY_CMD_START:
+			reset();
+			current_state = START;
+			break;
+
+		case TELEMETRY_CMD_STOP:
+			motor_ctrl_brake();
+			current_state = WAITING;
+			break;
+
+		case TELEMETRY_CMD_STATE:
+			if (cmd->value < CALIBRATE || cmd->value > FOLLOW_LINE_TEST)
+			{
+				response.status = TELEMETRY_ERR_VALUE;
+				break;
+			}
+			if ((state_t) cmd->value == WAITING)
+			{
+				motor_ctrl_brake();
+			}
+			current_state = (state_t) cmd->value;
+			break;
+
+		case TELEMETRY_CMD_GET:
+		case TELEMETRY_CMD_SET:
+			field = config_find_field(cmd->name);
+			if (field == NULL)
+			{
+				response.status = TELEMETRY_ERR_FIELD;
+				break;
+			}
+			if (cmd->op == TELEMETRY_CMD_SET)
+			{
+				if (!field->live)
+				{
+					response.status = TELEMETRY_ERR_LIVE;
+				}
+				else if (config_set_field(field, cmd->value) < 0)
+				{
+					response.status = TELEMETRY_ERR_VALUE;
+				}
+				else
+				{
+					apply_config();
+					printf("[remote] %s = %g\n", field->name, 
+						config_get_field(field));
+				}
+			}
+			response_field(&response, field);
+			break;
+
+		case TELEMETRY_CMD_DUMP:
+			response.state = current_state;
+			for (i = 0; i < config_n_fields; i++)
+			{
+				response_field(&response, &config_fields[i]);
+				response.remaining = config_n_fields - 1 - i;
+				remote_reply(command, &response);
+			}
+			return;
+
+		default:
+			response.status = TELEMETRY_ERR_COMMAND;
+			break;
+	}
+
+	response.state = current_state;
+	remote_reply(command, &response);
+}
 
 /**
  * SIGINT signal handler.
@@ -1091,6 +1582,61 @@ static void * led_thread_fn(void * ptr)
 	}
 }
 
+/**
+ * Capture frames of blank floor, then write and load the flat-field
+ * gain map. The frames are added by the vision thread; the file is
+ * written here, outside the frame loop. The capture is abandoned when
+ * no frame arrives for FLATCAL_TIMEOUT ms.
+ */
+static void flatfield_calibrate(int frames)
+{
+	int ret, captured, last = 0, idle = 0;
+
+	pthread_mutex_lock(&buffer_mutex);
+	ret = flatfield_capture_start(frames, config_get_str("flatfield_file"));
+	pthread_mutex_unlock(&buffer_mutex);
+	if (ret < 0)
+	{
+		printf("Flat-field calibration already running\n");
+		return;
+	}
+	printf("Capturing %d frames of blank floor\n", frames);
+
+	while (1)
+	{
+		delay(FLATCAL_POLL);
+
+		pthread_mutex_lock(&buffer_mutex);
+		ret = flatfield_capturing();
+		captured = flatfield_captured();
+		idle = captured == last ? idle + FLATCAL_POLL : 0;
+		if (ret && idle >= FLATCAL_TIMEOUT)
+		{
+			flatfield_capture_cancel();
+		}
+		pthread_mutex_unlock(&buffer_mutex);
+
+		if (!ret)
+		{
+			break;
+		}
+		if (idle >= FLATCAL_TIMEOUT)
+		{
+			printf("No frames captured for %d ms (%d of %d), calibration "
+				"cancelled\n", FLATCAL_TIMEOUT, captured, frames);
+			return;
+		}
+		last = captured;
+	}
+
+	if (flatfield_capture_write() == 0)
+	{
+		pthread_mutex_lock(&buffer_mutex);
+		flatfield_load(config_get_str("flatfield_file"));
+		pthread_mutex_unlock(&buffer_mutex);
+	}
+}
+
 /**
  *
  */
@@ -1168,7 +1714,7 @@ static void * shell_thread_fn(void * ptr)
 			 */
 			else if (strcmp(buffer, "r") == 0)
 			{
-				config_reload();
+				load_config();
 				printf("Constants reloaded\n");
 			}
 			/**
@@ -1216,6 +1762,79 @@ static void * shell_thread_fn(void * ptr)
 				pthread_mutex_unlock(&buffer_mutex);
 			}
 
+			/**
+			 * Dump the gray plane of the last processed frame, e.g. for
+			 * comparing the line detectors with vision_bench
+			 */
+			else if (strcmp(buffer, "dumpgray") == 0)
+			{
+				char filename[40];
+
+				pthread_mutex_lock(&buffer_mutex);
+
+				sprintf(filename, "gray-%lu.pgm", frame_counter);
+				printf("Dumping to %s\n", filename);
+				dump_to_pgm(vision.gray, latest_upper_error.x, 
+					latest_upper_error.y, latest_lower_error.x, 
+					latest_lower_error.y, latest_upper_error.mass + 
+					latest_lower_error.mass, filename);
+
+				pthread_mutex_unlock(&buffer_mutex);
+			}
+
+			/**
+			 * Capture frames of blank floor and build the flat-field
+			 * gain map from them. Usage: flatcal [frames]
+			 */
+			else if (strncmp(buffer, "flatcal", 7) == 0)
+			{
+				int frames = 30;
+				sscanf(buffer + 7, "%d", &frames);
+				flatfield_calibrate(frames);
+			}
+			/**
+			 * Print (and reset) the timing of each image processing stage
+			 */
+			else if (strcmp(buffer, "timing") == 0)
+			{
+				pthread_mutex_lock(&buffer_mutex);
+				pipeline_print_stats(&pipeline);
+				pipeline_reset_stats(&pipeline);
+				printf("Unchanged frames skipped: %lu\n", vision.skipped);
+				printf("Frames bridged by the tracker: %lu\n", coasted_frames);
+				printf("Quality level: %d (%s), load %.0f%%, %lu changes\n",
+					governor.level, governor_level_name(governor.level),
+					governor.load * 100, governor.changes);
+				vision.skipped = 0;
+				coasted_frames = 0;
+				pthread_mutex_unlock(&buffer_mutex);
+			}
+			/**
+			 * Print (and reset) the comparison of the production and 
+			 * shadow pipelines
+			 */
+			else if (strcmp(buffer, "shadow") == 0)
+			{
+				shadow_print_stats();
+			}
+			/**
+			 * Print the connected viewers and how far they lag behind,
+			 * and the remote control commands
+			 */
+			else if (strcmp(buffer, "clients") == 0)
+			{
+				broadcast_print_stats();
+				datagram_print_stats();
+				remote_print_stats();
+			}
+			/**
+			 * Print (and reset) the encoding time of the MJPEG stream
+			 */
+			else if (strcmp(buffer, "mjpeg") == 0)
+			{
+				mjpeg_print_stats();
+			}
+
 			else if (strcmp(buffer, "wall") == 0)
 			{	
 				straight_forward();
@@ -1260,10 +1879,21 @@ int main(int argc, char ** argv)
 	// Initialize variables
 	frame_counter = 0;
 	current_state = WAITING;
-	buffer = malloc(IMG_SIZE);
 	buffer_copy = malloc(IMG_SIZE);
+	if (pipeline_ctx_init(&vision) < 0)
+	{
+		printf("Failed allocating image buffers, exiting...\n");
+		exit(-1);
+	}
+	if (shadow_init(&vision) < 0)
+	{
+		printf("Failed starting the shadow pipeline, exiting...\n");
+		exit(-1);
+	}
 
 	pthread_mutex_init(&buffer_mutex, NULL);
+	tracker_init(&tracker, 0, 0);
+	governor_init(&governor);
 
 	// Init and load the configuration file
 	config_init();
@@ -1273,7 +1903,7 @@ int main(int argc, char ** argv)
 	logs = log_create();
 
 	// Allocate average number variables
-	avg_num_create(&avg_mass, AVG_MASS_CNT);
+	// (the mass averager is sized by load_config)
 	avg_num_create(&avg_front_dist, AVG_DIST_CNT);
 	avg_num_create(&avg_side_dist, AVG_DIST_CNT);
 
@@ -1304,8 +1934,23 @@ int main(int argc, char ** argv)
 	cam_start_capturing(cam);
 	
 	// Open TCP server socket, and start listening for connections	
-	broadcast_init();
-	broadcast_start();
+	remote_set_dump_size(config_n_fields);
+	if (broadcast_init() < 0 || !broadcast_start())
+	{
+		printf("Failed starting the broadcast server\n");
+	}
+
+	// Share the frames with other processes, if enabled
+	if (conf.shm_slots > 0)
+	{
+		shm_ring = shm_ring_create(SHM_RING_NAME, conf.shm_slots);
+	}
+
+	// Serve the gray image over HTTP, if enabled
+	if (mjpeg_start(conf.mjpeg_port) < 0)
+	{
+		printf("Failed starting the MJPEG stream\n");
+	}
 
 	// Reset all counters and stuff
 	reset();
@@ -1345,6 +1990,12 @@ led_current_state = KNIGHT_NIDER;
 	// Close server socket and drop connections
 	broadcast_release();
 
+	// Remove the frame ring
+	if (shm_ring != NULL)
+	{
+		shm_ring_close(shm_ring);
+	}
+
 	// Close the I2C bus
 	i2c_bus_close();
 
@@ -0,0 +1,2 @@
+#!/bin/bash
+gcc -O2 broadcast_bench.c receiver.c encoding.c broadcast.c telemetry.c remote.c -o broadcast_bench -lpthread
@@ -0,0 +1,2 @@
+#!/bin/bash
+gcc -O2 eyectl.c receiver.c encoding.c -o eyectl
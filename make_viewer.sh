@@ -1,3 +1,2 @@
-
 #!/bin/bash
-gcc -g -O0 viewer.c -o viewer -lX11
\ No newline at end of file
+gcc -g -O0 viewer.c receiver.c encoding.c -o viewer -lX11
\ No newline at end of file
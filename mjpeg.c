@@ -0,0 +1,558 @@
+
+#include "common.h"
+#include "mjpeg.h"
+#include "jpeg.h"
+#include "timer.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/**
+ * Serves the gray image (before thresholding) as a JPEG stream over HTTP
+ * (multipart/x-mixed-replace, as understood by browsers). The frames are
+ * encoded in the server thread, and only while someone is watching; the
+ * vision thread just copies the image into a triple buffer.
+ */
+
+#define MAX_CLIENTS			4
+
+/**
+ * Time a new connection has to send its request
+ */
+#define REQUEST_TIMEOUT_US	1000000LL
+
+/**
+ * Socket send buffer of a client. A frame that doesn't fit (the client
+ * is that far behind) drops the client, as the server never waits for
+ * one.
+ */
+#define SEND_BUFFER			(256 * 1024)
+
+#define BOUNDARY			"eyebotframe"
+
+/**
+ * Lowest quality used when encoding takes longer than the budget
+ */
+#define MIN_QUALITY			20
+
+/**
+ * Weight of a new frame in the smoothed encoding time
+ */
+#define TIME_WEIGHT			0.1f
+
+/**
+ * Set in `middle` when the slot holds an image the server hasn't taken
+ */
+#define SLOT_FRESH			4
+
+/**
+ * Triple buffer handing images from mjpeg_submit to the server thread
+ * (see broadcast.c)
+ */
+static unsigned char * slots[3];
+static int back = 0, middle = 1, front = 2;
+
+static unsigned char * jpeg_buffer;
+static int jpeg_buffer_size;
+static jpeg_encoder_t encoder;
+
+/**
+ * A connection. It is answered with the stream header when its request
+ * arrives, and gets the frames from then on.
+ */
+typedef struct client {
+	int fd;
+	int streaming;
+	long long accepted_us;
+} client_t;
+
+static int enabled = 0;
+static client_t clients[MAX_CLIENTS];
+// Clients receiving the stream
+static int n_clients = 0;
+
+static int server_fd = -1;
+static int wakeup_fd = -1;
+static pthread_t thread;
+
+/**
+ * Settings, written by mjpeg_configure
+ */
+static int quality = 75;
+static long long interval_us = 200000;
+static long long budget_us = 20000;
+
+/**
+ * Statistics, written by the server thread. mjpeg_print_stats sets
+ * `reset_stats` to have them cleared by the server thread.
+ */
+static unsigned long n_frames, n_over, n_failed, n_dropped;
+static unsigned long long total_bytes;
+static long long total_us, max_us;
+static float avg_us;
+static int reset_stats = 0;
+
+static void client_close(int i)
+{
+	if (clients[i].streaming)
+	{
+		printf("[mjpeg] Client %d disconnected\n", i);
+		__atomic_sub_fetch(&n_clients, 1, __ATOMIC_RELAXED);
+	}
+	close(clients[i].fd);
+	clients[i].fd = -1;
+	clients[i].streaming = 0;
+}
+
+/**
+ * Send all of the buffers without waiting (the socket is non-blocking).
+ * Returns -1 if the client is gone, or if the buffers don't fit in its
+ * socket buffer: the stream of that client is broken then, and it has
+ * to be closed.
+ */
+static int send_all(int fd, struct iovec * iov, int n)
+{
+	struct msghdr msg = { 0 };
+	ssize_t sent;
+
+	while (n > 0)
+	{
+		msg.msg_iov = iov;
+		msg.msg_iovlen = n;
+
+		sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if (sent < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+
+		while (n > 0 && (size_t) sent >= iov->iov_len)
+		{
+			sent -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n > 0)
+		{
+			iov->iov_base = (char *) iov->iov_base + sent;
+			iov->iov_len -= sent;
+		}
+	}
+	return 0;
+}
+
+static void accept_client()
+{
+	int fd, i, size = SEND_BUFFER;
+
+	fd = accept(server_fd, NULL, NULL);
+	if (fd < 0)
+	{
+		return;
+	}
+
+	for (i = 0; i < MAX_CLIENTS && clients[i].fd >= 0; i++);
+	if (i == MAX_CLIENTS)
+	{
+		close(fd);
+		return;
+	}
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+	clients[i].fd = fd;
+	clients[i].streaming = 0;
+	clients[i].accepted_us = timer_now_us();
+}
+
+/**
+ * Read from a client that poll() found readable. The first request is
+ * answered with the stream header (whatever is asked for, the answer is
+ * the stream); anything after that is ignored. The client is closed when
+ * it goes away.
+ */
+static void client_read(int i)
+{
+	static const char response[] =
+		"HTTP/1.0 200 OK\r\n"
+		"Cache-Control: no-cache\r\n"
+		"Connection: close\r\n"
+		"Content-Type: multipart/x-mixed-replace; boundary=" BOUNDARY "\r\n"
+		"\r\n";
+	struct iovec iov;
+	char buffer[1024];
+	ssize_t n;
+
+	n = recv(clients[i].fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+	{
+		return;
+	}
+	if (n <= 0)
+	{
+		client_close(i);
+		return;
+	}
+	if (clients[i].streaming)
+	{
+		return;
+	}
+
+	iov.iov_base = (void *) response;
+	iov.iov_len = sizeof(response) - 1;
+	if (send_all(clients[i].fd, &iov, 1) < 0)
+	{
+		client_close(i);
+		return;
+	}
+
+	clients[i].streaming = 1;
+	__atomic_add_fetch(&n_clients, 1, __ATOMIC_RELAXED);
+	printf("[mjpeg] Client %d connected\n", i);
+}
+
+/**
+ * Close the connections that haven't sent their request in time.
+ *
+ * \return Time until the next of the others times out (ms), or -1 if
+ * no connection is waiting for its request
+ */
+static int expire_requests()
+{
+	long long now = timer_now_us(), left, next = -1;
+	int i;
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+	{
+		if (clients[i].fd < 0 || clients[i].streaming)
+		{
+			continue;
+		}
+
+		left = clients[i].accepted_us + REQUEST_TIMEOUT_US - now;
+		if (left <= 0)
+		{
+			client_close(i);
+		}
+		else if (next < 0 || left < next)
+		{
+			next = left;
+		}
+	}
+	return next < 0 ? -1 : (int) (next / 1000) + 1;
+}
+
+static void clear_stats()
+{
+	n_frames = n_over = n_failed = n_dropped = 0;
+	total_bytes = 0;
+	total_us = max_us = 0;
+}
+
+/**
+ * Adjust the quality to the encoding budget: step down while the
+ * smoothed encoding time is above the budget, and back up towards the
+ * configured quality when it is well below.
+ */
+static void adjust_quality(long long us)
+{
+	int want = __atomic_load_n(&quality, __ATOMIC_RELAXED);
+	long long budget = __atomic_load_n(&budget_us, __ATOMIC_RELAXED);
+	int q = encoder.quality;
+
+	avg_us += TIME_WEIGHT * (us - avg_us);
+
+	if (us > budget)
+	{
+		n_over++;
+	}
+
+	if (budget > 0 && avg_us > budget && q > MIN_QUALITY)
+	{
+		q -= 5;
+	}
+	else if (budget > 0 && avg_us < budget / 2 && q < want)
+	{
+		q += 5;
+	}
+
+	if (q > want || budget <= 0)
+	{
+		q = want;
+	}
+	if (q != encoder.quality)
+	{
+		jpeg_init(&encoder, q);
+	}
+}
+
+static void send_frame()
+{
+	char part[128];
+	struct iovec iov[3];
+	long long t;
+	int i, size;
+
+	front = __atomic_exchange_n(&middle, front, __ATOMIC_ACQ_REL) & ~SLOT_FRESH;
+
+	t = timer_now_us();
+	size = jpeg_encode(&encoder, slots[front], WIDTH, HEIGHT, jpeg_buffer,
+		jpeg_buffer_size);
+	t = timer_now_us() - t;
+
+	n_frames++;
+	total_us += t;
+	if (t > max_us)
+	{
+		max_us = t;
+	}
+	adjust_quality(t);
+
+	if (size < 0)
+	{
+		n_failed++;
+		return;
+	}
+	total_bytes += size;
+
+	sprintf(part, "--" BOUNDARY "\r\n"
+		"Content-Type: image/jpeg\r\n"
+		"Content-Length: %d\r\n"
+		"\r\n", size);
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+	{
+		if (!clients[i].streaming)
+		{
+			continue;
+		}
+
+		iov[0].iov_base = part;
+		iov[0].iov_len = strlen(part);
+		iov[1].iov_base = jpeg_buffer;
+		iov[1].iov_len = size;
+		iov[2].iov_base = "\r\n";
+		iov[2].iov_len = 2;
+
+		if (send_all(clients[i].fd, iov, 3) < 0)
+		{
+			n_dropped++;
+			client_close(i);
+		}
+	}
+}
+
+static void * mjpeg_thread_fn(void * arg)
+{
+	struct pollfd fds[2 + MAX_CLIENTS];
+	uint64_t value;
+	int i, n, timeout;
+
+	while (1)
+	{
+		timeout = expire_requests();
+
+		fds[0].fd = server_fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = wakeup_fd;
+		fds[1].events = POLLIN;
+
+		// Clients only send their request; watch them to answer it, and
+		// to notice when they go away
+		for (i = 0; i < MAX_CLIENTS; i++)
+		{
+			fds[2 + i].fd = clients[i].fd;
+			fds[2 + i].events = POLLIN;
+		}
+
+		n = poll(fds, 2 + MAX_CLIENTS, timeout);
+		if (n <= 0)
+		{
+			continue;
+		}
+
+		for (i = 0; i < MAX_CLIENTS; i++)
+		{
+			if (clients[i].fd >= 0 && fds[2 + i].revents)
+			{
+				client_read(i);
+			}
+		}
+
+		if (fds[0].revents & POLLIN)
+		{
+			accept_client();
+		}
+
+		if ((fds[1].revents & POLLIN)
+			&& read(wakeup_fd, &value, sizeof(value)) == sizeof(value))
+		{
+			if (__atomic_exchange_n(&reset_stats, 0, __ATOMIC_ACQ_REL))
+			{
+				clear_stats();
+			}
+			if (__atomic_load_n(&middle, __ATOMIC_ACQUIRE) & SLOT_FRESH)
+			{
+				send_frame();
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Start the stream server on the given port (0 leaves it disabled)
+ */
+int mjpeg_start(int port)
+{
+	struct sockaddr_in addr;
+	int i, optval = 1;
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+	{
+		clients[i].fd = -1;
+	}
+
+	if (port <= 0)
+	{
+		return 0;
+	}
+
+	for (i = 0; i < 3; i++)
+	{
+		slots[i] = (unsigned char *) malloc(IMAGE_PIXELS);
+	}
+	jpeg_buffer_size = IMAGE_PIXELS + JPEG_HEADER_SIZE;
+	jpeg_buffer = (unsigned char *) malloc(jpeg_buffer_size);
+	if (slots[0] == NULL || slots[1] == NULL || slots[2] == NULL
+		|| jpeg_buffer == NULL)
+	{
+		return -1;
+	}
+	jpeg_init(&encoder, quality);
+
+	server_fd = socket(AF_INET, SOCK_STREAM, 0);
+	wakeup_fd = eventfd(0, EFD_NONBLOCK);
+	if (server_fd < 0 || wakeup_fd < 0)
+	{
+		printf("[mjpeg] Could not make a socket\n");
+		return -1;
+	}
+	setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof optval);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_addr.s_addr = INADDR_ANY;
+	addr.sin_port = htons(port);
+	addr.sin_family = AF_INET;
+
+	if (bind(server_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+		|| listen(server_fd, MAX_CLIENTS) < 0)
+	{
+		printf("[mjpeg] Could not listen on port %d\n", port);
+		close(server_fd);
+		return -1;
+	}
+
+	pthread_create(&thread, NULL, mjpeg_thread_fn, NULL);
+	enabled = 1;
+
+	printf("[mjpeg] Streaming on http://<robot>:%d/\n", port);
+	return 0;
+}
+
+/**
+ * Set the stream quality (1 - 100), frame rate, and the time encoding a
+ * frame may take (0 for no limit)
+ */
+void mjpeg_configure(int q, int fps, int budget)
+{
+	__atomic_store_n(&quality, q < 1 ? 1 : (q > 100 ? 100 : q),
+		__ATOMIC_RELAXED);
+	__atomic_store_n(&interval_us, 1000000LL / (fps > 0 ? fps : 1),
+		__ATOMIC_RELAXED);
+	__atomic_store_n(&budget_us, (long long) budget, __ATOMIC_RELAXED);
+}
+
+/**
+ * Hand a gray image to the stream. Called from the vision thread: the
+ * image is only copied when someone is watching and a frame is due, and
+ * this never waits for the server thread.
+ */
+void mjpeg_submit(const unsigned char * gray)
+{
+	static long long last_us = 0;
+	long long now;
+	uint64_t one = 1;
+
+	if (!enabled || __atomic_load_n(&n_clients, __ATOMIC_RELAXED) == 0)
+	{
+		return;
+	}
+
+	now = timer_now_us();
+	if (now - last_us < __atomic_load_n(&interval_us, __ATOMIC_RELAXED))
+	{
+		return;
+	}
+	last_us = now;
+
+	memcpy(slots[back], gray, IMAGE_PIXELS);
+	back = __atomic_exchange_n(&middle, back | SLOT_FRESH, __ATOMIC_ACQ_REL)
+		& ~SLOT_FRESH;
+
+	if (write(wakeup_fd, &one, sizeof(one)) < 0)
+	{
+		perror("[mjpeg] write()");
+	}
+}
+
+/**
+ * Print (and reset) the encoding statistics
+ */
+void mjpeg_print_stats()
+{
+	uint64_t one = 1;
+
+	if (!enabled)
+	{
+		printf("MJPEG stream disabled\n");
+		return;
+	}
+
+	// The counters are owned by the server thread; they are only read
+	// here, so a value may be a frame old
+	printf("MJPEG: %d client(s), quality %d, %lu frames, %lu too large, "
+		"%lu client(s) dropped\n", n_clients, encoder.quality, n_frames,
+		n_failed, n_dropped);
+	if (n_frames > 0)
+	{
+		printf("Encoding: avg %lld us, max %lld us, %lu over the %lld us "
+			"budget, avg %llu bytes\n", total_us / n_frames, max_us, n_over,
+			budget_us, total_bytes / n_frames);
+	}
+
+	// Have the server thread clear them
+	__atomic_store_n(&reset_stats, 1, __ATOMIC_RELEASE);
+	if (write(wakeup_fd, &one, sizeof(one)) < 0)
+	{
+		perror("[mjpeg] write()");
+	}
+}
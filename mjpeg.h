@@ -0,0 +1,11 @@
+
+#ifndef _MJPEG_H_
+#define _MJPEG_H_
+
+int mjpeg_start(int port);
+void mjpeg_configure(int quality, int fps, int budget_us);
+void mjpeg_submit(const unsigned char * gray);
+void mjpeg_print_stats();
+
+#endif
+
@@ -0,0 +1,176 @@
+
+#include "common.h"
+#include "morph.h"
+
+#include <string.h>
+#include <pthread.h>
+
+/**
+ * Multiplying eight bytes that are either 0 or 1 with this constant
+ * gathers them as the eight most significant bits (byte k -> bit 56 + k).
+ */
+#define GATHER_BITS				0x0102040810204080ULL
+#define BYTE_LSBS				0x0101010101010101ULL
+
+/**
+ * Eight unpacked pixels for every value of a byte of packed pixels.
+ * Built once, by the first thread unpacking an image.
+ */
+static uint64_t spread[256];
+static pthread_once_t spread_once = PTHREAD_ONCE_INIT;
+
+static void build_spread()
+{
+	int i, k;
+	uint64_t v;
+
+	for (i = 0; i < 256; i++)
+	{
+		v = 0;
+		for (k = 0; k < 8; k++)
+		{
+			v |= (uint64_t) ((i & (1 << k)) ? LINE : FLOOR) << (8 * k);
+		}
+		spread[i] = v;
+	}
+}
+
+/**
+ * Pack a binary image (LINE/FLOOR bytes) into one bit per pixel.
+ * Eight pixels are converted at a time.
+ */
+void morph_pack(const unsigned char * bin, uint64_t * packed)
+{
+	uint64_t v, word;
+	int i, k;
+
+	for (i = 0; i < MORPH_SIZE; i++)
+	{
+		word = 0;
+		for (k = 0; k < 8; k++)
+		{
+			memcpy(&v, bin, 8);
+			bin += 8;
+
+			// 1 in every byte that is a line pixel (LINE == 0)
+			v = ~v & BYTE_LSBS;
+			word |= ((v * GATHER_BITS) >> 56) << (8 * k);
+		}
+		packed[i] = word;
+	}
+}
+
+/**
+ * Unpack a packed image to LINE/FLOOR bytes.
+ */
+void morph_unpack(const uint64_t * packed, unsigned char * bin)
+{
+	uint64_t word;
+	int i, k;
+
+	pthread_once(&spread_once, build_spread);
+
+	for (i = 0; i < MORPH_SIZE; i++)
+	{
+		word = packed[i];
+		for (k = 0; k < 8; k++)
+		{
+			memcpy(bin, &spread[word & 0xFF], 8);
+			word >>= 8;
+			bin += 8;
+		}
+	}
+}
+
+/**
+ * Horizontal part of the 3x3 operator for a single row. Pixels outside
+ * the image take the value of `border` (all ones or all zeros).
+ *
+ * \param erode Non-zero for AND (erosion), zero for OR (dilation)
+ */
+static inline void row_op(const uint64_t * src, uint64_t * dst, int erode,
+	uint64_t border)
+{
+	uint64_t prev, next, left, right;
+	int w;
+
+	for (w = 0; w < MORPH_WORDS; w++)
+	{
+		prev = w > 0 ? src[w - 1] : border;
+		next = w < MORPH_WORDS - 1 ? src[w + 1] : border;
+
+		// Neighbour to the left (x - 1) and right (x + 1) of every bit
+		left = (src[w] << 1) | (prev >> 63);
+		right = (src[w] >> 1) | (next << 63);
+
+		dst[w] = erode ? (src[w] & left & right) : (src[w] | left | right);
+	}
+}
+
+/**
+ * Apply a 3x3 square erosion or dilation. The horizontal pass is done
+ * into `dst`, and the vertical pass combines three rows of it using a
+ * small rolling buffer.
+ */
+static void op3x3(const uint64_t * src, uint64_t * dst, int erode)
+{
+	uint64_t border = erode ? ~0ULL : 0ULL;
+	uint64_t above[MORPH_WORDS], cur[MORPH_WORDS];
+	const uint64_t * below;
+	int y, w;
+
+	for (y = 0; y < HEIGHT; y++)
+	{
+		row_op(src + y * MORPH_WORDS, dst + y * MORPH_WORDS, erode, border);
+	}
+
+	for (w = 0; w < MORPH_WORDS; w++)
+	{
+		above[w] = border;
+	}
+
+	for (y = 0; y < HEIGHT; y++)
+	{
+		uint64_t * row = dst + y * MORPH_WORDS;
+		below = y < HEIGHT - 1 ? row + MORPH_WORDS : NULL;
+
+		for (w = 0; w < MORPH_WORDS; w++)
+		{
+			uint64_t b = below != NULL ? below[w] : border;
+			cur[w] = row[w];
+			row[w] = erode ? (above[w] & cur[w] & b) : (above[w] | cur[w] | b);
+			above[w] = cur[w];
+		}
+	}
+}
+
+void morph_erode(const uint64_t * src, uint64_t * dst)
+{
+	op3x3(src, dst, 1);
+}
+
+void morph_dilate(const uint64_t * src, uint64_t * dst)
+{
+	op3x3(src, dst, 0);
+}
+
+/**
+ * Opening (erosion followed by dilation). Removes isolated line pixels
+ * and thin noise. The result is written back to `img`.
+ */
+void morph_open(uint64_t * img, uint64_t * tmp)
+{
+	morph_erode(img, tmp);
+	morph_dilate(tmp, img);
+}
+
+/**
+ * Closing (dilation followed by erosion). Fills small holes in the line.
+ * The result is written back to `img`.
+ */
+void morph_close(uint64_t * img, uint64_t * tmp)
+{
+	morph_dilate(img, tmp);
+	morph_erode(tmp, img);
+}
+
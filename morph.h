@@ -0,0 +1,25 @@
+
+#ifndef _MORPH_H_
+#define _MORPH_H_
+
+#include <stdint.h>
+#include "common.h"
+
+/**
+ * A packed binary image has one bit per pixel, set for line pixels.
+ * Each row is MORPH_WORDS 64-bit words, bit `i` of word `w` being the
+ * pixel in column `w * 64 + i`.
+ */
+#define MORPH_WORDS				((WIDTH + 63) / 64)
+#define MORPH_SIZE				(MORPH_WORDS * HEIGHT)
+
+void morph_pack(const unsigned char * bin, uint64_t * packed);
+void morph_unpack(const uint64_t * packed, unsigned char * bin);
+
+void morph_erode(const uint64_t * src, uint64_t * dst);
+void morph_dilate(const uint64_t * src, uint64_t * dst);
+void morph_open(uint64_t * img, uint64_t * tmp);
+void morph_close(uint64_t * img, uint64_t * tmp);
+
+#endif
+
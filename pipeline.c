@@ -0,0 +1,689 @@
+
+#include "common.h"
+#include "configuration.h"
+#include "pipeline.h"
+#include "undistort.h"
+#include "flatfield.h"
+#include "morph.h"
+#include "edge.h"
+#include "timer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Definition of a stage that can be used in the pipeline
+ */
+typedef struct stage_def {
+	const char * name;
+	stage_fn_t fn;
+	int flags;
+} stage_def_t;
+
+/**
+ * Contrast lookup table and the parameters it was built from
+ */
+static unsigned char lut[256];
+static int lut_identity = 1;
+static float lut_brightness = 0, lut_contrast = 1, lut_gamma = 1;
+
+/**
+ * Return the contrast lookup table, or NULL if it is the identity
+ * mapping. The table is only rebuilt when the parameters change.
+ */
+static const unsigned char * get_lut()
+{
+	if (conf.k_brightness != lut_brightness || 
+		conf.k_contrast != lut_contrast || conf.k_gamma != lut_gamma)
+	{
+		lut_brightness = conf.k_brightness;
+		lut_contrast = conf.k_contrast;
+		lut_gamma = conf.k_gamma;
+		lut_identity = image_build_lut(lut, lut_brightness, lut_contrast,
+			lut_gamma);
+	}
+	return lut_identity ? NULL : lut;
+}
+
+/**
+ * Copy the luminance channel of the YUYV frame to the gray plane.
+ * The flat-field gains and, unless the pipeline has a separate `lut` 
+ * stage, the contrast lookup table are applied in the same pass.
+ *
+ * While a flat-field calibration is running, the uncorrected frame
+ * is passed on to the calibration.
+ */
+static void stage_deinterleave(pipeline_ctx_t * ctx)
+{
+	const unsigned char * table = ctx->fuse_lut ? get_lut() : NULL;
+	const uint16_t * gains = flatfield_gains();
+
+	if (flatfield_capturing())
+	{
+		image_deinterleave(ctx->frame, ctx->gray, NULL);
+		flatfield_capture_add(ctx->gray);
+	}
+	else if (gains != NULL)
+	{
+		image_deinterleave_gain(ctx->frame, ctx->gray, gains, FLATFIELD_SHIFT,
+			table);
+	}
+	else
+	{
+		image_deinterleave(ctx->frame, ctx->gray, table);
+	}
+	ctx->out = ctx->gray;
+}
+
+/**
+ * Apply the contrast lookup table to the gray plane.
+ */
+static void stage_lut(pipeline_ctx_t * ctx)
+{
+	const unsigned char * table = get_lut();
+	if (table != NULL)
+	{
+		image_apply_lut(ctx->gray, table);
+	}
+}
+
+/**
+ * Temporal noise filter on the gray plane. The history is seeded with
+ * the first frame.
+ */
+static void stage_denoise(pipeline_ctx_t * ctx)
+{
+	int i;
+
+	if (!ctx->history_valid)
+	{
+		for (i = 0; i < IMG_SIZE; i++)
+		{
+			ctx->history[i] = ctx->gray[i] << IMAGE_HISTORY_SHIFT;
+		}
+		ctx->history_valid = 1;
+		return;
+	}
+
+	image_denoise(ctx->gray, ctx->history, 
+		(int) (conf.denoise_alpha * 32767), conf.denoise_motion);
+}
+
+/**
+ * Rows to run the line detector on: from the first to the last threshold
+ * band boundary, starting no higher than the region of interest. Rows
+ * above the region of interest are cleared.
+ *
+ * \return 0 if there are no rows to process
+ */
+static int detect_rows(pipeline_ctx_t * ctx, int * start, int * end)
+{
+	if (conf.n_threshold_bands < 2)
+	{
+		return 0;
+	}
+
+	*start = conf.threshold_bands[0];
+	*end = conf.threshold_bands[conf.n_threshold_bands - 1];
+	if (*start < 0) *start = 0;
+	if (*end > HEIGHT) *end = HEIGHT;
+
+	if (ctx->roi_start > *start && *start < *end)
+	{
+		memset(ctx->bin + INDEX((*start)), FLOOR, 
+			((ctx->roi_start < *end ? ctx->roi_start : *end) - *start) * WIDTH);
+		*start = ctx->roi_start;
+	}
+	return *start < *end;
+}
+
+/**
+ * Threshold a band, optionally summing up the darkness weights of
+ * each row.
+ */
+static void threshold_band(pipeline_ctx_t * ctx, int start, int end,
+	int weighted)
+{
+	int step = ctx->row_step > 1 ? ctx->row_step : 1;
+	int thr;
+
+	if (weighted)
+	{
+		thr = image_optimum_threshold(ctx->gray, start, end, step);
+		image_threshold_weighted(ctx->gray, ctx->bin, start, end, thr, step,
+			ctx->rows);
+	}
+	else if (step > 1)
+	{
+		thr = image_optimum_threshold(ctx->gray, start, end, step);
+		image_threshold_rows(ctx->gray, ctx->bin, start, end, thr, step);
+	}
+	else
+	{
+		extract_slice(ctx->gray, ctx->bin, start, end, 0);
+	}
+}
+
+static void threshold_bands(pipeline_ctx_t * ctx, int weighted)
+{
+	int i, start, end, first, last;
+
+	ctx->out = ctx->bin;
+	if (!detect_rows(ctx, &first, &last))
+	{
+		return;
+	}
+
+	if (ctx->single_band)
+	{
+		threshold_band(ctx, first, last, weighted);
+		return;
+	}
+
+	for (i = 0; i < conf.n_threshold_bands - 1; i++)
+	{
+		start = conf.threshold_bands[i];
+		end = conf.threshold_bands[i + 1];
+		if (start < first) start = first;
+		if (end > last) end = last;
+
+		if (start < end)
+		{
+			threshold_band(ctx, start, end, weighted);
+		}
+	}
+}
+
+/**
+ * Threshold each of the configured bands of the gray plane
+ * into the binary plane.
+ */
+static void stage_threshold(pipeline_ctx_t * ctx)
+{
+	threshold_bands(ctx, 0);
+}
+
+/**
+ * Threshold like `threshold`, and calculate the center of mass of the
+ * upper and lower slice in the same pass (replacing `com`). Line pixels
+ * are weighted by how much darker than the threshold they are, giving
+ * a sub-pixel centroid.
+ */
+static void stage_centroid(pipeline_ctx_t * ctx)
+{
+	vision_result_t * r = &ctx->result;
+
+	memset(ctx->rows, 0, sizeof(ctx->rows));
+	threshold_bands(ctx, 1);
+
+	image_weighted_centroid(ctx->rows, &r->upper, conf.slice_upper_start,
+		conf.slice_upper_end);
+	image_weighted_centroid(ctx->rows, &r->lower, conf.slice_lower_start,
+		conf.slice_lower_end);
+
+	r->mass = r->upper.mass + r->lower.mass;
+}
+
+/**
+ * Edge based line detection over the rows covered by the thresholding
+ * bands. Writes the binary plane like `threshold`.
+ */
+static void stage_edge(pipeline_ctx_t * ctx)
+{
+	int start, end, y, k;
+
+	ctx->out = ctx->bin;
+	if (!detect_rows(ctx, &start, &end))
+	{
+		return;
+	}
+
+	if (ctx->row_step <= 1)
+	{
+		edge_detect(ctx->gray, ctx->bin, start, end, conf.edge_threshold,
+			conf.edge_max_width);
+		return;
+	}
+
+	for (y = start; y < end; y += ctx->row_step)
+	{
+		edge_detect(ctx->gray, ctx->bin, y, y + 1, conf.edge_threshold,
+			conf.edge_max_width);
+		for (k = 1; k < ctx->row_step && y + k < end; k++)
+		{
+			memcpy(ctx->bin + INDEX((y + k)), ctx->bin + INDEX(y), WIDTH);
+		}
+	}
+}
+
+/**
+ * Run the line detector selected by the `detector` option, so the
+ * detector can be switched by reloading the configuration.
+ */
+static void stage_detect(pipeline_ctx_t * ctx)
+{
+	if (conf.detector == DETECTOR_EDGE)
+	{
+		stage_edge(ctx);
+	}
+	else
+	{
+		stage_threshold(ctx);
+	}
+}
+
+/**
+ * Morphological operators on the binary plane. The plane is packed to
+ * one bit per pixel, processed with 64-bit shifts and AND/OR, and
+ * unpacked again.
+ */
+static void stage_erode(pipeline_ctx_t * ctx)
+{
+	morph_pack(ctx->bin, ctx->scratch);
+	morph_erode(ctx->scratch, ctx->packed);
+	morph_unpack(ctx->packed, ctx->bin);
+}
+
+static void stage_dilate(pipeline_ctx_t * ctx)
+{
+	morph_pack(ctx->bin, ctx->scratch);
+	morph_dilate(ctx->scratch, ctx->packed);
+	morph_unpack(ctx->packed, ctx->bin);
+}
+
+static void stage_open(pipeline_ctx_t * ctx)
+{
+	morph_pack(ctx->bin, ctx->packed);
+	morph_open(ctx->packed, ctx->scratch);
+	morph_unpack(ctx->packed, ctx->bin);
+}
+
+static void stage_close(pipeline_ctx_t * ctx)
+{
+	morph_pack(ctx->bin, ctx->packed);
+	morph_close(ctx->packed, ctx->scratch);
+	morph_unpack(ctx->packed, ctx->bin);
+}
+
+/**
+ * Label the connected regions of the binary plane, over the rows covered
+ * by the thresholding bands. Regions smaller than `blob_min_area` are
+ * removed, and the largest region is recorded in the result.
+ */
+static void stage_blobs(pipeline_ctx_t * ctx)
+{
+	vision_result_t * r = &ctx->result;
+	int start, end;
+
+	if (conf.n_threshold_bands < 2)
+	{
+		return;
+	}
+
+	if (ctx->blob_work == NULL)
+	{
+		ctx->blob_work = (blob_work_t *) malloc(sizeof(blob_work_t));
+		if (ctx->blob_work == NULL)
+		{
+			return;
+		}
+	}
+
+	start = conf.threshold_bands[0];
+	end = conf.threshold_bands[conf.n_threshold_bands - 1];
+	if (ctx->roi_start > start)
+	{
+		start = ctx->roi_start;
+	}
+
+	r->n_blobs = blob_detect(ctx->bin, start, end, conf.blob_min_area,
+		ctx->blob_work, &r->blob);
+}
+
+/**
+ * Calculate the center of mass of the upper and lower slice
+ * of the binary plane.
+ */
+static void stage_com(pipeline_ctx_t * ctx)
+{
+	vision_result_t * r = &ctx->result;
+
+	// Upper part of the image (this is where the line is farest away)
+	calculate_center_of_mass(ctx->bin, &r->upper, conf.slice_upper_start,
+		conf.slice_upper_end);
+
+	// Lower part of the image
+	calculate_center_of_mass(ctx->bin, &r->lower, conf.slice_lower_start,
+		conf.slice_lower_end);
+
+	r->mass = r->upper.mass + r->lower.mass;
+}
+
+/**
+ * Record the line runs of every row of the binary plane.
+ */
+static void stage_runs(pipeline_ctx_t * ctx)
+{
+	track_profile(ctx->bin, &ctx->profile, conf.run_min_width);
+}
+
+/**
+ * Classify the track feature from the row profiles.
+ */
+static void stage_classify(pipeline_ctx_t * ctx)
+{
+	track_params_t params;
+
+	params.wide_width = conf.track_wide_width;
+	params.wide_rows = conf.track_wide_rows;
+	params.fork_rows = conf.track_fork_rows;
+	params.end_rows = conf.track_end_rows;
+
+	track_classify(&ctx->profile, &params, &ctx->result.event);
+}
+
+/**
+ * Track the two branches of a forking line from the row profiles.
+ */
+static void stage_branches(pipeline_ctx_t * ctx)
+{
+	track_branches(&ctx->profile, &ctx->result.branches);
+}
+
+/**
+ * Fit a straight line to the binary plane with the Hough transform.
+ * Only done when requested in the context, as it is only needed while
+ * looking for the line.
+ */
+static void stage_hough(pipeline_ctx_t * ctx)
+{
+	hough_params_t params;
+
+	if (!ctx->fit_line || conf.n_threshold_bands < 2)
+	{
+		return;
+	}
+
+	if (ctx->hough_acc == NULL)
+	{
+		ctx->hough_acc = (uint16_t *) malloc(HOUGH_ACC_SIZE * sizeof(uint16_t));
+		if (ctx->hough_acc == NULL)
+		{
+			return;
+		}
+	}
+
+	params.angle_min = conf.hough_angle_min;
+	params.angle_max = conf.hough_angle_max;
+	params.sample = conf.hough_sample;
+	params.min_votes = conf.hough_min_votes;
+	params.max_width = conf.edge_max_width;
+
+	hough_detect(ctx->bin, conf.threshold_bands[0],
+		conf.threshold_bands[conf.n_threshold_bands - 1], &params,
+		ctx->hough_acc, &ctx->hough_seed, &ctx->result.line);
+}
+
+/**
+ * Correct lens distortion of the points found by the stages before it:
+ * the two centroids, the branches of a fork and the fitted line.
+ */
+static void stage_undistort(pipeline_ctx_t * ctx)
+{
+	undistort_slice(&ctx->result.upper);
+	undistort_slice(&ctx->result.lower);
+	undistort_branches(&ctx->result.branches);
+	undistort_line(&ctx->result.line);
+}
+
+/**
+ * All known stages
+ */
+static const stage_def_t registry[] = {
+	{ "deinterleave", stage_deinterleave, STAGE_CAPTURE },
+	{ "lut", stage_lut, STAGE_CAPTURE },
+	{ "denoise", stage_denoise, STAGE_CAPTURE },
+	{ "threshold", stage_threshold, 0 },
+	{ "edge", stage_edge, 0 },
+	{ "centroid", stage_centroid, 0 },
+	{ "detect", stage_detect, 0 },
+	{ "erode", stage_erode, 0 },
+	{ "dilate", stage_dilate, 0 },
+	{ "open", stage_open, 0 },
+	{ "close", stage_close, 0 },
+	{ "blobs", stage_blobs, 0 },
+	{ "com", stage_com, 0 },
+	{ "runs", stage_runs, 0 },
+	{ "classify", stage_classify, 0 },
+	{ "branches", stage_branches, 0 },
+	{ "hough", stage_hough, 0 },
+	{ "undistort", stage_undistort, 0 },
+	{ NULL, NULL, 0 }
+};
+
+static const stage_def_t * find_stage(const char * name)
+{
+	const stage_def_t * def;
+
+	for (def = registry; def->name != NULL; def++)
+	{
+		if (strcmp(def->name, name) == 0)
+		{
+			return def;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Allocate the image planes of the given context.
+ */
+int pipeline_ctx_init(pipeline_ctx_t * ctx)
+{
+	memset(ctx, 0, sizeof(pipeline_ctx_t));
+
+	ctx->gray = (unsigned char *) malloc(IMG_SIZE);
+	ctx->bin = (unsigned char *) malloc(IMG_SIZE);
+	ctx->packed = (uint64_t *) malloc(MORPH_SIZE * sizeof(uint64_t));
+	ctx->scratch = (uint64_t *) malloc(MORPH_SIZE * sizeof(uint64_t));
+	if (posix_memalign((void **) &ctx->history, 16, 
+		IMG_SIZE * sizeof(int16_t)) != 0)
+	{
+		ctx->history = NULL;
+	}
+	if (ctx->gray == NULL || ctx->bin == NULL || ctx->packed == NULL ||
+		ctx->scratch == NULL || ctx->history == NULL)
+	{
+		return -1;
+	}
+
+	memset(ctx->gray, FLOOR, IMG_SIZE);
+	memset(ctx->bin, FLOOR, IMG_SIZE);
+	ctx->out = ctx->gray;
+	ctx->analyze = 1;
+	ctx->hough_seed = HOUGH_SEED;
+	return 0;
+}
+
+/**
+ * (Re)build the pipeline from the list of stage names given by the
+ * configuration option `option`. The current pipeline is kept if the list
+ * contains an unknown stage.
+ *
+ * \param p The pipeline
+ * \param option Name of the string list in the configuration file
+ * \return Number of stages or -1 on error
+ */
+int pipeline_configure(pipeline_t * p, const char * option)
+{
+	stage_t stages[PIPELINE_MAX_STAGES];
+	const stage_def_t * def;
+	const char * name;
+	int i, n;
+
+	n = config_get_list_size(option);
+	if (n > PIPELINE_MAX_STAGES)
+	{
+		printf("[pipeline] Too many stages in '%s' (max %d)\n", option,
+			PIPELINE_MAX_STAGES);
+		return -1;
+	}
+
+	memset(stages, 0, sizeof(stages));
+	for (i = 0; i < n; i++)
+	{
+		name = config_get_nstr(option, i);
+		def = find_stage(name);
+		if (def == NULL)
+		{
+			printf("[pipeline] Unknown stage '%s' in '%s'\n", name, option);
+			return -1;
+		}
+		stages[i].name = def->name;
+		stages[i].fn = def->fn;
+		stages[i].flags = def->flags;
+	}
+
+	memcpy(p->stages, stages, sizeof(stages));
+	p->n_stages = n;
+	p->last_us = 0;
+
+	// Fuse the lookup table into the deinterleaving, unless it is
+	// explicitly placed somewhere else in the pipeline
+	p->fuse_lut = 1;
+	for (i = 0; i < n; i++)
+	{
+		if (p->stages[i].fn == stage_lut)
+		{
+			p->fuse_lut = 0;
+		}
+	}
+
+	printf("[pipeline] %s:", option);
+	for (i = 0; i < n; i++)
+	{
+		printf(" %s", p->stages[i].name);
+	}
+	printf("\n");
+
+	return n;
+}
+
+/**
+ * Run all stages of the pipeline on the frame in the context.
+ * When the context is not marked for analysis, only capture
+ * stages are run.
+ */
+void pipeline_run(pipeline_t * p, pipeline_ctx_t * ctx)
+{
+	int i;
+	long long start, now, begin;
+	stage_t * s;
+
+	memset(&ctx->result, 0, sizeof(vision_result_t));
+	ctx->fuse_lut = p->fuse_lut;
+	begin = start = timer_now_us();
+
+	for (i = 0; i < p->n_stages; i++)
+	{
+		s = &p->stages[i];
+		if (!ctx->analyze && !(s->flags & STAGE_CAPTURE))
+		{
+			continue;
+		}
+
+		s->fn(ctx);
+
+		now = timer_now_us();
+		s->last_us = now - start;
+		s->total_us += s->last_us;
+		if (s->last_us > s->max_us)
+		{
+			s->max_us = s->last_us;
+		}
+		s->runs++;
+		start = now;
+	}
+
+	p->last_us = start - begin;
+}
+
+/**
+ * Check if the frame in the context differs from the last processed frame.
+ * The luminance is sampled on a sparse grid (every `step` pixel in both
+ * directions) and compared to the signature of the last processed frame
+ * using the mean absolute difference. The stored signature is only
+ * replaced when a change is detected, so slow drift is also caught.
+ *
+ * \param ctx Context with the new (raw) frame
+ * \param step Grid spacing in pixels (at least 4)
+ * \param tolerance Largest mean absolute difference (in gray levels)
+ * considered unchanged
+ * \return 1 if the frame changed and should be processed, 0 if not
+ */
+int pipeline_frame_changed(pipeline_ctx_t * ctx, int step, int tolerance)
+{
+	unsigned char sig[SIGNATURE_MAX];
+	int x, y, n = 0, d, sad = 0;
+
+	if (step < 4)
+	{
+		step = 4;
+	}
+
+	for (y = step / 2; y < HEIGHT; y += step)
+	{
+		for (x = step / 2; x < WIDTH; x += step)
+		{
+			// Luminance of the pixel in the YUYV frame
+			sig[n] = ctx->frame[INDEX2(x, y) * 2];
+			d = sig[n] - ctx->signature[n];
+			sad += d < 0 ? -d : d;
+			n++;
+		}
+	}
+
+	if (n == ctx->signature_len && ctx->analyze == ctx->signature_analyze &&
+		sad <= tolerance * n)
+	{
+		ctx->skipped++;
+		return 0;
+	}
+
+	memcpy(ctx->signature, sig, n);
+	ctx->signature_len = n;
+	ctx->signature_analyze = ctx->analyze;
+	return 1;
+}
+
+void pipeline_reset_stats(pipeline_t * p)
+{
+	int i;
+	for (i = 0; i < p->n_stages; i++)
+	{
+		p->stages[i].runs = 0;
+		p->stages[i].last_us = 0;
+		p->stages[i].total_us = 0;
+		p->stages[i].max_us = 0;
+	}
+}
+
+/**
+ * Print the timing of each stage (in microseconds).
+ */
+void pipeline_print_stats(pipeline_t * p)
+{
+	int i;
+	stage_t * s;
+
+	printf("%-16s %10s %8s %8s %8s\n", "stage", "runs", "last", "avg", "max");
+	for (i = 0; i < p->n_stages; i++)
+	{
+		s = &p->stages[i];
+		printf("%-16s %10lu %8lld %8lld %8lld\n", s->name, s->runs, s->last_us,
+			s->runs > 0 ? s->total_us / (long long) s->runs : 0, s->max_us);
+	}
+	printf("Total (last frame): %lld us\n", p->last_us);
+}
+
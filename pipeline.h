@@ -0,0 +1,121 @@
+
+#ifndef _PIPELINE_H_
+#define _PIPELINE_H_
+
+#include <stdint.h>
+#include "common.h"
+#include "image.h"
+#include "track.h"
+#include "hough.h"
+#include "blob.h"
+
+#define PIPELINE_MAX_STAGES		16
+
+/**
+ * Maximum number of samples in a frame signature
+ */
+#define SIGNATURE_MAX			(IMG_SIZE / 16)
+
+/**
+ * Stage flags. Capture stages always run, also when the frame
+ * is not analyzed (calibration mode).
+ */
+#define STAGE_CAPTURE			0x01
+
+/**
+ * Result of processing a single frame
+ */
+typedef struct vision_result {
+	slice_t upper, lower;
+	int mass;
+	track_event_t event;
+	track_branches_t branches;
+	hough_line_t line;
+	// Largest region of line pixels and the number of regions
+	blob_t blob;
+	int n_blobs;
+} vision_result_t;
+
+/**
+ * Per-frame context passed through the stages. The image planes are
+ * allocated once by `pipeline_ctx_init` and reused for every frame.
+ */
+typedef struct pipeline_ctx {
+	// Raw frame from the camera (YUYV)
+	const unsigned char * frame;
+	int length;
+
+	// Luminance plane
+	unsigned char * gray;
+	// Binary (thresholded) plane
+	unsigned char * bin;
+	// Bit-packed binary image and scratch space for morphology
+	uint64_t * packed;
+	uint64_t * scratch;
+	// History of the temporal noise filter (16-byte aligned)
+	int16_t * history;
+	int history_valid;
+	// Line runs of every row of the binary plane
+	track_profile_t profile;
+	// Darkness weighted sums of every row (the `centroid` stage)
+	row_moments_t rows[HEIGHT];
+	// Hough accumulator (allocated when first used) and the state of its
+	// random sampling
+	uint16_t * hough_acc;
+	uint32_t hough_seed;
+	// Working memory of the `blobs` stage (allocated when first used)
+	blob_work_t * blob_work;
+
+	// Sparse signature of the last processed frame
+	unsigned char signature[SIGNATURE_MAX];
+	int signature_len, signature_analyze;
+	unsigned long skipped;
+	// The plane written by the last image stage
+	unsigned char * out;
+
+	// Set to zero to only run capture stages
+	int analyze;
+	// Set to run the (optional) line fitting stage
+	int fit_line;
+
+	// Reduced quality settings of the detector stages: threshold all
+	// bands as one, skip the rows above `roi_start`, and only process
+	// every `row_step` row
+	int single_band, roi_start, row_step;
+
+	// Apply the contrast lookup table while deinterleaving
+	int fuse_lut;
+
+	vision_result_t result;
+} pipeline_ctx_t;
+
+typedef void (*stage_fn_t)(pipeline_ctx_t *);
+
+/**
+ * A stage in the pipeline, including its timing statistics.
+ */
+typedef struct stage {
+	const char * name;
+	stage_fn_t fn;
+	int flags;
+
+	unsigned long runs;
+	long long last_us, total_us, max_us;
+} stage_t;
+
+typedef struct pipeline {
+	stage_t stages[PIPELINE_MAX_STAGES];
+	int n_stages;
+	int fuse_lut;
+	long long last_us;
+} pipeline_t;
+
+int pipeline_ctx_init(pipeline_ctx_t * ctx);
+int pipeline_configure(pipeline_t * p, const char * option);
+void pipeline_run(pipeline_t * p, pipeline_ctx_t * ctx);
+int pipeline_frame_changed(pipeline_ctx_t * ctx, int step, int tolerance);
+void pipeline_reset_stats(pipeline_t * p);
+void pipeline_print_stats(pipeline_t * p);
+
+#endif
+
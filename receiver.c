@@ -0,0 +1,192 @@
+#include "receiver.h"
+#include "encoding.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+/**
+ * Start receiving from a connected socket
+ *
+ * \return 0 on success, -1 if out of memory
+ */
+int receiver_init(receiver_t * rx, int fd)
+{
+	memset(rx, 0, sizeof(receiver_t));
+	rx->fd = fd;
+	rx->chunk = RECEIVER_SIZE;
+	rx->buffer = (unsigned char *) malloc(RECEIVER_SIZE);
+	return rx->buffer != NULL ? 0 : -1;
+}
+
+void receiver_free(receiver_t * rx)
+{
+	free(rx->buffer);
+	rx->buffer = NULL;
+}
+
+/**
+ * Make sure that at least `need` bytes are available in the receive 
+ * buffer, reading as much as the socket has available.
+ *
+ * Returns 0 on success, -1 if the connection was closed or failed.
+ */
+static int fill(receiver_t * rx, unsigned int need)
+{
+	unsigned int room;
+	int n;
+
+	while (rx->end - rx->start < need)
+	{
+		// Move the unparsed data to the front of the buffer
+		if (rx->start > 0)
+		{
+			memmove(rx->buffer, rx->buffer + rx->start, rx->end - rx->start);
+			rx->end -= rx->start;
+			rx->start = 0;
+		}
+
+		room = RECEIVER_SIZE - rx->end;
+		n = recv(rx->fd, rx->buffer + rx->end, 
+			room < rx->chunk ? room : rx->chunk, 0);
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n <= 0)
+		{
+			return -1;
+		}
+		rx->end += n;
+	}
+
+	return 0;
+}
+
+/**
+ * Read the next packet from the socket: a frame, or the response to a 
+ * command (header->magic is TELEMETRY_RESPONSE_MAGIC, and the payload is 
+ * the telemetry_response_t). The header is copied to `header`,
+ * the known part of the field block to `fields` (the rest is zeroed), and
+ * `payload` points at the payload in the receive buffer. The payload is 
+ * valid until the next call.
+ *
+ * If the stream doesn't start with a packet header, the data is skipped
+ * until one is found.
+ *
+ * Returns the size of the payload, or -1 if the connection was lost.
+ */
+int receiver_read(receiver_t * rx, telemetry_header_t * header, 
+	telemetry_fields_t * fields, unsigned char ** payload)
+{
+	unsigned int fields_size, payload_size;
+
+	while (1)
+	{
+		if (fill(rx, sizeof(telemetry_header_t)) < 0)
+		{
+			return -1;
+		}
+		memcpy(header, rx->buffer + rx->start, sizeof(telemetry_header_t));
+
+		if ((header->magic == TELEMETRY_MAGIC 
+			|| header->magic == TELEMETRY_RESPONSE_MAGIC)
+			&& header->version >= TELEMETRY_VERSION
+			&& header->length >= sizeof(telemetry_header_t) + header->fields_size 
+			&& header->length <= TELEMETRY_MAX_LENGTH)
+		{
+			break;
+		}
+
+		// Not a packet header, try the next byte
+		rx->start++;
+		rx->skipped++;
+	}
+
+	if (fill(rx, header->length) < 0)
+	{
+		return -1;
+	}
+
+	fields_size = header->fields_size;
+	payload_size = header->length - sizeof(telemetry_header_t) - fields_size;
+
+	// Fields unknown to this reader are skipped, missing fields are zero
+	memset(fields, 0, sizeof(telemetry_fields_t));
+	memcpy(fields, rx->buffer + rx->start + sizeof(telemetry_header_t), 
+		fields_size < sizeof(telemetry_fields_t) ? fields_size 
+		: sizeof(telemetry_fields_t));
+
+	*payload = rx->buffer + rx->start + sizeof(telemetry_header_t) + fields_size;
+	rx->start += header->length;
+
+	return payload_size;
+}
+
+/**
+ * Subscribe to the frames, the region and the encoding to be sent
+ */
+int receiver_subscribe(int fd, const telemetry_subscription_t * sub)
+{
+	struct {
+		telemetry_request_t header;
+		telemetry_subscription_t sub;
+	} __attribute__ ((packed)) request;
+
+	request.header.magic = TELEMETRY_REQUEST_MAGIC;
+	request.header.type = TELEMETRY_REQ_SUBSCRIBE;
+	request.header.length = sizeof(request);
+	request.sub = *sub;
+
+	return send(fd, &request, sizeof(request), 0) == sizeof(request) ? 0 : -1;
+}
+
+/**
+ * Send a remote control command
+ */
+int receiver_command(int fd, const telemetry_command_t * command)
+{
+	struct {
+		telemetry_request_t header;
+		telemetry_command_t command;
+	} __attribute__ ((packed)) request;
+
+	request.header.magic = TELEMETRY_REQUEST_MAGIC;
+	request.header.type = TELEMETRY_REQ_COMMAND;
+	request.header.length = sizeof(request);
+	request.command = *command;
+
+	return send(fd, &request, sizeof(request), 0) == sizeof(request) ? 0 : -1;
+}
+
+/**
+ * Decode the payload into an image of fields->width x fields->height 
+ * pixels. A delta is applied to the image already there (the previous 
+ * image of the region).
+ *
+ * Returns 0 on success, -1 if the image can't be decoded.
+ */
+int receiver_decode(const telemetry_fields_t * fields, 
+	const unsigned char * payload, int size, unsigned char * image)
+{
+	int pixels = fields->width * fields->height;
+
+	switch (fields->encoding)
+	{
+		case TELEMETRY_RAW:
+			if (size != pixels)
+			{
+				return -1;
+			}
+			memcpy(image, payload, pixels);
+			return 0;
+		case TELEMETRY_BITS:
+			return decode_bits(payload, size, image, pixels);
+		case TELEMETRY_RLE:
+			return decode_rle(payload, size, image, pixels);
+		case TELEMETRY_DELTA:
+			return decode_delta(payload, size, image, pixels);
+	}
+	return -1;
+}
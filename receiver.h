@@ -0,0 +1,37 @@
+
+#ifndef _RECEIVER_H_
+#define _RECEIVER_H_
+
+#include "telemetry.h"
+
+/**
+ * Client side of the broadcast stream (see telemetry.h), shared by the 
+ * viewer and the benchmark client.
+ */
+
+/**
+ * Room for two packets of data received from the socket
+ */
+#define RECEIVER_SIZE			(2 * TELEMETRY_MAX_LENGTH)
+
+typedef struct receiver {
+	int fd;
+	// Data received from the socket, not yet parsed (start to end)
+	unsigned char * buffer;
+	unsigned int start, end;
+	// Largest read from the socket at a time
+	unsigned int chunk;
+	// Bytes skipped to find a packet header
+	unsigned long skipped;
+} receiver_t;
+
+int receiver_init(receiver_t * rx, int fd);
+void receiver_free(receiver_t * rx);
+int receiver_read(receiver_t * rx, telemetry_header_t * header, 
+	telemetry_fields_t * fields, unsigned char ** payload);
+int receiver_subscribe(int fd, const telemetry_subscription_t * sub);
+int receiver_command(int fd, const telemetry_command_t * command);
+int receiver_decode(const telemetry_fields_t * fields, 
+	const unsigned char * payload, int size, unsigned char * image);
+
+#endif
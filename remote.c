@@ -0,0 +1,208 @@
+
+#include "remote.h"
+#include "timer.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+/**
+ * Commands waiting for the next frame. More than this in one frame time
+ * are answered TELEMETRY_ERR_BUSY.
+ */
+#define MAILBOX_SIZE		16
+
+/**
+ * Responses waiting to be sent, enough for two dumps of all fields
+ */
+#define REPLIES_SIZE		256
+
+/**
+ * Each ring is written only at `head` by its producer and read only at
+ * `tail` by its consumer. The indexes only grow (modulo 2^32), so the
+ * ring is full when head - tail is its size.
+ */
+static remote_command_t mailbox[MAILBOX_SIZE];
+static unsigned int mailbox_head, mailbox_tail;
+
+static remote_reply_t replies[REPLIES_SIZE];
+static unsigned int replies_head, replies_tail;
+
+static int event_fd = -1;
+
+/**
+ * Responses still to come for the commands handed over (server thread).
+ * A command is only handed over when the ring has room for all of its
+ * responses, so the vision thread never finds it full.
+ */
+static int reserved;
+
+/**
+ * Responses to a TELEMETRY_CMD_DUMP, one per field
+ */
+static int dump_replies = 1;
+
+/**
+ * Responses added since the server was last woken up (vision thread)
+ */
+static int pending;
+
+/**
+ * Statistics, kept by the vision thread
+ */
+static unsigned long applied, dropped;
+static long long wait_total, wait_max;
+
+int remote_init()
+{
+	event_fd = eventfd(0, EFD_NONBLOCK);
+	return event_fd < 0 ? -1 : 0;
+}
+
+/**
+ * File descriptor that becomes readable when there are responses to send
+ */
+int remote_fd()
+{
+	return event_fd;
+}
+
+/**
+ * Set the number of responses to a dump (call before starting the server)
+ */
+void remote_set_dump_size(int fields)
+{
+	dump_replies = fields;
+}
+
+/**
+ * Number of responses the vision thread sends for a command
+ */
+int remote_replies(const telemetry_command_t * command)
+{
+	return command->op == TELEMETRY_CMD_DUMP ? dump_replies : 1;
+}
+
+/**
+ * Hand a command to the vision thread
+ *
+ * \return 0 on success, -1 if the mailbox is full or there is no room
+ * 		for the responses to the command
+ */
+int remote_submit(const remote_command_t * command)
+{
+	unsigned int head = mailbox_head;
+	int n = remote_replies(&command->command);
+
+	if (head - __atomic_load_n(&mailbox_tail, __ATOMIC_ACQUIRE) == MAILBOX_SIZE
+		|| reserved + n > REPLIES_SIZE)
+	{
+		return -1;
+	}
+	reserved += n;
+	mailbox[head % MAILBOX_SIZE] = *command;
+	__atomic_store_n(&mailbox_head, head + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/**
+ * Take the next command waiting
+ *
+ * \return 1 if a command was taken, 0 if there is none
+ */
+int remote_take(remote_command_t * command)
+{
+	unsigned int tail = mailbox_tail;
+
+	if (tail == __atomic_load_n(&mailbox_head, __ATOMIC_ACQUIRE))
+	{
+		return 0;
+	}
+	*command = mailbox[tail % MAILBOX_SIZE];
+	__atomic_store_n(&mailbox_tail, tail + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/**
+ * Answer a command. The id, op and wait time of the response are filled
+ * in from the command. The server is woken up by remote_flush.
+ */
+void remote_reply(const remote_command_t * command, 
+	telemetry_response_t * response)
+{
+	unsigned int head = replies_head;
+	long long wait = timer_now_us() - command->received_us;
+
+	response->id = command->command.id;
+	response->op = command->command.op;
+	response->wait_us = (uint32_t) wait;
+
+	if (response->remaining == 0)
+	{
+		applied++;
+		wait_total += wait;
+		if (wait > wait_max)
+		{
+			wait_max = wait;
+		}
+	}
+
+	if (head - __atomic_load_n(&replies_tail, __ATOMIC_ACQUIRE) == REPLIES_SIZE)
+	{
+		dropped++;
+		return;
+	}
+	replies[head % REPLIES_SIZE].response = *response;
+	replies[head % REPLIES_SIZE].client = command->client;
+	replies[head % REPLIES_SIZE].generation = command->generation;
+	__atomic_store_n(&replies_head, head + 1, __ATOMIC_RELEASE);
+	pending = 1;
+}
+
+/**
+ * Wake up the server if there are new responses
+ */
+void remote_flush()
+{
+	uint64_t one = 1;
+
+	if (pending)
+	{
+		pending = 0;
+		if (write(event_fd, &one, sizeof(one)) < 0)
+		{
+			perror("[remote] write()");
+		}
+	}
+}
+
+/**
+ * Take the next response to send
+ *
+ * \return 1 if a response was taken, 0 if there is none
+ */
+int remote_next_reply(remote_reply_t * reply)
+{
+	unsigned int tail = replies_tail;
+
+	if (tail == __atomic_load_n(&replies_head, __ATOMIC_ACQUIRE))
+	{
+		return 0;
+	}
+	*reply = replies[tail % REPLIES_SIZE];
+	__atomic_store_n(&replies_tail, tail + 1, __ATOMIC_RELEASE);
+	reserved--;
+	return 1;
+}
+
+/**
+ * Print how many commands were applied and how long they waited for a
+ * frame
+ */
+void remote_print_stats()
+{
+	printf("%lu command(s) applied, waited avg %lld us, max %lld us for a "
+		"frame, %lu response(s) dropped\n", applied, 
+		applied ? wait_total / (long long) applied : 0, wait_max, dropped);
+}
@@ -0,0 +1,50 @@
+
+#ifndef _REMOTE_H_
+#define _REMOTE_H_
+
+#include "telemetry.h"
+
+/**
+ * Remote control: hands the commands received by the broadcast server to
+ * the vision thread, and the responses back.
+ *
+ * Both directions are single producer, single consumer rings, so neither
+ * thread ever waits for the other. The vision thread takes the commands
+ * at the start of each frame (remote_take), applies them, and answers
+ * each one (remote_reply). The server thread is woken up through
+ * remote_fd when there are responses to send. A command is only handed
+ * over when there is room for all of its responses (remote_replies).
+ */
+typedef struct remote_command {
+	telemetry_command_t command;
+	// Client that sent the command
+	int client;
+	unsigned int generation;
+	// When the command was received (microseconds, monotonic clock)
+	long long received_us;
+} remote_command_t;
+
+typedef struct remote_reply {
+	telemetry_response_t response;
+	int client;
+	unsigned int generation;
+} remote_reply_t;
+
+int remote_init();
+int remote_fd();
+void remote_set_dump_size(int fields);
+int remote_replies(const telemetry_command_t * command);
+
+// Server thread
+int remote_submit(const remote_command_t * command);
+int remote_next_reply(remote_reply_t * reply);
+
+// Vision thread
+int remote_take(remote_command_t * command);
+void remote_reply(const remote_command_t * command, 
+	telemetry_response_t * response);
+void remote_flush();
+
+void remote_print_stats();
+
+#endif
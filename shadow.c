@@ -0,0 +1,352 @@
+
+#define _GNU_SOURCE
+
+#include "common.h"
+#include "shadow.h"
+#include "timer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+/**
+ * The shadow pipeline runs a candidate detector on the gray planes of the
+ * production pipeline, in its own thread (preferably on its own core).
+ *
+ * The production pipeline alternates between two gray planes. A plane
+ * handed to the shadow thread is not written until the shadow is done
+ * with it, as production always writes to the plane the shadow is not
+ * holding. Frames arriving while the shadow is busy are not shadowed,
+ * so the production thread never waits for it.
+ */
+
+/**
+ * A frame handed to the shadow thread
+ */
+typedef struct shadow_job {
+	int plane;
+	int fit_line;
+	unsigned long frame;
+	long long production_us;
+	vision_result_t result;
+} shadow_job_t;
+
+static unsigned char * planes[2];
+
+/**
+ * Plane held by the shadow thread (-1 if none). Only set by the
+ * production thread, and only cleared by the shadow thread.
+ */
+static int held = -1;
+
+static pipeline_t pipeline;
+static pipeline_ctx_t ctx;
+static int enabled = 0;
+
+static pthread_t thread;
+static pthread_mutex_t job_mutex;
+static pthread_cond_t job_cv;
+static shadow_job_t job;
+static int job_pending = 0;
+
+/**
+ * Held while the shadow pipeline runs, so it can be reconfigured
+ * between two frames
+ */
+static pthread_mutex_t run_mutex;
+
+/**
+ * Statistics since the last print
+ */
+static pthread_mutex_t stats_mutex;
+static unsigned long n_frames, n_disagree, n_missed;
+static long long production_total_us, shadow_total_us;
+static long long production_max_us, shadow_max_us;
+static long long dx_total;
+static int tolerance;
+// Set when the shadow pipeline classifies track features
+static int compare_events;
+
+static FILE * log_fp = NULL;
+
+/**
+ * Compare the results of a frame. The detectors disagree if only one of
+ * them sees the line in the lower slice, if the lower centroids are more
+ * than `tolerance` pixels apart, or if the classified features differ
+ * (when the shadow pipeline classifies them).
+ *
+ * \return Horizontal distance of the lower centroids, or -1 if they
+ * disagree on whether there is a line at all
+ */
+static int compare(const vision_result_t * a, const vision_result_t * b,
+	int * disagree)
+{
+	int dx;
+
+	if ((a->lower.mass > 0) != (b->lower.mass > 0))
+	{
+		*disagree = 1;
+		return -1;
+	}
+
+	dx = abs(a->lower.x - b->lower.x);
+	*disagree = dx > tolerance || 
+		(compare_events && a->event.type != b->event.type);
+	return dx;
+}
+
+static void * shadow_thread_fn(void * arg)
+{
+	shadow_job_t j;
+	long long us;
+	int dx, disagree;
+
+	while (1)
+	{
+		pthread_mutex_lock(&job_mutex);
+		while (!job_pending)
+		{
+			pthread_cond_wait(&job_cv, &job_mutex);
+		}
+		j = job;
+		job_pending = 0;
+		pthread_mutex_unlock(&job_mutex);
+
+		pthread_mutex_lock(&run_mutex);
+		ctx.gray = planes[j.plane];
+		ctx.out = ctx.gray;
+		ctx.analyze = 1;
+		ctx.fit_line = j.fit_line;
+		pipeline_run(&pipeline, &ctx);
+		us = pipeline.last_us;
+		dx = compare(&j.result, &ctx.result, &disagree);
+		pthread_mutex_unlock(&run_mutex);
+
+		// Release the plane
+		__atomic_store_n(&held, -1, __ATOMIC_RELEASE);
+
+		pthread_mutex_lock(&stats_mutex);
+		n_frames++;
+		n_disagree += disagree;
+		if (dx >= 0)
+		{
+			dx_total += dx;
+		}
+		production_total_us += j.production_us;
+		shadow_total_us += us;
+		if (j.production_us > production_max_us)
+		{
+			production_max_us = j.production_us;
+		}
+		if (us > shadow_max_us)
+		{
+			shadow_max_us = us;
+		}
+		if (log_fp != NULL)
+		{
+			fprintf(log_fp, "%lu %lld %lld %d %d %d %d %d %d %d\n", j.frame,
+				j.production_us, us, j.result.lower.x, j.result.lower.mass,
+				ctx.result.lower.x, ctx.result.lower.mass, dx,
+				j.result.event.type, ctx.result.event.type);
+		}
+		pthread_mutex_unlock(&stats_mutex);
+	}
+
+	return NULL;
+}
+
+/**
+ * Allocate the second gray plane and start the (idle) shadow thread.
+ *
+ * \param production Context of the production pipeline
+ */
+int shadow_init(pipeline_ctx_t * production)
+{
+	if (pipeline_ctx_init(&ctx) < 0)
+	{
+		return -1;
+	}
+
+	// The shadow reads the gray planes of the production pipeline
+	free(ctx.gray);
+	ctx.gray = NULL;
+
+	planes[0] = production->gray;
+	planes[1] = (unsigned char *) malloc(IMG_SIZE);
+	if (planes[1] == NULL)
+	{
+		return -1;
+	}
+	memcpy(planes[1], planes[0], IMG_SIZE);
+
+	pthread_mutex_init(&job_mutex, NULL);
+	pthread_mutex_init(&run_mutex, NULL);
+	pthread_mutex_init(&stats_mutex, NULL);
+	pthread_cond_init(&job_cv, NULL);
+
+	return pthread_create(&thread, NULL, shadow_thread_fn, NULL) == 0 ? 0 : -1;
+}
+
+/**
+ * (Re)configure the shadow pipeline from the configuration option
+ * `option`. An empty list disables shadowing. Stages that modify the
+ * gray plane (capture stages) are not allowed, as the plane is shared
+ * with the production pipeline.
+ *
+ * \param option Name of the stage list in the configuration file
+ * \param cpu Core to run the shadow thread on (-1 for any)
+ * \param tol Largest distance of the lower centroids (pixels) that
+ * counts as agreement
+ * \param log_file File the per-frame comparison is appended to, or NULL
+ */
+void shadow_configure(const char * option, int cpu, int tol,
+	const char * log_file)
+{
+	cpu_set_t set;
+	int i, n;
+
+	pthread_mutex_lock(&run_mutex);
+
+	n = pipeline_configure(&pipeline, option);
+	compare_events = 0;
+	for (i = 0; i < pipeline.n_stages; i++)
+	{
+		if (strcmp(pipeline.stages[i].name, "classify") == 0)
+		{
+			compare_events = 1;
+		}
+		if (pipeline.stages[i].flags & STAGE_CAPTURE)
+		{
+			printf("[shadow] Stage '%s' modifies the shared gray plane, "
+				"shadowing disabled\n", pipeline.stages[i].name);
+			n = -1;
+		}
+	}
+	__atomic_store_n(&enabled, n > 0, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&run_mutex);
+
+	if (cpu >= 0)
+	{
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (pthread_setaffinity_np(thread, sizeof(set), &set) != 0)
+		{
+			printf("[shadow] Unable to run on cpu %d\n", cpu);
+		}
+	}
+
+	pthread_mutex_lock(&stats_mutex);
+	tolerance = tol;
+	if (log_fp != NULL)
+	{
+		fclose(log_fp);
+		log_fp = NULL;
+	}
+	if (n > 0 && log_file != NULL && log_file[0] != '\0')
+	{
+		log_fp = fopen(log_file, "a");
+		if (log_fp == NULL)
+		{
+			printf("[shadow] Unable to open %s\n", log_file);
+		}
+		else
+		{
+			fprintf(log_fp, "# frame production_us shadow_us "
+				"production_x production_mass shadow_x shadow_mass dx "
+				"production_event shadow_event\n");
+		}
+	}
+	pthread_mutex_unlock(&stats_mutex);
+}
+
+int shadow_enabled()
+{
+	return __atomic_load_n(&enabled, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Point the production context at the gray plane that is not held by
+ * the shadow thread. Called before running the production pipeline.
+ */
+void shadow_select_plane(pipeline_ctx_t * production)
+{
+	int h = __atomic_load_n(&held, __ATOMIC_ACQUIRE);
+
+	if (h >= 0 && production->gray == planes[h])
+	{
+		production->gray = planes[1 - h];
+	}
+}
+
+/**
+ * Hand the frame just processed by the production pipeline to the shadow
+ * thread. The frame is dropped if the shadow is still busy.
+ *
+ * \param production Context of the production pipeline
+ * \param production_us Time spent in the production pipeline
+ * \param frame Frame number
+ */
+void shadow_submit(const pipeline_ctx_t * production, long long production_us,
+	unsigned long frame)
+{
+	int plane = production->gray == planes[0] ? 0 : 1;
+
+	if (!shadow_enabled())
+	{
+		return;
+	}
+
+	if (__atomic_load_n(&held, __ATOMIC_ACQUIRE) >= 0 ||
+		pthread_mutex_trylock(&job_mutex) != 0)
+	{
+		__atomic_add_fetch(&n_missed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	__atomic_store_n(&held, plane, __ATOMIC_RELEASE);
+	job.plane = plane;
+	job.fit_line = production->fit_line;
+	job.frame = frame;
+	job.production_us = production_us;
+	job.result = production->result;
+	job_pending = 1;
+	pthread_cond_signal(&job_cv);
+	pthread_mutex_unlock(&job_mutex);
+}
+
+/**
+ * Print (and reset) the comparison of the two pipelines.
+ */
+void shadow_print_stats()
+{
+	pthread_mutex_lock(&stats_mutex);
+
+	printf("Shadowed frames: %lu (not shadowed, shadow busy: %lu)\n",
+		n_frames, __atomic_load_n(&n_missed, __ATOMIC_RELAXED));
+	if (n_frames > 0)
+	{
+		printf("Disagreements: %lu (%.1f %%), avg lower dx: %.1f px\n",
+			n_disagree, 100.0 * n_disagree / n_frames,
+			(double) dx_total / n_frames);
+		printf("Production: avg %lld us, max %lld us\n",
+			production_total_us / (long long) n_frames, production_max_us);
+		printf("Shadow:     avg %lld us, max %lld us\n",
+			shadow_total_us / (long long) n_frames, shadow_max_us);
+	}
+	if (log_fp != NULL)
+	{
+		fflush(log_fp);
+	}
+
+	n_frames = n_disagree = 0;
+	__atomic_store_n(&n_missed, 0, __ATOMIC_RELAXED);
+	production_total_us = shadow_total_us = 0;
+	production_max_us = shadow_max_us = 0;
+	dx_total = 0;
+
+	pthread_mutex_unlock(&stats_mutex);
+}
+
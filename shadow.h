@@ -0,0 +1,17 @@
+
+#ifndef _SHADOW_H_
+#define _SHADOW_H_
+
+#include "pipeline.h"
+
+int shadow_init(pipeline_ctx_t * production);
+void shadow_configure(const char * option, int cpu, int tolerance,
+	const char * log_file);
+int shadow_enabled();
+void shadow_select_plane(pipeline_ctx_t * production);
+void shadow_submit(const pipeline_ctx_t * production, long long production_us,
+	unsigned long frame);
+void shadow_print_stats();
+
+#endif
+
@@ -0,0 +1,197 @@
+
+#include "shmring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/**
+ * Client side of the frame ring (see shmring.h). Link it into tools that
+ * read frames from a running eyecam.
+ */
+
+struct shm_client {
+	shm_header_t * header;
+	const shm_slot_t * slots;
+	size_t size;
+};
+
+/**
+ * Map the ring read-only
+ *
+ * \param name Name of the ring (e.g. SHM_RING_NAME)
+ * \return The client, or NULL if there is no ring (yet)
+ */
+shm_client_t * shm_attach(const char * name)
+{
+	shm_client_t * client;
+	struct stat st;
+	void * mem;
+	int fd;
+
+	// Write access is only needed to wait on the head (futex) and to
+	// count the waiters
+	fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0)
+	{
+		return NULL;
+	}
+
+	if (fstat(fd, &st) < 0 || st.st_size < SHM_SLOTS_OFFSET)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	mem = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED)
+	{
+		return NULL;
+	}
+
+	client = (shm_client_t *) calloc(1, sizeof(shm_client_t));
+	if (client == NULL)
+	{
+		munmap(mem, st.st_size);
+		return NULL;
+	}
+	client->header = (shm_header_t *) mem;
+	client->slots = (const shm_slot_t *) ((char *) mem + SHM_SLOTS_OFFSET);
+	client->size = st.st_size;
+
+	if (__atomic_load_n(&client->header->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC
+		|| client->header->version != SHM_VERSION
+		|| client->header->slot_size != sizeof(shm_slot_t)
+		|| SHM_RING_SIZE(client->header->n_slots) > client->size)
+	{
+		shm_detach(client);
+		errno = EINVAL;
+		return NULL;
+	}
+	return client;
+}
+
+void shm_detach(shm_client_t * client)
+{
+	munmap(client->header, client->size);
+	free(client);
+}
+
+/**
+ * Take the slot of the given frame. Returns -1 if it is being written.
+ */
+static int take(shm_client_t * client, uint32_t n, shm_frame_t * frame)
+{
+	const shm_slot_t * slot = &client->slots[n % client->header->n_slots];
+	uint32_t lock = __atomic_load_n(&slot->lock, __ATOMIC_ACQUIRE);
+
+	if ((lock & 1) || slot->frame != n)
+	{
+		return -1;
+	}
+
+	frame->slot = slot;
+	frame->lock = lock;
+	frame->frame = n;
+	return 0;
+}
+
+/**
+ * Get the most recent frame
+ *
+ * \return 0 on success, -1 if no frame has been published yet
+ */
+int shm_latest(shm_client_t * client, shm_frame_t * frame)
+{
+	uint32_t head;
+
+	do
+	{
+		head = __atomic_load_n(&client->header->head, __ATOMIC_ACQUIRE);
+		if (head == 0)
+		{
+			return -1;
+		}
+	}
+	while (take(client, head - 1, frame) < 0);
+
+	frame->missed = 0;
+	return 0;
+}
+
+/**
+ * Get the frame after the given one, waiting for it if needed. If the
+ * reader has fallen behind so far that the frame was overwritten, the
+ * most recent frame is returned, and frame->missed tells how many were
+ * skipped.
+ *
+ * \param client The client
+ * \param frame The previous frame, replaced by the next one
+ * \param timeout_ms How long to wait (-1: forever)
+ * \return 0 on success, -1 on timeout
+ */
+int shm_wait_next(shm_client_t * client, shm_frame_t * frame, int timeout_ms)
+{
+	shm_header_t * h = client->header;
+	struct timespec ts, * pts = NULL;
+	uint32_t next = frame->frame + 1, head;
+
+	if (timeout_ms >= 0)
+	{
+		ts.tv_sec = timeout_ms / 1000;
+		ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+		pts = &ts;
+	}
+
+	while (1)
+	{
+		head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+
+		if ((int32_t) (head - next) > 0)
+		{
+			// Keep a slot of margin to the one being written
+			if (head - next < h->n_slots && take(client, next, frame) == 0)
+			{
+				frame->missed = 0;
+				return 0;
+			}
+			if (shm_latest(client, frame) == 0)
+			{
+				frame->missed = frame->frame - next;
+				return 0;
+			}
+		}
+
+		// Counted before FUTEX_WAIT checks the head (see shm_ring_publish)
+		__atomic_add_fetch(&h->waiters, 1, __ATOMIC_SEQ_CST);
+		if (syscall(SYS_futex, &h->head, FUTEX_WAIT, head, pts, NULL, 0) < 0
+			&& errno == ETIMEDOUT)
+		{
+			__atomic_sub_fetch(&h->waiters, 1, __ATOMIC_ACQ_REL);
+			return -1;
+		}
+		__atomic_sub_fetch(&h->waiters, 1, __ATOMIC_ACQ_REL);
+	}
+}
+
+/**
+ * Check that the frame wasn't overwritten while it was read. Call it
+ * after reading from frame->slot.
+ *
+ * \return 1 if what was read is consistent, 0 if it must be discarded
+ */
+int shm_frame_valid(const shm_frame_t * frame)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&frame->slot->lock, __ATOMIC_RELAXED) == frame->lock;
+}
+
@@ -0,0 +1,137 @@
+
+#include "shmring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+struct shm_ring {
+	char name[64];
+	shm_header_t * header;
+	shm_slot_t * slots;
+	size_t size;
+};
+
+/**
+ * Create (or recreate) the ring in shared memory
+ *
+ * \param name Name of the shared memory object (e.g. SHM_RING_NAME)
+ * \param n_slots Number of frames kept
+ * \return The ring, or NULL on failure
+ */
+shm_ring_t * shm_ring_create(const char * name, int n_slots)
+{
+	shm_ring_t * ring;
+	void * mem;
+	int fd;
+
+	ring = (shm_ring_t *) calloc(1, sizeof(shm_ring_t));
+	if (ring == NULL)
+	{
+		return NULL;
+	}
+	strncpy(ring->name, name, sizeof(ring->name) - 1);
+	ring->size = SHM_RING_SIZE(n_slots);
+
+	// Start from scratch, so attached readers of an old ring don't see
+	// the new one change size under them
+	shm_unlink(name);
+	fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+	if (fd < 0)
+	{
+		perror("[shmring] shm_open()");
+		free(ring);
+		return NULL;
+	}
+
+	if (ftruncate(fd, ring->size) < 0)
+	{
+		perror("[shmring] ftruncate()");
+		close(fd);
+		free(ring);
+		return NULL;
+	}
+
+	mem = mmap(NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED)
+	{
+		perror("[shmring] mmap()");
+		free(ring);
+		return NULL;
+	}
+
+	ring->header = (shm_header_t *) mem;
+	ring->slots = (shm_slot_t *) ((char *) mem + SHM_SLOTS_OFFSET);
+
+	ring->header->version = SHM_VERSION;
+	ring->header->n_slots = n_slots;
+	ring->header->slot_size = sizeof(shm_slot_t);
+	ring->header->width = 320;
+	ring->header->height = 240;
+	ring->header->head = 0;
+	// Readers check the magic last
+	__atomic_store_n(&ring->header->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+
+	printf("[shmring] Keeping the last %d frames in %s (%lu kB)\n", n_slots,
+		name, (unsigned long) ring->size / 1024);
+	return ring;
+}
+
+/**
+ * Write a frame to the next slot and wake up the waiting readers. The
+ * images may be NULL, leaving them out.
+ */
+void shm_ring_publish(shm_ring_t * ring, uint64_t timestamp_us,
+	const shm_result_t * result, const unsigned char * gray,
+	const unsigned char * bin)
+{
+	shm_header_t * h = ring->header;
+	uint32_t head = h->head;
+	shm_slot_t * slot = &ring->slots[head % h->n_slots];
+
+	// Odd: being written
+	__atomic_store_n(&slot->lock, slot->lock + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	slot->frame = head;
+	slot->timestamp_us = timestamp_us;
+	slot->result = *result;
+	if (gray != NULL)
+	{
+		memcpy(slot->gray, gray, sizeof(slot->gray));
+	}
+	if (bin != NULL)
+	{
+		memcpy(slot->bin, bin, sizeof(slot->bin));
+	}
+
+	// Even: complete
+	__atomic_store_n(&slot->lock, slot->lock + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&h->head, head + 1, __ATOMIC_RELEASE);
+
+	// The head must be visible before the waiters are counted: a reader
+	// counts itself before checking the head (in FUTEX_WAIT), so either
+	// it sees the new head or we see it waiting. Release/acquire alone
+	// lets the load pass the store.
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&h->waiters, __ATOMIC_RELAXED) > 0)
+	{
+		syscall(SYS_futex, &h->head, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+	}
+}
+
+void shm_ring_close(shm_ring_t * ring)
+{
+	munmap(ring->header, ring->size);
+	shm_unlink(ring->name);
+	free(ring);
+}
+
@@ -0,0 +1,104 @@
+
+#ifndef _SHMRING_H_
+#define _SHMRING_H_
+
+#include <stdint.h>
+
+/**
+ * Ring of the last frames and their results in POSIX shared memory, for
+ * processes on the robot (recorders, experimental detectors, a local
+ * viewer). Readers map the ring and read the frames in place, without
+ * any copy or help from the control process.
+ *
+ * Each slot is protected by a sequence lock: its sequence number is odd
+ * while the slot is written. A reader remembers the sequence number,
+ * reads the slot, and checks that it is unchanged (shm_frame_valid)
+ * before trusting what it read.
+ */
+#define SHM_RING_NAME			"/eyebot"
+#define SHM_MAGIC				0x53425945		// "EYBS"
+#define SHM_VERSION				1
+
+/**
+ * Result of the frame, as in vision_result_t
+ */
+typedef struct shm_result {
+	int32_t l_x, l_y, u_x, u_y;
+	int32_t error_lower, error_upper;
+	// Sub-pixel errors (SLICE_SHIFT fraction bits)
+	int32_t errorq_lower, errorq_upper;
+	int32_t mass;
+	// Classified track feature (track_type_t)
+	int32_t event;
+	// Fitted line, if any (see hough.h)
+	int32_t line_angle, line_offset, line_votes;
+} shm_result_t;
+
+typedef struct shm_slot {
+	// Sequence lock, odd while the slot is written
+	uint32_t lock;
+	// Number of the frame (counted from 0 when the ring was created)
+	uint32_t frame;
+	// Capture time (microseconds, monotonic clock)
+	uint64_t timestamp_us;
+	shm_result_t result;
+	// Gray image and the binary image of the line
+	unsigned char gray[320 * 240];
+	unsigned char bin[320 * 240];
+} shm_slot_t;
+
+typedef struct shm_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t n_slots;
+	uint32_t slot_size;
+	uint32_t width, height;
+	// Frames published so far; also the futex readers wait on
+	uint32_t head;
+	// Number of readers waiting for a frame
+	uint32_t waiters;
+} shm_header_t;
+
+/**
+ * Offset of the first slot from the start of the mapping
+ */
+#define SHM_SLOTS_OFFSET		4096
+
+#define SHM_RING_SIZE(n)		(SHM_SLOTS_OFFSET + (n) * sizeof(shm_slot_t))
+
+/**
+ * Writer, in the control process
+ */
+typedef struct shm_ring shm_ring_t;
+
+shm_ring_t * shm_ring_create(const char * name, int n_slots);
+void shm_ring_publish(shm_ring_t * ring, uint64_t timestamp_us,
+	const shm_result_t * result, const unsigned char * gray,
+	const unsigned char * bin);
+void shm_ring_close(shm_ring_t * ring);
+
+/**
+ * Client library (shmclient.c)
+ */
+typedef struct shm_client shm_client_t;
+
+/**
+ * A frame read in place. `slot` is only valid as long as
+ * shm_frame_valid() says so.
+ */
+typedef struct shm_frame {
+	const shm_slot_t * slot;
+	uint32_t lock;
+	uint32_t frame;
+	// Frames skipped since the previous frame (shm_wait_next)
+	uint32_t missed;
+} shm_frame_t;
+
+shm_client_t * shm_attach(const char * name);
+int shm_latest(shm_client_t * client, shm_frame_t * frame);
+int shm_wait_next(shm_client_t * client, shm_frame_t * frame, int timeout_ms);
+int shm_frame_valid(const shm_frame_t * frame);
+void shm_detach(shm_client_t * client);
+
+#endif
+
@@ -0,0 +1,129 @@
+/**
+ * Follow the frames of a running eyecam through the shared memory ring.
+ *
+ * Usage: shmview [-n frames] [-d file.pgm]
+ *
+ * Prints the result of each frame and how long after capture it was
+ * read, and a summary at the end. With -d the gray image of the last
+ * frame is written to a PGM file. The ring is enabled with shm_slots in
+ * eyebot.conf.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shmring.h"
+#include "timer.h"
+
+static int dump_pgm(const char * file, const unsigned char * gray)
+{
+	FILE * fp;
+
+	fp = fopen(file, "wb");
+	if (fp == NULL)
+	{
+		perror(file);
+		return -1;
+	}
+	fprintf(fp, "P5\n320 240\n255\n");
+	fwrite(gray, 1, 320 * 240, fp);
+	fclose(fp);
+	return 0;
+}
+
+int main(int argc, char ** argv)
+{
+	static unsigned char gray[320 * 240];
+	const char * dump = NULL;
+	shm_client_t * client;
+	shm_frame_t frame;
+	shm_result_t result;
+	long long latency, total = 0, max = 0;
+	unsigned long n = 0, frames = 100, missed = 0, torn = 0;
+	int i;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+		{
+			frames = strtoul(argv[++i], NULL, 10);
+		}
+		else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+		{
+			dump = argv[++i];
+		}
+		else
+		{
+			fprintf(stderr, "Usage: %s [-n frames] [-d file.pgm]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	client = shm_attach(SHM_RING_NAME);
+	if (client == NULL)
+	{
+		fprintf(stderr, "No frame ring (is eyecam running with shm_slots?)\n");
+		return 1;
+	}
+
+	if (shm_latest(client, &frame) < 0 && shm_wait_next(client, &frame, 5000) < 0)
+	{
+		fprintf(stderr, "No frames\n");
+		return 1;
+	}
+
+	while (n < frames)
+	{
+		if (shm_wait_next(client, &frame, 5000) < 0)
+		{
+			fprintf(stderr, "Timed out waiting for a frame\n");
+			break;
+		}
+		latency = timer_now_us() - frame.slot->timestamp_us;
+
+		// Read in place, then make sure the slot wasn't overwritten
+		result = frame.slot->result;
+		if (dump != NULL)
+		{
+			memcpy(gray, frame.slot->gray, sizeof(gray));
+		}
+		if (!shm_frame_valid(&frame))
+		{
+			torn++;
+			continue;
+		}
+
+		printf("frame %u: lower (%d, %d), upper (%d, %d), mass %d, "
+			"%lld us after capture", frame.frame, result.l_x, result.l_y,
+			result.u_x, result.u_y, result.mass, latency);
+		if (frame.missed)
+		{
+			printf(", %u missed", frame.missed);
+		}
+		printf("\n");
+
+		n++;
+		missed += frame.missed;
+		total += latency;
+		if (latency > max)
+		{
+			max = latency;
+		}
+	}
+
+	if (n > 0)
+	{
+		printf("%lu frames, %lu missed, %lu overwritten while read, "
+			"latency avg %lld us, max %lld us\n", n, missed, torn,
+			total / n, max);
+	}
+	if (dump != NULL && n > 0)
+	{
+		dump_pgm(dump, gray);
+	}
+
+	shm_detach(client);
+	return 0;
+}
+
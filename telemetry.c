@@ -0,0 +1,84 @@
+
+#include "telemetry.h"
+
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/**
+ * Complete the header of the packet: magic, version and sizes. The caller
+ * fills in the fields and the sequence number and timestamp of the 
+ * header.
+ *
+ * \param packet Header and fields
+ * \param payload_size Size of the payload in bytes
+ */
+void telemetry_prepare(telemetry_packet_t * packet, uint32_t payload_size)
+{
+	packet->header.magic = TELEMETRY_MAGIC;
+	packet->header.version = TELEMETRY_VERSION;
+	packet->header.fields_size = sizeof(telemetry_fields_t);
+	packet->header.length = sizeof(telemetry_packet_t) + payload_size;
+}
+
+/**
+ * Send (the rest of) a prepared packet, starting `offset` bytes into the
+ * packet. Header and payload are sent with a single sendmsg() call, the
+ * payload straight from the given buffer.
+ *
+ * On a non-blocking socket only part of the packet may be sent; call 
+ * again with the offset advanced by the returned count.
+ *
+ * \param fd Connected socket
+ * \param packet Prepared header and fields
+ * \param payload Payload (packet->header.length - header size bytes)
+ * \param offset Bytes of the packet already sent
+ * \param flags Flags for sendmsg() (MSG_NOSIGNAL is always added)
+ * \return Number of bytes sent, or -1 on error (see errno)
+ */
+ssize_t telemetry_send_from(int fd, const telemetry_packet_t * packet,
+	const unsigned char * payload, uint32_t offset, int flags)
+{
+	struct iovec iov[2];
+	struct msghdr msg = { 0 };
+	uint32_t payload_size = packet->header.length - sizeof(telemetry_packet_t);
+	ssize_t sent;
+	int n = 0;
+
+	if (offset < sizeof(telemetry_packet_t))
+	{
+		iov[n].iov_base = (char *) packet + offset;
+		iov[n].iov_len = sizeof(telemetry_packet_t) - offset;
+		n++;
+		offset = 0;
+	}
+	else
+	{
+		offset -= sizeof(telemetry_packet_t);
+	}
+
+	if (offset < payload_size)
+	{
+		iov[n].iov_base = (void *) (payload + offset);
+		iov[n].iov_len = payload_size - offset;
+		n++;
+	}
+
+	if (n == 0)
+	{
+		return 0;
+	}
+
+	msg.msg_iov = iov;
+	msg.msg_iovlen = n;
+
+	do
+	{
+		sent = sendmsg(fd, &msg, flags | MSG_NOSIGNAL);
+	}
+	while (sent < 0 && errno == EINTR);
+
+	return sent;
+}
+
@@ -0,0 +1,247 @@
+
+#ifndef _TELEMETRY_H_
+#define _TELEMETRY_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Wire format of the packets sent by the broadcast server. This header
+ * is shared with the viewer.
+ *
+ * Every packet is a header, a field block and a payload:
+ *
+ *   telemetry_header_t   magic, version, sizes, sequence number, time
+ *   telemetry_fields_t   vision result (header.fields_size bytes)
+ *   payload              image (header.length - header_size -
+ *                        fields_size bytes)
+ *
+ * All values are little endian. Fields added in later versions are
+ * appended to the field block, so a reader skips what it doesn't know
+ * using fields_size.
+ *
+ * Version 2 appended the image position (x, y) to the field block, and
+ * gave the control block of datagrams its own size.
+ */
+#define TELEMETRY_MAGIC			0x54425945		// "EYBT"
+#define TELEMETRY_VERSION		2
+
+/**
+ * Payload encodings (see encoding.h)
+ */
+// One byte per pixel
+#define TELEMETRY_RAW			0
+// One bit per pixel, floor is 1
+#define TELEMETRY_BITS			1
+// Runs of (value, varint length)
+#define TELEMETRY_RLE			2
+// Run-length encoded XOR with the previous image sent to the client. The 
+// server sends RLE (a keyframe) instead when the client doesn't have the
+// previous image.
+#define TELEMETRY_DELTA			3
+#define TELEMETRY_ENCODINGS		4
+
+typedef struct telemetry_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t fields_size;
+	// Total length of the packet, including this header
+	uint32_t length;
+	// Number of the camera frame
+	uint32_t seq;
+	// Capture time (microseconds, monotonic clock of the robot)
+	uint64_t timestamp_us;
+} __attribute__ ((packed)) telemetry_header_t;
+
+typedef struct telemetry_fields {
+	int32_t l_x, l_y, u_x, u_y;
+	int32_t error_lower, error_upper;
+	int32_t mass;
+	// Size and encoding of the image in the payload (0 x 0 if there is
+	// no image)
+	uint16_t width, height;
+	uint16_t encoding;
+	uint16_t flags;
+	// Position of the image in the camera frame
+	uint16_t x, y;
+} __attribute__ ((packed)) telemetry_fields_t;
+
+/**
+ * A complete packet header, as sent in front of the payload
+ */
+typedef struct telemetry_packet {
+	telemetry_header_t header;
+	telemetry_fields_t fields;
+} __attribute__ ((packed)) telemetry_packet_t;
+
+/**
+ * Datagrams with the result of every frame, sent over UDP next to the
+ * image stream. A datagram is a header (with TELEMETRY_DATAGRAM_MAGIC),
+ * the fields of the vision result (without an image) and the state of 
+ * the controller:
+ *
+ *   telemetry_header_t   header.fields_size covers the field block only
+ *   telemetry_fields_t
+ *   telemetry_control_t  at header_size + fields_size, control.size bytes
+ *
+ * Both blocks can grow at their end independently.
+ */
+#define TELEMETRY_DATAGRAM_MAGIC	0x44425945		// "EYBD"
+
+typedef struct telemetry_control {
+	// Size of this block
+	uint16_t size;
+	uint16_t reserved;
+	// State of the robot (state_t in main.c)
+	int32_t state;
+	// Terms of the line PID controller, 0 in frames it didn't run
+	float p, i, d, correction;
+	int32_t speed_left, speed_right, speed_ref;
+	// Time spent on the frame (microseconds) and the quality level
+	int32_t frame_us;
+	int32_t quality;
+} __attribute__ ((packed)) telemetry_control_t;
+
+typedef struct telemetry_datagram {
+	telemetry_header_t header;
+	telemetry_fields_t fields;
+	telemetry_control_t control;
+} __attribute__ ((packed)) telemetry_datagram_t;
+
+/**
+ * Requests sent by a client to the server. A request is a header followed
+ * by (length - header size) bytes of data.
+ */
+#define TELEMETRY_REQUEST_MAGIC	0x51425945		// "EYBQ"
+
+// Select the encoding of the images (data: uint16_t encoding)
+#define TELEMETRY_REQ_ENCODING	1
+// Select what is sent, and how often (data: telemetry_subscription_t)
+#define TELEMETRY_REQ_SUBSCRIBE	2
+// Remote control (data: telemetry_command_t)
+#define TELEMETRY_REQ_COMMAND	3
+
+typedef struct telemetry_request {
+	uint32_t magic;
+	uint16_t type;
+	// Total length of the request, including this header
+	uint16_t length;
+} __attribute__ ((packed)) telemetry_request_t;
+
+/**
+ * Parts of a packet a client subscribes to. Without the result, the
+ * result fields are 0; without the image, the payload is empty.
+ */
+#define TELEMETRY_FIELD_RESULT	0x01
+#define TELEMETRY_FIELD_IMAGE	0x02
+
+/**
+ * A subscription. Clients that never subscribe get every third frame,
+ * whole and raw, with the result.
+ */
+typedef struct telemetry_subscription {
+	// Send the frames whose sequence number is a multiple of this
+	uint16_t divisor;
+	uint16_t encoding;
+	// TELEMETRY_FIELD_* flags
+	uint16_t fields;
+	// Region of the image to send (a width or height of 0 is the whole
+	// image)
+	uint16_t x, y, width, height;
+} __attribute__ ((packed)) telemetry_subscription_t;
+
+/**
+ * Remote control commands. Each command is applied by the vision thread
+ * at the start of the next frame, and answered with one response (or,
+ * for TELEMETRY_CMD_DUMP, one per configuration field).
+ */
+// Do nothing, only answer (measures the round trip)
+#define TELEMETRY_CMD_PING		0
+// Start the run with the current configuration (as "st", without the 
+// reload)
+#define TELEMETRY_CMD_START		1
+// Brake and wait (as "s")
+#define TELEMETRY_CMD_STOP		2
+// Go to state `value` (state_t in main.c)
+#define TELEMETRY_CMD_STATE		3
+// Get the configuration field `name`
+#define TELEMETRY_CMD_GET		4
+// Set the configuration field `name` to `value`
+#define TELEMETRY_CMD_SET		5
+// Get all configuration fields
+#define TELEMETRY_CMD_DUMP		6
+
+#define TELEMETRY_NAME_SIZE		32
+
+typedef struct telemetry_command {
+	// Chosen by the client, returned in the response
+	uint32_t id;
+	uint16_t op;
+	uint16_t reserved;
+	double value;
+	char name[TELEMETRY_NAME_SIZE];
+} __attribute__ ((packed)) telemetry_command_t;
+
+/**
+ * Responses to commands are sent between the packets of the stream, as a
+ * header (with TELEMETRY_RESPONSE_MAGIC and no field block) followed by a
+ * telemetry_response_t.
+ */
+#define TELEMETRY_RESPONSE_MAGIC	0x52425945		// "EYBR"
+
+// Status of a response
+#define TELEMETRY_OK			0
+// Unknown command
+#define TELEMETRY_ERR_COMMAND	1
+// Unknown field
+#define TELEMETRY_ERR_FIELD		2
+// The field is only used when the configuration is loaded
+#define TELEMETRY_ERR_LIVE		3
+// Value out of range
+#define TELEMETRY_ERR_VALUE		4
+// Too many commands or responses waiting, try again
+#define TELEMETRY_ERR_BUSY		5
+
+// Type of the value in a response
+#define TELEMETRY_VALUE_NONE	0
+#define TELEMETRY_VALUE_INT		1
+#define TELEMETRY_VALUE_FLOAT	2
+
+typedef struct telemetry_response {
+	uint32_t id;
+	uint16_t op;
+	uint16_t status;
+	// Frame the command was applied at, and how long it waited for that 
+	// frame (microseconds)
+	uint32_t frame;
+	uint32_t wait_us;
+	// State after the command
+	int32_t state;
+	uint16_t type;
+	// Responses still to come for the same command
+	uint16_t remaining;
+	double value;
+	char name[TELEMETRY_NAME_SIZE];
+} __attribute__ ((packed)) telemetry_response_t;
+
+typedef struct telemetry_reply {
+	telemetry_header_t header;
+	telemetry_response_t response;
+} __attribute__ ((packed)) telemetry_reply_t;
+
+/**
+ * Largest request accepted by the server
+ */
+#define TELEMETRY_MAX_REQUEST	256
+
+/**
+ * Largest packet accepted by a reader
+ */
+#define TELEMETRY_MAX_LENGTH	(sizeof(telemetry_packet_t) + 4 * 320 * 240)
+
+void telemetry_prepare(telemetry_packet_t * packet, uint32_t payload_size);
+ssize_t telemetry_send_from(int fd, const telemetry_packet_t * packet,
+	const unsigned char * payload, uint32_t offset, int flags);
+
+#endif
+
@@ -0,0 +1,18 @@
+
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+#include <time.h>
+
+/**
+ * Current value of the monotonic clock in microseconds.
+ */
+static inline long long timer_now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+#endif
+
@@ -0,0 +1,319 @@
+
+#include "track.h"
+
+#include <string.h>
+#include <stdint.h>
+
+#define ALL_FLOOR				0xFFFFFFFFFFFFFFFFULL
+
+/**
+ * Scale `n` out of `needed` to a confidence (two times `needed` 
+ * gives full confidence).
+ */
+static int confidence(int n, int needed)
+{
+	int c = needed > 0 ? (100 * n) / (2 * needed) : 100;
+	return c > 100 ? 100 : c;
+}
+
+static int min(int a, int b)
+{
+	return a < b ? a : b;
+}
+
+/**
+ * Record the runs of line pixels in every row of the binary image.
+ * Runs narrower than `min_width` pixels are treated as noise. Eight
+ * floor pixels are skipped at a time.
+ *
+ * \param bin Binary image (LINE/FLOOR)
+ * \param profile Where the row profiles are written
+ * \param min_width Minimum run width in pixels
+ */
+void track_profile(const unsigned char * bin, track_profile_t * profile,
+	int min_width)
+{
+	const unsigned char * row;
+	row_profile_t * rp;
+	uint64_t v;
+	int x, y, start;
+
+	for (y = 0; y < HEIGHT; y++)
+	{
+		row = bin + INDEX(y);
+		rp = &profile->rows[y];
+		rp->n_runs = rp->width = 0;
+		rp->left = WIDTH;
+		rp->right = -1;
+
+		x = 0;
+		while (x < WIDTH)
+		{
+			if ((x & 7) == 0 && x + 8 <= WIDTH)
+			{
+				memcpy(&v, row + x, 8);
+				if (v == ALL_FLOOR)
+				{
+					x += 8;
+					continue;
+				}
+			}
+
+			if (row[x] != LINE)
+			{
+				x++;
+				continue;
+			}
+
+			start = x;
+			while (x < WIDTH && row[x] == LINE)
+			{
+				x++;
+			}
+
+			if (x - start < min_width)
+			{
+				continue;
+			}
+
+			if (rp->n_runs < TRACK_MAX_RUNS)
+			{
+				rp->runs[rp->n_runs].start = start;
+				rp->runs[rp->n_runs].end = x - 1;
+				rp->width += x - start;
+			}
+			rp->n_runs++;
+
+			if (start < rp->left) rp->left = start;
+			rp->right = x - 1;
+		}
+	}
+}
+
+/**
+ * Classify the track feature seen in a frame from its row profiles.
+ *
+ * - A band of at least `wide_rows` rows that are `wide_width` wide is a
+ *   horizontal line. If the line continues both above and below the band,
+ *   it is a crossing.
+ * - At least `fork_rows` consecutive rows with two separate runs is a
+ *   fork.
+ * - A line that does not reach higher than `end_rows` rows from the top
+ *   of the image has ended.
+ *
+ * \param profile Row profiles of the frame
+ * \param params Classifier limits
+ * \param event The classified feature
+ */
+void track_classify(const track_profile_t * profile, 
+	const track_params_t * params, track_event_t * event)
+{
+	const row_profile_t * rp;
+	int y, top = -1, line_rows = 0;
+	int band = 0, band_len = 0, band_top = 0, band_bottom = 0;
+	int fork = 0, fork_len = 0;
+	int above = 0, below = 0;
+
+	for (y = 0; y < HEIGHT; y++)
+	{
+		rp = &profile->rows[y];
+		if (rp->n_runs == 0)
+		{
+			band = fork = 0;
+			continue;
+		}
+
+		line_rows++;
+		if (top < 0)
+		{
+			top = y;
+		}
+
+		// Longest band of wide rows
+		if (rp->n_runs == 1 && rp->width >= params->wide_width)
+		{
+			if (++band > band_len)
+			{
+				band_len = band;
+				band_bottom = y;
+				band_top = y - band + 1;
+			}
+		}
+		else
+		{
+			band = 0;
+		}
+
+		// Longest stretch of rows with two or more runs
+		if (rp->n_runs >= 2)
+		{
+			if (++fork > fork_len)
+			{
+				fork_len = fork;
+			}
+		}
+		else
+		{
+			fork = 0;
+		}
+	}
+
+	if (line_rows == 0)
+	{
+		event->type = TRACK_NONE;
+		event->confidence = 100;
+		return;
+	}
+
+	if (band_len >= params->wide_rows)
+	{
+		// Narrow line rows above and below the band
+		for (y = 0; y < HEIGHT; y++)
+		{
+			rp = &profile->rows[y];
+			if (rp->n_runs >= 1 && rp->width < params->wide_width)
+			{
+				if (y < band_top) above++;
+				if (y > band_bottom) below++;
+			}
+		}
+
+		if (above >= params->end_rows && below >= params->end_rows)
+		{
+			event->type = TRACK_CROSSING;
+			event->confidence = min(confidence(band_len, params->wide_rows),
+				confidence(min(above, below), params->end_rows));
+		}
+		else
+		{
+			event->type = TRACK_HORIZONTAL_LINE;
+			event->confidence = confidence(band_len, params->wide_rows);
+		}
+	}
+	else if (fork_len >= params->fork_rows)
+	{
+		event->type = TRACK_FORK;
+		event->confidence = confidence(fork_len, params->fork_rows);
+	}
+	else if (top >= params->end_rows)
+	{
+		event->type = TRACK_END;
+		event->confidence = confidence(top, params->end_rows);
+	}
+	else
+	{
+		event->type = TRACK_LINE;
+		event->confidence = 100;
+	}
+}
+
+/**
+ * Index of the run in the row whose center is closest to `x`
+ */
+static int closest_run(const row_profile_t * rp, int x, int skip)
+{
+	int i, n, c, d, best = -1, best_d = WIDTH * 2;
+
+	n = rp->n_runs < TRACK_MAX_RUNS ? rp->n_runs : TRACK_MAX_RUNS;
+	for (i = 0; i < n; i++)
+	{
+		if (i == skip)
+		{
+			continue;
+		}
+		c = (rp->runs[i].start + rp->runs[i].end) / 2;
+		d = c > x ? c - x : x - c;
+		if (d < best_d)
+		{
+			best_d = d;
+			best = i;
+		}
+	}
+	return best;
+}
+
+/**
+ * Track the two branches of a fork from the bottom of the image (closest
+ * to the robot) and up. The first row with two runs starts the branches
+ * at its leftmost and rightmost run. In the following rows, each branch
+ * continues with the run closest to its position in the previous row.
+ * The branch centroids are weighted by run width.
+ *
+ * \param profile Row profiles of the frame
+ * \param branches The two branches (`rows` is zero if no fork was found)
+ */
+void track_branches(const track_profile_t * profile, 
+	track_branches_t * branches)
+{
+	const row_profile_t * rp;
+	const run_t * run;
+	int y, n, l, r, w, left = -1, right = -1;
+	long lx = 0, ly = 0, rx = 0, ry = 0;
+
+	memset(branches, 0, sizeof(track_branches_t));
+
+	for (y = HEIGHT - 1; y >= 0; y--)
+	{
+		rp = &profile->rows[y];
+		n = rp->n_runs < TRACK_MAX_RUNS ? rp->n_runs : TRACK_MAX_RUNS;
+		if (n < 2)
+		{
+			continue;
+		}
+
+		if (left < 0)
+		{
+			// The line splits: start at the outermost runs
+			l = 0;
+			r = n - 1;
+		}
+		else
+		{
+			l = closest_run(rp, left, -1);
+			r = closest_run(rp, right, l);
+			if (r < l)
+			{
+				w = l; l = r; r = w;
+			}
+		}
+
+		run = &rp->runs[l];
+		w = run->end - run->start + 1;
+		left = (run->start + run->end) / 2;
+		lx += (long) left * w;
+		ly += (long) y * w;
+		branches->left_mass += w;
+
+		run = &rp->runs[r];
+		w = run->end - run->start + 1;
+		right = (run->start + run->end) / 2;
+		rx += (long) right * w;
+		ry += (long) y * w;
+		branches->right_mass += w;
+
+		branches->rows++;
+	}
+
+	if (branches->rows > 0)
+	{
+		branches->left_x = lx / branches->left_mass;
+		branches->left_y = ly / branches->left_mass;
+		branches->right_x = rx / branches->right_mass;
+		branches->right_y = ry / branches->right_mass;
+	}
+}
+
+const char * track_type_name(track_type_t type)
+{
+	switch (type)
+	{
+		case TRACK_NONE: return "none";
+		case TRACK_LINE: return "line";
+		case TRACK_HORIZONTAL_LINE: return "horizontal";
+		case TRACK_CROSSING: return "crossing";
+		case TRACK_FORK: return "fork";
+		case TRACK_END: return "end";
+	}
+	return "?";
+}
+
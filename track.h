@@ -0,0 +1,92 @@
+
+#ifndef _TRACK_H_
+#define _TRACK_H_
+
+#include "common.h"
+
+/**
+ * Maximum number of line runs recorded per row
+ */
+#define TRACK_MAX_RUNS			4
+
+/**
+ * Features of the track seen in a single frame
+ */
+typedef enum {
+	TRACK_NONE,
+	TRACK_LINE,
+	TRACK_HORIZONTAL_LINE,
+	TRACK_CROSSING,
+	TRACK_FORK,
+	TRACK_END
+} track_type_t;
+
+/**
+ * A horizontal run of line pixels (columns `start` to `end`, inclusive)
+ */
+typedef struct run {
+	short start, end;
+} run_t;
+
+/**
+ * Line runs of a single row.
+ */
+typedef struct row_profile {
+	// Number of runs (the first TRACK_MAX_RUNS are recorded)
+	short n_runs;
+	// Total number of line pixels in the recorded runs
+	short width;
+	// Horizontal extent of the line
+	short left, right;
+	run_t runs[TRACK_MAX_RUNS];
+} row_profile_t;
+
+typedef struct track_profile {
+	row_profile_t rows[HEIGHT];
+} track_profile_t;
+
+/**
+ * Classifier limits (in pixels / rows)
+ */
+typedef struct track_params {
+	// Rows at least this wide belong to a horizontal line
+	int wide_width;
+	// Consecutive wide rows needed for a horizontal line
+	int wide_rows;
+	// Consecutive rows with two or more runs needed for a fork
+	int fork_rows;
+	// Empty rows needed above the line to call it the end of the line,
+	// and narrow rows needed on both sides of a horizontal line to call
+	// it a crossing
+	int end_rows;
+} track_params_t;
+
+/**
+ * A classified feature and how confident the classifier is
+ * (0 - 100 percent).
+ */
+typedef struct track_event {
+	track_type_t type;
+	int confidence;
+} track_event_t;
+
+/**
+ * The two branches of a fork. Each branch is given as the centroid of
+ * its runs over the rows where the line is split.
+ */
+typedef struct track_branches {
+	int rows;
+	int left_x, left_y, left_mass;
+	int right_x, right_y, right_mass;
+} track_branches_t;
+
+void track_profile(const unsigned char * bin, track_profile_t * profile,
+	int min_width);
+void track_classify(const track_profile_t * profile, 
+	const track_params_t * params, track_event_t * event);
+void track_branches(const track_profile_t * profile, 
+	track_branches_t * branches);
+const char * track_type_name(track_type_t type);
+
+#endif
+
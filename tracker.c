@@ -0,0 +1,121 @@
+
+#include "tracker.h"
+
+#include <string.h>
+
+/**
+ * Measurements further apart than this (in microseconds) restart the
+ * filter instead of estimating rates over the gap.
+ */
+#define TRACKER_MAX_GAP			500000LL
+
+void tracker_init(tracker_t * tr, float alpha, float beta)
+{
+	memset(tr, 0, sizeof(tracker_t));
+	pthread_mutex_init(&tr->lock, NULL);
+	tr->alpha = alpha;
+	tr->beta = beta;
+}
+
+void tracker_set_gains(tracker_t * tr, float alpha, float beta)
+{
+	pthread_mutex_lock(&tr->lock);
+	tr->alpha = alpha;
+	tr->beta = beta;
+	pthread_mutex_unlock(&tr->lock);
+}
+
+/**
+ * Forget the estimate, e.g. when the line has been lost for a while.
+ */
+void tracker_reset(tracker_t * tr)
+{
+	pthread_mutex_lock(&tr->lock);
+	memset(&tr->state, 0, sizeof(tracker_state_t));
+	tr->valid = 0;
+	pthread_mutex_unlock(&tr->lock);
+}
+
+/**
+ * Correct one value and its rate with a new measurement, given the time
+ * since the last measurement in seconds.
+ */
+static inline void correct(float * x, float * rate, float z, float dt,
+	float alpha, float beta)
+{
+	float predicted = *x + *rate * dt;
+	float residual = z - predicted;
+
+	*x = predicted + alpha * residual;
+	*rate += beta * residual / dt;
+}
+
+/**
+ * Update the estimate with the line position measured in a frame.
+ *
+ * \param tr The tracker
+ * \param offset Error of the lower slice (pixels)
+ * \param heading Upper minus lower slice error (pixels)
+ * \param t_us Time the frame was captured
+ */
+void tracker_update(tracker_t * tr, float offset, float heading,
+	long long t_us)
+{
+	float dt;
+
+	pthread_mutex_lock(&tr->lock);
+
+	dt = (t_us - tr->t_us) / 1e6f;
+	if (!tr->valid || t_us - tr->t_us > TRACKER_MAX_GAP || dt <= 0)
+	{
+		tr->state.offset = offset;
+		tr->state.heading = heading;
+		tr->state.offset_rate = tr->state.heading_rate = 0;
+		tr->valid = 1;
+	}
+	else
+	{
+		correct(&tr->state.offset, &tr->state.offset_rate, offset, dt,
+			tr->alpha, tr->beta);
+		correct(&tr->state.heading, &tr->state.heading_rate, heading, dt,
+			tr->alpha, tr->beta);
+	}
+	tr->t_us = t_us;
+
+	pthread_mutex_unlock(&tr->lock);
+}
+
+/**
+ * Predict the line position at the given time.
+ *
+ * \param tr The tracker
+ * \param t_us Time of the prediction
+ * \param state The predicted state
+ * \return Age of the last measurement in microseconds, or -1 if there is
+ * no estimate
+ */
+long long tracker_predict(tracker_t * tr, long long t_us,
+	tracker_state_t * state)
+{
+	long long age;
+	float dt;
+
+	pthread_mutex_lock(&tr->lock);
+
+	if (!tr->valid)
+	{
+		pthread_mutex_unlock(&tr->lock);
+		return -1;
+	}
+
+	age = t_us - tr->t_us;
+	dt = age / 1e6f;
+
+	*state = tr->state;
+	state->offset += state->offset_rate * dt;
+	state->heading += state->heading_rate * dt;
+
+	pthread_mutex_unlock(&tr->lock);
+	return age;
+}
+
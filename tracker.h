@@ -0,0 +1,40 @@
+
+#ifndef _TRACKER_H_
+#define _TRACKER_H_
+
+#include <pthread.h>
+
+/**
+ * Estimated position of the line relative to the robot. The offset is
+ * the error of the lower slice, and the heading the horizontal distance
+ * from the lower to the upper slice (both in pixels). Rates are in pixels
+ * per second.
+ */
+typedef struct tracker_state {
+	float offset, offset_rate;
+	float heading, heading_rate;
+} tracker_state_t;
+
+/**
+ * Alpha-beta filter over the line position. Updated with every usable
+ * frame, and can be queried from any thread at any time.
+ */
+typedef struct tracker {
+	pthread_mutex_t lock;
+	float alpha, beta;
+	tracker_state_t state;
+	// Time of the last measurement (microseconds, monotonic clock)
+	long long t_us;
+	int valid;
+} tracker_t;
+
+void tracker_init(tracker_t * tr, float alpha, float beta);
+void tracker_set_gains(tracker_t * tr, float alpha, float beta);
+void tracker_reset(tracker_t * tr);
+void tracker_update(tracker_t * tr, float offset, float heading,
+	long long t_us);
+long long tracker_predict(tracker_t * tr, long long t_us,
+	tracker_state_t * state);
+
+#endif
+
@@ -0,0 +1,304 @@
+
+#include "common.h"
+#include "undistort.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Number of fixed-point iterations used when inverting the
+ * distortion model.
+ */
+#define INVERT_ITERATIONS		8
+
+/**
+ * Correction table. For every pixel in the (distorted) camera image,
+ * the undistorted position in the same pixel space, stored as fixed-point
+ * numbers with UNDISTORT_SHIFT fractional bits. The x and y coordinates
+ * are interleaved.
+ */
+static short * table = NULL;
+
+/**
+ * The model the table was built from
+ */
+static cam_model_t current;
+
+/**
+ * Flag indicating if the correction should be applied at all
+ */
+static int enabled = 0;
+
+/**
+ * Invert the distortion model for a single pixel, using the
+ * iterative approach also found in OpenCV's `undistortPoints`.
+ *
+ * \param m The camera model
+ * \param u Distorted pixel column
+ * \param v Distorted pixel row
+ * \param ux Pointer to where the undistorted column is written
+ * \param uy Pointer to where the undistorted row is written
+ */
+static void invert_model(const cam_model_t * m, float u, float v,
+	float * ux, float * uy)
+{
+	float xd, yd, x, y, r2, radial, dx, dy;
+	int i;
+
+	xd = x = (u - m->cx) / m->fx;
+	yd = y = (v - m->cy) / m->fy;
+
+	for (i = 0; i < INVERT_ITERATIONS; i++)
+	{
+		r2 = x*x + y*y;
+		radial = 1 + r2 * (m->k1 + r2 * (m->k2 + r2 * m->k3));
+		dx = 2*m->p1*x*y + m->p2*(r2 + 2*x*x);
+		dy = m->p1*(r2 + 2*y*y) + 2*m->p2*x*y;
+
+		x = (xd - dx) / radial;
+		y = (yd - dy) / radial;
+	}
+
+	*ux = x * m->fx + m->cx;
+	*uy = y * m->fy + m->cy;
+}
+
+/**
+ * Build the per-pixel correction table from the given model.
+ */
+static void build_table(const cam_model_t * m)
+{
+	int x, y, i = 0;
+	float ux, uy;
+
+	for (y = 0; y < HEIGHT; y++)
+	{
+		for (x = 0; x < WIDTH; x++)
+		{
+			invert_model(m, x, y, &ux, &uy);
+			table[i++] = (short) (ux * UNDISTORT_ONE + 0.5f);
+			table[i++] = (short) (uy * UNDISTORT_ONE + 0.5f);
+		}
+	}
+}
+
+/**
+ * Update the camera model. The correction table is only rebuilt
+ * when the model actually changed since the last call, so it is
+ * cheap to call this every time the configuration is reloaded.
+ *
+ * \param model Camera intrinsics and distortion coefficients
+ * \param enable Non-zero to enable the correction
+ * \return 1 if the table was rebuilt, 0 if not and -1 on error
+ */
+int undistort_update(const cam_model_t * model, int enable)
+{
+	enabled = 0;
+
+	if (!enable)
+	{
+		return 0;
+	}
+
+	if (model->fx <= 0 || model->fy <= 0)
+	{
+		printf("[undistort] Invalid focal length, correction disabled\n");
+		return -1;
+	}
+
+	if (table == NULL)
+	{
+		table = (short *) malloc(IMG_SIZE * 2 * sizeof(short));
+		if (table == NULL)
+		{
+			return -1;
+		}
+	}
+	else if (memcmp(model, &current, sizeof(cam_model_t)) == 0)
+	{
+		enabled = 1;
+		return 0;
+	}
+
+	current = *model;
+	build_table(&current);
+	enabled = 1;
+
+	printf("[undistort] Correction table built (f: %.1f/%.1f, k: %.4f %.4f %.4f)\n",
+		current.fx, current.fy, current.k1, current.k2, current.k3);
+	return 1;
+}
+
+/**
+ * Return non-zero if the correction is enabled.
+ */
+int undistort_enabled()
+{
+	return enabled;
+}
+
+/**
+ * Look up the undistorted position of the pixel at (x,y).
+ * The result is given as fixed-point numbers (UNDISTORT_SHIFT fractional
+ * bits). Coordinates outside the image are clamped to the border.
+ *
+ * \param x Pixel column in the camera image
+ * \param y Pixel row in the camera image
+ * \param ux Undistorted column (fixed-point)
+ * \param uy Undistorted row (fixed-point)
+ */
+void undistort_point(int x, int y, int * ux, int * uy)
+{
+	int i;
+
+	if (!enabled)
+	{
+		*ux = x << UNDISTORT_SHIFT;
+		*uy = y << UNDISTORT_SHIFT;
+		return;
+	}
+
+	if (x < 0) x = 0;
+	if (x >= WIDTH) x = WIDTH - 1;
+	if (y < 0) y = 0;
+	if (y >= HEIGHT) y = HEIGHT - 1;
+
+	i = INDEX2(x, y) * 2;
+	*ux = table[i];
+	*uy = table[i + 1];
+}
+
+/**
+ * Move the center of mass of the given slice to its undistorted
+ * position and recalculate the error. Empty slices are left untouched.
+ * The sub-pixel part of the centroid is kept (the correction is 
+ * looked up for the whole pixel).
+ */
+void undistort_slice(slice_t * pt)
+{
+	int ux, uy;
+
+	if (!enabled || pt->mass == 0)
+	{
+		return;
+	}
+
+	undistort_point(pt->x, pt->y, &ux, &uy);
+	slice_set_centroid(pt, 
+		(ux << (SLICE_SHIFT - UNDISTORT_SHIFT)) + pt->xq - (pt->x << SLICE_SHIFT),
+		(uy << (SLICE_SHIFT - UNDISTORT_SHIFT)) + pt->yq - (pt->y << SLICE_SHIFT));
+}
+
+/**
+ * Move the centroids of the two branches of a fork to their undistorted
+ * positions. Nothing is done if no fork was found.
+ */
+void undistort_branches(track_branches_t * br)
+{
+	int ux, uy;
+
+	if (!enabled || br->rows == 0)
+	{
+		return;
+	}
+
+	undistort_point(br->left_x, br->left_y, &ux, &uy);
+	br->left_x = (ux + UNDISTORT_ONE / 2) >> UNDISTORT_SHIFT;
+	br->left_y = (uy + UNDISTORT_ONE / 2) >> UNDISTORT_SHIFT;
+
+	undistort_point(br->right_x, br->right_y, &ux, &uy);
+	br->right_x = (ux + UNDISTORT_ONE / 2) >> UNDISTORT_SHIFT;
+	br->right_y = (uy + UNDISTORT_ONE / 2) >> UNDISTORT_SHIFT;
+}
+
+/**
+ * Clip the parameter range [t0,t1] of the line p + t*d to the half-plane
+ * where p + t*d >= lo (one coordinate).
+ */
+static int clip(double p, double d, double lo, double * t0, double * t1)
+{
+	double t;
+
+	if (d == 0)
+	{
+		return p >= lo;
+	}
+	t = (lo - p) / d;
+	if (d > 0 && t > *t0) *t0 = t;
+	if (d < 0 && t < *t1) *t1 = t;
+	return *t0 < *t1;
+}
+
+/**
+ * Correct a fitted line. The line is clipped to the image, two points a
+ * quarter from the ends of the visible part are undistorted, and the
+ * line through the corrected points is converted back to normal form.
+ * The normal keeps pointing the same way as the fitted one. Lines that
+ * do not cross the image are left untouched.
+ */
+void undistort_line(hough_line_t * line)
+{
+	double a, c, s, px, py, t0 = -1e9, t1 = 1e9, t, x[2], y[2], nx, ny, len;
+	int i, ux, uy;
+
+	if (!enabled || line->votes == 0)
+	{
+		return;
+	}
+
+	// Closest point to the bottom center, and the direction of the line
+	// (in pixels, relative to the bottom center of the image)
+	a = line->angle * PI / 180.0;
+	c = cos(a);
+	s = sin(a);
+	px = line->offset * c;
+	py = line->offset * s;
+
+	if (!clip(px, -s, -WIDTH / 2, &t0, &t1) ||
+		!clip(-px, s, -(WIDTH / 2 - 1), &t0, &t1) ||
+		!clip(py, c, -HEIGHT, &t0, &t1) ||
+		!clip(-py, -c, 1, &t0, &t1))
+	{
+		return;
+	}
+
+	for (i = 0; i < 2; i++)
+	{
+		t = t0 + (t1 - t0) * (1 + 2 * i) / 4;
+		undistort_point((int) lround(px - t * s) + WIDTH / 2,
+			(int) lround(py + t * c) + HEIGHT, &ux, &uy);
+		x[i] = (double) ux / UNDISTORT_ONE - WIDTH / 2;
+		y[i] = (double) uy / UNDISTORT_ONE - HEIGHT;
+	}
+
+	nx = y[1] - y[0];
+	ny = x[0] - x[1];
+	len = sqrt(nx * nx + ny * ny);
+	if (len == 0)
+	{
+		return;
+	}
+	if (nx * c + ny * s < 0)
+	{
+		nx = -nx;
+		ny = -ny;
+	}
+	nx /= len;
+	ny /= len;
+
+	line->angle = (int) lround(atan2(ny, nx) * 180.0 / PI);
+	line->offset = (int) lround(x[0] * nx + y[0] * ny);
+}
+
+/**
+ * Free the correction table
+ */
+void undistort_release()
+{
+	free(table);
+	table = NULL;
+	enabled = 0;
+}
+
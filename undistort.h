@@ -0,0 +1,33 @@
+
+#ifndef _UNDISTORT_H_
+#define _UNDISTORT_H_
+
+#include "image.h"
+#include "track.h"
+#include "hough.h"
+
+/**
+ * Fixed-point precision of the correction table (1/16 pixel)
+ */
+#define UNDISTORT_SHIFT			4
+#define UNDISTORT_ONE			(1 << UNDISTORT_SHIFT)
+
+/**
+ * Pinhole camera intrinsics and Brown-Conrady distortion coefficients.
+ */
+typedef struct cam_model {
+	float fx, fy, cx, cy;
+	float k1, k2, k3;
+	float p1, p2;
+} cam_model_t;
+
+int undistort_update(const cam_model_t * model, int enable);
+int undistort_enabled();
+void undistort_point(int x, int y, int * ux, int * uy);
+void undistort_slice(slice_t * pt);
+void undistort_branches(track_branches_t * br);
+void undistort_line(hough_line_t * line);
+void undistort_release();
+
+#endif
+
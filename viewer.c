@@ -13,6 +13,9 @@
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 
+#include "telemetry.h"
+#include "receiver.h"
+
 #define SERVER_PORT         "24000"
 #define SERVER_HOSTNAME     "10.42.0.71"
 
@@ -46,6 +49,11 @@ static unsigned char * img_buffer;//[N_IMG_BYTES];
 static unsigned char * img_disp_buffer;
 // Buffer used when reading the image over socket
 static unsigned char * read_buffer;//[WIDTH * HEIGHT + PADDING];
+// Region of the image as last received
+static unsigned char * roi_buffer;
+
+// Packets received from the server
+static receiver_t rx;
 
 static unsigned char * scaled_up_img;
 static unsigned char * scaled_up_img_dbl;
@@ -225,6 +233,36 @@ static void upscale_image()
     }
 }
 
+/**
+ * Decode the payload into its region of read_buffer. The region is 
+ * decoded in roi_buffer first, where a delta is applied to the previous
+ * image of the region.
+ *
+ * Returns 0 on success, -1 if the image can't be decoded.
+ */
+static int decode_image(const telemetry_fields_t * fields, 
+    const unsigned char * payload, int size)
+{
+    int y, ret;
+
+    if (fields->width == 0 || fields->x + fields->width > WIDTH 
+        || fields->y + fields->height > HEIGHT)
+    {
+        return -1;
+    }
+
+    ret = receiver_decode(fields, payload, size, roi_buffer);
+    if (ret == 0)
+    {
+        for (y = 0; y < fields->height; y++)
+        {
+            memcpy(read_buffer + (fields->y + y) * WIDTH + fields->x,
+                roi_buffer + y * fields->width, fields->width);
+        }
+    }
+    return ret;
+}
+
 static exitp(const char * msg)
 {
     perror(msg);
@@ -235,12 +273,63 @@ int main(int argc, char* argv[])
 {
     struct timeval begin, now;
     long counter;
+    unsigned long long bytes;
+    const char * encodings[] = { "raw", "bits", "rle", "delta" };
+    telemetry_subscription_t sub;
+    unsigned int x, y, w, h;
+    int i;
+
+    // Every third frame, whole, as deltas
+    memset(&sub, 0, sizeof(sub));
+    sub.divisor = 3;
+    sub.encoding = TELEMETRY_DELTA;
+    sub.fields = TELEMETRY_FIELD_RESULT | TELEMETRY_FIELD_IMAGE;
+
+    // Usage: viewer [-e raw|bits|rle|delta] [-r divisor] [-c x,y,w,h]
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-e") == 0 && i + 1 < argc)
+        {
+            i++;
+            for (sub.encoding = 0; sub.encoding < TELEMETRY_ENCODINGS; sub.encoding++)
+            {
+                if (strcmp(argv[i], encodings[sub.encoding]) == 0)
+                {
+                    break;
+                }
+            }
+            if (sub.encoding == TELEMETRY_ENCODINGS)
+            {
+                fprintf(stderr, "Unknown encoding %s\n", argv[i]);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+        {
+            sub.divisor = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc
+            && sscanf(argv[++i], "%u,%u,%u,%u", &x, &y, &w, &h) == 4)
+        {
+            sub.x = x;
+            sub.y = y;
+            sub.width = w;
+            sub.height = h;
+        }
+        else
+        {
+            fprintf(stderr, "Usage: %s [-e raw|bits|rle|delta] [-r divisor] "
+                "[-c x,y,w,h]\n", argv[0]);
+            exit(1);
+        }
+    }
 
     printf("\n -- EYEBOT Viewer -- \n\n");
 
     // Allocate buffers
     img_buffer = malloc(SIZE * CHANNELS);
-    read_buffer = malloc(SIZE + PADDING);
+    read_buffer = calloc(1, SIZE + PADDING);
+    roi_buffer = malloc(SIZE);
 
     scaled_up_img = malloc(UP_S * CHANNELS);
     scaled_up_img_dbl = malloc(UP_S * CHANNELS);
@@ -316,83 +405,67 @@ int main(int argc, char* argv[])
         tv.tv_usec = 0; 
         setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv, sizeof(struct timeval));
 
+        // Start with an empty receive buffer
+        receiver_free(&rx);
+        receiver_init(&rx, socket_fd);
+
+        if (receiver_subscribe(socket_fd, &sub) < 0)
+        {
+            perror("send");
+        }
+        printf("Every %d frame(s), %s encoding\n", sub.divisor, 
+            encodings[sub.encoding]);
+
         // Measure time at beginning
         counter = 0;
+        bytes = 0;
         gettimeofday(&begin, NULL);
 
         // Frame update loop
         while (1)
         {
             int bytes_read;
-            int total = 0;
-            unsigned int x = 0, y = 0, error, error_upper, mass;
+            int error, error_upper, mass;
             int l_x, l_y, u_x, u_y;
+            telemetry_header_t header;
+            telemetry_fields_t fields;
+            unsigned char * payload;
 
-            fd_set fds;
-            FD_ZERO(&fds);
-            FD_SET(socket_fd, &fds);
-
-            struct timeval timeout;
-            timeout.tv_sec = 6 * 60;
-            timeout.tv_usec = 0;
-
-            if (select(sizeof(fds) * 8, &fds, NULL, NULL, &timeout) < 0)
-            {
-                exitp("select()");
-            }
-
-            if (read(socket_fd, &l_x, sizeof(l_x)) < 0)
-            {
-                exitp("read() (error x)");
-            }
-
-            if (read(socket_fd, &l_y, sizeof(l_y)) < 0)
-            {
-                exitp("read() (error y)");
-            }
-
-            if (read(socket_fd, &u_x, sizeof(u_x)) < 0)
-            {
-                exitp("read() (error x)");
-            }
-
-            if (read(socket_fd, &u_y, sizeof(u_y)) < 0)
+            bytes_read = receiver_read(&rx, &header, &fields, &payload);
+            if (bytes_read < 0)
             {
-                exitp("read() (error y)");
+                printf("Connection lost - retrying!\n");
+                close(socket_fd);
+                break;
             }
-
-            if (read(socket_fd, &error, sizeof(error)) < 0)
+            if (rx.skipped > 0)
             {
-                exitp("read() (error)");
+                printf("Skipped %lu bytes to find the next packet\n", rx.skipped);
+                rx.skipped = 0;
             }
-
-            if (read(socket_fd, &error_upper, sizeof(error_upper)) < 0)
+            if (header.magic != TELEMETRY_MAGIC)
             {
-                exitp("read() (error)");
+                continue;
             }
 
+            l_x = fields.l_x;
+            l_y = fields.l_y;
+            u_x = fields.u_x;
+            u_y = fields.u_y;
+            error = fields.error_lower;
+            error_upper = fields.error_upper;
+            mass = fields.mass;
 
-            if (read(socket_fd, &mass, sizeof(mass)) < 0)
-            {
-                exitp("read() (error mass)");
-            }
-
-            // Clear the read buffer
-            memset(read_buffer, 0, SIZE);
+            bytes += header.length;
 
-            //
-            // Read the 76800 bytes a frame consist of
-            //
-            
-            bytes_read = recv(socket_fd, read_buffer, SIZE, MSG_WAITALL);
-            if (bytes_read < 0)
+            if (decode_image(&fields, payload, bytes_read) < 0)
             {
-                perror("recv");
-                break;
+                printf("Can't decode image %u (encoding %d)\n", header.seq, 
+                    fields.encoding);
             }
-            else if (bytes_read == SIZE)
+            else
             {
-                copy_to_x_buffer(read_buffer, bytes_read);
+                copy_to_x_buffer(read_buffer, SIZE);
                 draw_center_point(l_x, l_y, 0, 0, 255);
                 draw_center_point(u_x, u_y, 0, 255, 0);
                 draw_center_lines();
@@ -455,14 +528,13 @@ int main(int argc, char* argv[])
                 sprintf(b, "FPS: %.2f", ((counter / elapsed) * 3));
                 XDrawString(display, window, DefaultGC(display, 0), 150, 280, b, strlen(b));
 
+                memset(b, 0, sizeof(b));
+                sprintf(b, "%s: %llu B/frame", encodings[fields.encoding % TELEMETRY_ENCODINGS], 
+                    bytes / (counter + 1));
+                XDrawString(display, window, DefaultGC(display, 0), 150, 295, b, strlen(b));
+
                 counter++;
             }
-            else
-            {   
-                printf("Connection lost - retrying!\n");
-                close(socket_fd);
-                break;
-            }
         }
     }
 
@@ -0,0 +1,214 @@
+
+/**
+ * Compare the threshold and edge line detectors on recorded frames.
+ *
+ * Usage: vision_bench [-n iterations] frame.pgm ...
+ *
+ * Frames are gray 320x240 PGM files (P2 or P5), e.g. recorded with the
+ * `dumpgray` shell command. The thresholds, bands and slices are taken
+ * from eyebot.conf in the current directory. For every frame the
+ * centroids of both detectors are printed, followed by the average time
+ * per frame and the average centroid difference.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "configuration.h"
+#include "image.h"
+#include "edge.h"
+#include "timer.h"
+
+static int load_pgm(const char * file, unsigned char * gray)
+{
+	char magic[3] = { 0 };
+	int w, h, max, c, i, v;
+	FILE * fp;
+
+	fp = fopen(file, "rb");
+	if (fp == NULL)
+	{
+		perror(file);
+		return -1;
+	}
+
+	if (fscanf(fp, "%2s", magic) != 1)
+	{
+		goto error;
+	}
+
+	// Skip comments in the header
+	for (i = 0; i < 3; i++)
+	{
+		while ((c = fgetc(fp)) == ' ' || c == '\n' || c == '\r' || c == '\t')
+			;
+		if (c == '#')
+		{
+			while ((c = fgetc(fp)) != '\n' && c != EOF)
+				;
+			i--;
+			continue;
+		}
+		ungetc(c, fp);
+		if (fscanf(fp, "%d", i == 0 ? &w : (i == 1 ? &h : &max)) != 1)
+		{
+			goto error;
+		}
+	}
+
+	if (w != WIDTH || h != HEIGHT || max != 255)
+	{
+		fprintf(stderr, "%s: expected %dx%d 8-bit image\n", file, WIDTH,
+			HEIGHT);
+		goto error;
+	}
+
+	if (strcmp(magic, "P5") == 0)
+	{
+		fgetc(fp);
+		if (fread(gray, 1, IMG_SIZE, fp) != IMG_SIZE)
+		{
+			goto error;
+		}
+	}
+	else if (strcmp(magic, "P2") == 0)
+	{
+		for (i = 0; i < IMG_SIZE; i++)
+		{
+			if (fscanf(fp, "%d", &v) != 1)
+			{
+				goto error;
+			}
+			gray[i] = (unsigned char) v;
+		}
+	}
+	else
+	{
+		goto error;
+	}
+
+	fclose(fp);
+	return 0;
+
+error:
+	fprintf(stderr, "%s: unable to read PGM file\n", file);
+	fclose(fp);
+	return -1;
+}
+
+static void detect_threshold(const unsigned char * gray, unsigned char * bin)
+{
+	int i;
+
+	for (i = 0; i < conf.n_threshold_bands - 1; i++)
+	{
+		extract_slice(gray, bin, conf.threshold_bands[i],
+			conf.threshold_bands[i + 1], 0);
+	}
+}
+
+static void detect_edge(const unsigned char * gray, unsigned char * bin)
+{
+	edge_detect(gray, bin, conf.threshold_bands[0],
+		conf.threshold_bands[conf.n_threshold_bands - 1],
+		conf.edge_threshold, conf.edge_max_width);
+}
+
+/**
+ * Run a detector `n` times on the frame followed by the center of mass
+ * calculation.
+ *
+ * \return Average time in microseconds
+ */
+static long long run(void (*detect)(const unsigned char *, unsigned char *),
+	const unsigned char * gray, unsigned char * bin, int n,
+	slice_t * upper, slice_t * lower)
+{
+	long long start;
+	int i;
+
+	start = timer_now_us();
+	for (i = 0; i < n; i++)
+	{
+		detect(gray, bin);
+		calculate_center_of_mass(bin, upper, conf.slice_upper_start,
+			conf.slice_upper_end);
+		calculate_center_of_mass(bin, lower, conf.slice_lower_start,
+			conf.slice_lower_end);
+	}
+	return (timer_now_us() - start) / n;
+}
+
+int main(int argc, char ** argv)
+{
+	static unsigned char gray[IMG_SIZE], bin[IMG_SIZE];
+	slice_t tu, tl, eu, el;
+	long long t_thr = 0, t_edge = 0;
+	int i, n = 100, frames = 0, both = 0, dx = 0;
+
+	if (argc > 2 && strcmp(argv[1], "-n") == 0)
+	{
+		n = atoi(argv[2]);
+		argv += 2;
+		argc -= 2;
+	}
+	if (argc < 2 || n < 1)
+	{
+		fprintf(stderr, "Usage: %s [-n iterations] frame.pgm ...\n", argv[0]);
+		return 1;
+	}
+
+	config_init();
+	if (conf.n_threshold_bands < 2)
+	{
+		fprintf(stderr, "At least two threshold band boundaries needed\n");
+		return 1;
+	}
+
+	printf("%-24s %16s %16s %16s %16s\n", "frame", "thr upper", "thr lower",
+		"edge upper", "edge lower");
+
+	for (i = 1; i < argc; i++)
+	{
+		if (load_pgm(argv[i], gray) < 0)
+		{
+			continue;
+		}
+
+		memset(bin, FLOOR, IMG_SIZE);
+		t_thr += run(detect_threshold, gray, bin, n, &tu, &tl);
+		memset(bin, FLOOR, IMG_SIZE);
+		t_edge += run(detect_edge, gray, bin, n, &eu, &el);
+		frames++;
+
+		printf("%-24s %5d,%3d %6d %5d,%3d %6d %5d,%3d %6d %5d,%3d %6d\n",
+			argv[i], tu.x, tu.y, tu.mass, tl.x, tl.y, tl.mass,
+			eu.x, eu.y, eu.mass, el.x, el.y, el.mass);
+
+		// Compare the lower centroid when both detectors found the line
+		if (tl.mass > 0 && el.mass > 0)
+		{
+			dx += abs(tl.x - el.x);
+			both++;
+		}
+	}
+
+	if (frames == 0)
+	{
+		return 1;
+	}
+
+	printf("\nFrames: %d, iterations: %d\n", frames, n);
+	printf("threshold: %lld us/frame\n", t_thr / frames);
+	printf("edge:      %lld us/frame\n", t_edge / frames);
+	if (both > 0)
+	{
+		printf("Lower centroid difference: %.1f px (%d frames)\n",
+			(float) dx / both, both);
+	}
+
+	return 0;
+}
+